@@ -0,0 +1,66 @@
+/*
+ * affinity.h
+ *
+ * Which CPUs may we run on, and pinning threads to them.
+ * - The number of online CPUs is not the number we can use. A
+ *   container, taskset or a cgroup cpuset can give us fewer, and
+ *   not necessarily CPUs 0..n-1. Pinning thread i to CPU i then
+ *   either fails or puts it on a CPU somebody else was given.
+ * - sched_getaffinity() tells us which ones are ours. Read it once,
+ *   before starting any threads (they inherit it, and pinning one
+ *   changes its own), and hand thread i the i-th CPU in there.
+ *   More threads than CPUs wrap around.
+ *
+ * Header only. Just #include it.
+ */
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+
+#include <stdio.h>
+#include <sched.h>
+#include <pthread.h>
+
+// Fills cpus with the CPUs the calling thread may run on, lowest
+// first. cpus has room for CPU_SETSIZE.
+// Returns how many there are, 0 if we couldn't find out.
+static inline int affinity_cpus (int *cpus)
+{
+    cpu_set_t   mask;
+    int         count = 0;
+    int         cpu = 0;
+
+    CPU_ZERO(&mask);
+    if (sched_getaffinity(0, sizeof(mask), &mask) < 0)
+    {
+        printf("sched_getaffinity() failed, threads won't be pinned\n");
+        return 0;
+    }
+
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &mask))
+        {
+            cpus[count] = cpu;
+            count += 1;
+        }
+    }
+    return count;
+}
+
+// Pins the calling thread to cpu. -1 leaves it where it is.
+// Returns what pthread_setaffinity_np returns.
+static inline int affinity_pin (int cpu)
+{
+    cpu_set_t   mask;
+
+    if (cpu < 0)
+    {
+        return 0;
+    }
+
+    CPU_ZERO(&mask);
+    CPU_SET(cpu, &mask);
+    return pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+}
+
+#endif /* __AFFINITY_H__ */
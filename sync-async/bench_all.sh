@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# bench_all.sh
+#
+# Runs load_gen.c against each server on loopback and prints
+# a comparison table.
+#
+# Usage: $ ./bench_all.sh [connections] [seconds] [load_gen options...]
+#   e.g. $ ./bench_all.sh 20 5
+#        $ ./bench_all.sh 20 5 --rate 10000
+#
+# - server_v1.c to server_v4.c serve one request per connection,
+#   so they are run with --hello.
+# - Servers which can't serve all connections at once (echo_server_v0.c
+#   serves one client at a time) show up with unfinished requests.
+#   Their latency includes the time those requests waited.
+# - Entries ending in .rs are Rust servers, built with rustc.
+#   Skipped if rustc isn't around.
+# - Every server gets a fresh port, so that a previous run's
+#   TIME_WAIT sockets don't get in the way of bind().
+
+CONNECTIONS=${1:-10}
+SECONDS_PER_RUN=${2:-5}
+shift 2 2>/dev/null
+EXTRA_ARGS="$@"
+
+HOST=127.0.0.1
+PORT=$((20000 + RANDOM % 20000))
+SRC_DIR=$(cd "$(dirname "$0")" && pwd)
+BUILD_DIR=$(mktemp -d)
+
+# name:server arguments after host and port:load_gen mode
+SERVERS="
+server_v1::--hello
+server_v2::--hello
+server_v3::--hello
+server_v4::--hello
+echo_server_v0::
+echo_server_v1::
+echo_server_v2::
+echo_server_v3::
+echo_server_v1.rs::
+"
+
+trap 'rm -rf "$BUILD_DIR"' EXIT
+
+gcc -O2 -pthread -o "$BUILD_DIR/load_gen" "$SRC_DIR/load_gen.c" || exit 1
+
+printf "%-18s %10s %10s %10s %10s %10s %8s %10s\n" \
+       "server" "req/s" "p50(us)" "p99(us)" "p99.9(us)" "max(us)" "errors" "unfinished"
+
+for entry in $SERVERS
+do
+    name=$(echo "$entry" | cut -d: -f1)
+    server_args=$(echo "$entry" | cut -d: -f2)
+    mode=$(echo "$entry" | cut -d: -f3)
+
+    case "$name" in
+        *.rs) build="rustc -O -o $BUILD_DIR/$name $SRC_DIR/$name" ;;
+        *)    build="gcc -O2 -pthread -o $BUILD_DIR/$name $SRC_DIR/$name.c" ;;
+    esac
+
+    if ! $build 2>/dev/null
+    then
+        printf "%-18s build failed\n" "$name"
+        continue
+    fi
+
+    # The servers print on every event. Not what we are measuring.
+    "$BUILD_DIR/$name" $HOST $PORT $server_args > /dev/null 2>&1 &
+    server_pid=$!
+    sleep 0.5
+
+    result=$(timeout $((SECONDS_PER_RUN + 30)) "$BUILD_DIR/load_gen" $HOST $PORT \
+             $CONNECTIONS $SECONDS_PER_RUN $mode $EXTRA_ARGS | grep "^RESULT")
+
+    kill $server_pid 2>/dev/null
+    wait $server_pid 2>/dev/null
+    PORT=$((PORT + 1))
+
+    if [ -z "$result" ]
+    then
+        printf "%-18s no result\n" "$name"
+        continue
+    fi
+
+    set -- $result
+    printf "%-18s %10s %10s %10s %10s %10s %8s %10s\n" "$name" $2 $3 $4 $5 $6 $7 $8
+done
@@ -0,0 +1,131 @@
+/*
+ * buf_pool.h
+ *
+ * Pool of fixed-size I/O buffers.
+ * - The servers used to have a 10,000 byte buffer on the stack in
+ *   serve_connection, zeroed on every call.
+ * - Here buffers are carved out of big slabs and kept on a free list.
+ *   A connection leases a buffer when it has something to do and
+ *   returns it once it goes idle. So idle connections hold no buffer.
+ * - Buffers are not zeroed. Whoever leases one knows how many bytes
+ *   it wrote into it.
+ * - The free list is a stack. The buffer returned last is handed out
+ *   first - it is most likely still in the cache.
+ * - Not thread-safe. Use one pool per thread.
+ *
+ * Header only. Just #include it.
+ */
+#ifndef __BUF_POOL_H__
+#define __BUF_POOL_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Size of one buffer. A server can pick its own by
+// defining this before including the file.
+#ifndef BUF_POOL_BUF_SIZE
+#define BUF_POOL_BUF_SIZE       16384
+#endif
+
+// Number of buffers allocated in one go.
+#define BUF_POOL_SLAB_BUFS      64
+
+// A buffer. While it is free, the first bytes hold the free list link.
+typedef struct pool_buf
+{
+    union
+    {
+        struct pool_buf     *next_free;
+        uint8_t             data[BUF_POOL_BUF_SIZE];
+    };
+} pool_buf_t;
+
+// A slab. Buffers are never given back to the system,
+// only to the pool.
+typedef struct pool_slab
+{
+    struct pool_slab    *next;
+    pool_buf_t          bufs[BUF_POOL_SLAB_BUFS];
+} pool_slab_t;
+
+typedef struct buf_pool
+{
+    pool_buf_t      *free_list;
+    pool_slab_t     *slabs;
+
+    // Counters. Used to find memory per connection.
+    uint64_t        total_bufs;
+    uint64_t        leased_bufs;
+    uint64_t        max_leased_bufs;
+} buf_pool_t;
+
+static inline void buf_pool_init (buf_pool_t *pool)
+{
+    memset(pool, '\0', sizeof(buf_pool_t));
+}
+
+// Allocates another slab and puts its buffers on the free list.
+static int buf_pool_grow (buf_pool_t *pool)
+{
+    pool_slab_t     *slab = NULL;
+    int             i = 0;
+
+    // Page aligned, so that buffers don't share cache lines
+    // with anything else.
+    slab = aligned_alloc(4096, (sizeof(pool_slab_t) + 4095) & ~(size_t)4095);
+    if (slab == NULL)
+    {
+        return -1;
+    }
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+
+    for (i = BUF_POOL_SLAB_BUFS - 1; i >= 0; i--)
+    {
+        slab->bufs[i].next_free = pool->free_list;
+        pool->free_list = &slab->bufs[i];
+    }
+    pool->total_bufs += BUF_POOL_SLAB_BUFS;
+    return 0;
+}
+
+// Hands out a buffer. Contents are whatever the last user left.
+static inline uint8_t* buf_pool_lease (buf_pool_t *pool)
+{
+    pool_buf_t  *buf = NULL;
+
+    if (pool->free_list == NULL)
+    {
+        if (buf_pool_grow(pool) < 0)
+        {
+            // No memory - system may not be doing good.
+            // kill the server.
+            printf("aligned_alloc() failed. Exiting...\n");
+            exit(-1);
+        }
+    }
+
+    buf = pool->free_list;
+    pool->free_list = buf->next_free;
+
+    pool->leased_bufs += 1;
+    if (pool->leased_bufs > pool->max_leased_bufs)
+    {
+        pool->max_leased_bufs = pool->leased_bufs;
+    }
+    return buf->data;
+}
+
+static inline void buf_pool_return (buf_pool_t *pool, uint8_t *data)
+{
+    pool_buf_t  *buf = (pool_buf_t *)data;
+
+    buf->next_free = pool->free_list;
+    pool->free_list = buf;
+    pool->leased_bufs -= 1;
+}
+
+#endif /* __BUF_POOL_H__ */
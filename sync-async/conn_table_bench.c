@@ -0,0 +1,342 @@
+/*
+ * conn_table_bench.c
+ *
+ * What does the client loop of a poll server cost per connection,
+ * depending on how the connection table is laid out?
+ * No sockets - 100k connections is more than the descriptor limit
+ * allows here, and poll() itself would drown out the difference. We
+ * fill in revents the way poll() would and time the walk that follows
+ * (echo_server_v3.c's client loop):
+ * - aos:   everything about a connection in one struct, in slot order.
+ *          Like pollfd + conn_t + timer node + counters in one.
+ * - byfd:  pollfd list in slot order, conn_t indexed by descriptor.
+ *          Every slot's conn_t is read to check its timed_out flag.
+ *          echo_server_v3.c before the hot/cold split.
+ * - soa:   pollfd list and a flags byte per slot in slot order, conn_t
+ *          indexed by descriptor and read only for ready slots.
+ *          echo_server_v3.c now.
+ * Slots and descriptors are shuffled against each other, like they
+ * are after a while of connections coming and going.
+ *
+ * Cache misses come from perf_event_open, counting only the walk. Where
+ * the hardware counters aren't available (most VMs), only times are
+ * printed.
+ *
+ * Usage: $ ./conn_table_bench [connections] [ready-per-round] [rounds]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "out_ring.h"
+
+// Everything in one place.
+typedef struct conn_aos
+{
+    struct pollfd       pfd;
+    uint8_t             flags;
+    bool                paused;
+    bool                read_closed;
+    bool                got_data;
+
+    // Timer wheel node.
+    uint64_t            expires;
+    int32_t             prev;
+    int32_t             next;
+
+    struct sockaddr_in  peer;
+    uint64_t            bytes_in;
+    uint64_t            bytes_out;
+    out_ring_t          out;
+} conn_aos_t;
+
+// echo_server_v3.c's conn_t, with timed_out still in it.
+typedef struct conn_byfd
+{
+    out_ring_t          out;
+    bool                paused;
+    bool                read_closed;
+    bool                got_data;
+    bool                timed_out;
+    bool                corked;
+} conn_byfd_t;
+
+// echo_server_v3.c's conn_t now.
+typedef struct conn_cold
+{
+    out_ring_t          out;
+    bool                paused;
+    bool                read_closed;
+    bool                got_data;
+    bool                corked;
+    struct sockaddr_in  peer;
+} conn_cold_t;
+
+#define TIMED_OUT       0x01
+
+// A hardware counter, or -1.
+typedef struct counter
+{
+    int         fd;
+    uint64_t    total;
+} counter_t;
+
+uint64_t now_ns ()
+{
+    struct timespec     ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void counter_open (counter_t *counter, uint32_t type, uint64_t config)
+{
+    struct perf_event_attr  attr;
+
+    memset(&attr, '\0', sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    counter->fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    counter->total = 0;
+}
+
+void counter_start (counter_t *counter)
+{
+    if (counter->fd >= 0)
+    {
+        ioctl(counter->fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(counter->fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+void counter_stop (counter_t *counter)
+{
+    uint64_t    value = 0;
+
+    if (counter->fd >= 0)
+    {
+        ioctl(counter->fd, PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counter->fd, &value, sizeof(value)) == sizeof(value))
+        {
+            counter->total += value;
+        }
+    }
+}
+
+// xorshift. Same sequence for every layout.
+static uint64_t     rng_state;
+
+uint64_t rng_next ()
+{
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+int main (int argc, char **argv)
+{
+    uint64_t        count = (argc > 1) ? strtoull(argv[1], NULL, 10) : 100000;
+    uint64_t        ready = (argc > 2) ? strtoull(argv[2], NULL, 10) : 100;
+    uint64_t        rounds = (argc > 3) ? strtoull(argv[3], NULL, 10) : 2000;
+    const char      *names[] = { "aos", "byfd", "soa" };
+    int             layout = 0;
+    uint64_t        round = 0;
+    uint64_t        i = 0;
+    uint64_t        j = 0;
+    uint64_t        tmp = 0;
+    uint64_t        events = 0;
+    uint64_t        elapsed = 0;
+    uint64_t        start = 0;
+    uint64_t        *ready_slots = NULL;
+    int32_t         *slot_fd = NULL;
+    conn_aos_t      *aos = NULL;
+    struct pollfd   *list = NULL;
+    uint8_t         *flags = NULL;
+    conn_byfd_t     *byfd = NULL;
+    conn_cold_t     *cold = NULL;
+    uint64_t        sink = 0;
+    counter_t       l1_misses;
+    counter_t       llc_misses;
+
+    if (count == 0 || ready > count || rounds == 0)
+    {
+        printf("need 0 < ready-per-round <= connections and rounds > 0\n");
+        return -1;
+    }
+
+    ready_slots = calloc(ready, sizeof(uint64_t));
+    slot_fd = calloc(count, sizeof(int32_t));
+    aos = calloc(count, sizeof(conn_aos_t));
+    list = calloc(count, sizeof(struct pollfd));
+    flags = calloc(count, sizeof(uint8_t));
+    byfd = calloc(count, sizeof(conn_byfd_t));
+    cold = calloc(count, sizeof(conn_cold_t));
+    if (ready_slots == NULL || slot_fd == NULL || aos == NULL || list == NULL ||
+        flags == NULL || byfd == NULL || cold == NULL)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+
+    // Descriptors, shuffled over the slots.
+    for (i = 0; i < count; i++)
+    {
+        slot_fd[i] = i;
+    }
+    rng_state = 88172645463325252ULL;
+    for (i = count - 1; i > 0; i--)
+    {
+        j = rng_next() % (i + 1);
+        tmp = slot_fd[i];
+        slot_fd[i] = slot_fd[j];
+        slot_fd[j] = tmp;
+    }
+    for (i = 0; i < count; i++)
+    {
+        aos[i].pfd.fd = slot_fd[i];
+        list[i].fd = slot_fd[i];
+    }
+
+    counter_open(&l1_misses, PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                 (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+    counter_open(&llc_misses, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+
+    printf("%lu connections, %lu ready per round, %lu rounds\n", count, ready, rounds);
+    printf("sizes: conn_aos_t %lu, pollfd + conn_byfd_t %lu + %lu, pollfd + flags + conn_cold_t %lu + 1 + %lu\n",
+           sizeof(conn_aos_t), sizeof(struct pollfd), sizeof(conn_byfd_t),
+           sizeof(struct pollfd), sizeof(conn_cold_t));
+    printf("%-6s %12s %12s %14s %14s\n", "layout", "ns/conn", "ns/event", "L1 miss/event", "LLC miss/event");
+
+    for (layout = 0; layout < 3; layout++)
+    {
+        rng_state = 2463534242ULL;
+        elapsed = 0;
+        events = 0;
+        l1_misses.total = 0;
+        llc_misses.total = 0;
+
+        for (round = 0; round < rounds; round++)
+        {
+            // What poll() would do: revents for the ready ones.
+            for (i = 0; i < ready; i++)
+            {
+                ready_slots[i] = rng_next() % count;
+                if (layout == 0)
+                {
+                    aos[ready_slots[i]].pfd.revents = POLLIN;
+                }
+                else
+                {
+                    list[ready_slots[i]].revents = POLLIN;
+                }
+            }
+
+            start = now_ns();
+            counter_start(&l1_misses);
+            counter_start(&llc_misses);
+
+            // The client loop. A ready connection gets its
+            // state touched and its interest recomputed.
+            if (layout == 0)
+            {
+                for (i = 0; i < count; i++)
+                {
+                    if (aos[i].pfd.revents == 0)
+                    {
+                        sink += (aos[i].flags & TIMED_OUT);
+                        continue;
+                    }
+                    aos[i].got_data = true;
+                    aos[i].bytes_in += 64;
+                    aos[i].pfd.events = (out_ring_len(&aos[i].out) > 0) ? POLLIN | POLLOUT : POLLIN;
+                    aos[i].pfd.revents = 0;
+                    aos[i].flags &= ~TIMED_OUT;
+                    events += 1;
+                }
+            }
+            else if (layout == 1)
+            {
+                for (i = 0; i < count; i++)
+                {
+                    conn_byfd_t     *conn = &byfd[list[i].fd];
+
+                    if (conn->timed_out && list[i].revents == 0)
+                    {
+                        sink += 1;
+                        continue;
+                    }
+                    if (list[i].revents == 0)
+                    {
+                        continue;
+                    }
+                    conn->got_data = true;
+                    list[i].events = (out_ring_len(&conn->out) > 0) ? POLLIN | POLLOUT : POLLIN;
+                    list[i].revents = 0;
+                    conn->timed_out = false;
+                    events += 1;
+                }
+            }
+            else
+            {
+                for (i = 0; i < count; i++)
+                {
+                    conn_cold_t     *conn = NULL;
+
+                    if (list[i].revents == 0)
+                    {
+                        sink += (flags[i] & TIMED_OUT);
+                        continue;
+                    }
+                    conn = &cold[list[i].fd];
+                    conn->got_data = true;
+                    list[i].events = (out_ring_len(&conn->out) > 0) ? POLLIN | POLLOUT : POLLIN;
+                    list[i].revents = 0;
+                    flags[i] &= ~TIMED_OUT;
+                    events += 1;
+                }
+            }
+
+            counter_stop(&l1_misses);
+            counter_stop(&llc_misses);
+            elapsed += now_ns() - start;
+        }
+
+        // A slot picked twice in a round is one event, not two.
+        printf("%-6s %12.2f %12.1f ", names[layout],
+               (double)elapsed / (count * rounds), (double)elapsed / events);
+        if (l1_misses.fd >= 0)
+        {
+            printf("%14.1f ", (double)l1_misses.total / events);
+        }
+        else
+        {
+            printf("%14s ", "n/a");
+        }
+        if (llc_misses.fd >= 0)
+        {
+            printf("%14.1f\n", (double)llc_misses.total / events);
+        }
+        else
+        {
+            printf("%14s\n", "n/a");
+        }
+    }
+
+    // Keep the compiler from dropping the timed out checks.
+    return (sink == 42) ? 1 : 0;
+}
@@ -0,0 +1,285 @@
+/*
+ * connect_bench.c
+ *
+ * Connection-rate benchmark.
+ * - Fires --burst connects at once (non-blocking), like a crowd of
+ *   clients showing up together. Each connection sends one byte and
+ *   waits for it to come back, so it counts only once the server has
+ *   accepted it and served it. Then it is closed and, once the whole
+ *   burst is done, the next burst goes out.
+ * - Reports connections/sec and the HDR histogram (hdr_hist.h) of
+ *   connect -> echo latency. Connections the server never gets to
+ *   in CONNECT_TIMEOUT_NS count as errors.
+ * - Connections are closed with an RST (SO_LINGER 0) so that we don't
+ *   run out of local ports to TIME_WAIT.
+ * - Works against any of the echo servers.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include "hdr_hist.h"
+
+#define MAX_EVENTS          256
+
+// Give up on a connection after this long.
+#define CONNECT_TIMEOUT_NS  5000000000ULL
+
+typedef struct conn
+{
+    int             fd;
+    uint64_t        start_ns;
+
+    // Byte is sent, waiting for the echo.
+    bool            sent;
+} conn_t;
+
+static struct sockaddr_in   server_addr;
+
+uint64_t now_ns ()
+{
+    struct timespec     ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void conn_close (conn_t *conn)
+{
+    struct linger   lin = {1, 0};
+
+    setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+// Starts a non-blocking connect.
+int conn_open (int epoll_fd, conn_t *conn, uint64_t now)
+{
+    struct epoll_event  event = {0};
+    int                 ret = 0;
+
+    conn->fd = -1;
+    conn->sent = false;
+    conn->start_ns = now;
+
+    ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ret < 0)
+    {
+        return -1;
+    }
+    conn->fd = ret;
+
+    ret = connect(conn->fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0 && errno != EINPROGRESS)
+    {
+        conn_close(conn);
+        return -1;
+    }
+
+    // Writable once connected.
+    event.events = EPOLLOUT;
+    event.data.ptr = conn;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conn->fd, &event) < 0)
+    {
+        conn_close(conn);
+        return -1;
+    }
+    return 0;
+}
+
+// Connected? Send the byte. Echo is in? Done.
+// Returns 1 when the connection is done, -1 if it failed, 0 otherwise.
+int conn_progress (int epoll_fd, conn_t *conn, uint32_t events)
+{
+    struct epoll_event  event = {0};
+    uint8_t             byte = 'c';
+    int                 err = 0;
+    socklen_t           len = sizeof(err);
+
+    if (events & (EPOLLERR | EPOLLHUP))
+    {
+        return -1;
+    }
+
+    if (conn->sent == false)
+    {
+        if (getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0)
+        {
+            return -1;
+        }
+        if (send(conn->fd, &byte, 1, MSG_NOSIGNAL) != 1)
+        {
+            return -1;
+        }
+        conn->sent = true;
+
+        event.events = EPOLLIN;
+        event.data.ptr = conn;
+        return (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) < 0) ? -1 : 0;
+    }
+
+    if (recv(conn->fd, &byte, 1, 0) != 1)
+    {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    return 1;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number] [seconds] [--burst N]\n", argv[0]);
+        return 0;
+    }
+
+    int                 ret = 0;
+    int                 i = 0;
+    int                 seconds = atoi(argv[3]);
+    int                 burst = 100;
+    int                 epoll_fd = 0;
+    int                 ready_count = 0;
+    int                 pending = 0;
+    conn_t              *conns = NULL;
+    conn_t              *conn = NULL;
+    hist_t              *hist = NULL;
+    struct epoll_event  events[MAX_EVENTS];
+    uint64_t            start = 0;
+    uint64_t            end = 0;
+    uint64_t            now = 0;
+    uint64_t            burst_start = 0;
+    uint64_t            done = 0;
+    uint64_t            errors = 0;
+    uint64_t            bursts = 0;
+    double              elapsed = 0;
+
+    for (i = 4; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--burst") == 0)
+        {
+            burst = atoi(argv[i + 1]);
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (seconds <= 0 || burst <= 0)
+    {
+        printf("seconds and burst should be positive\n");
+        return -1;
+    }
+
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    conns = calloc(burst, sizeof(conn_t));
+    hist = malloc(sizeof(hist_t));
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (conns == NULL || hist == NULL || epoll_fd < 0)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+    hist_init(hist);
+
+    start = now_ns();
+    end = start + (uint64_t)seconds * 1000000000ULL;
+
+    for (now = start; now < end; now = now_ns())
+    {
+        // A new burst. All of them at once.
+        burst_start = now;
+        pending = 0;
+        for (i = 0; i < burst; i++)
+        {
+            if (conn_open(epoll_fd, &conns[i], now) < 0)
+            {
+                errors += 1;
+                continue;
+            }
+            pending += 1;
+        }
+        bursts += 1;
+
+        while (pending > 0)
+        {
+            ret = epoll_wait(epoll_fd, events, MAX_EVENTS, 10);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                printf("epoll_wait() failed\n");
+                return -1;
+            }
+            ready_count = ret;
+            now = now_ns();
+
+            for (i = 0; i < ready_count; i++)
+            {
+                conn = events[i].data.ptr;
+                ret = conn_progress(epoll_fd, conn, events[i].events);
+                if (ret == 0)
+                {
+                    continue;
+                }
+
+                hist_record(hist, now - conn->start_ns);
+                if (ret > 0)
+                {
+                    done += 1;
+                }
+                else
+                {
+                    errors += 1;
+                }
+                conn_close(conn);
+                pending -= 1;
+            }
+
+            // The server isn't getting to some of them. Give up.
+            if (now - burst_start > CONNECT_TIMEOUT_NS)
+            {
+                for (i = 0; i < burst; i++)
+                {
+                    if (conns[i].fd >= 0)
+                    {
+                        hist_record(hist, now - conns[i].start_ns);
+                        errors += 1;
+                        conn_close(&conns[i]);
+                    }
+                }
+                pending = 0;
+            }
+        }
+    }
+    elapsed = (now_ns() - start) / 1e9;
+
+    printf("%lu bursts of %d: %lu connections served, %lu errors in %.2f s: %.0f connections/sec\n",
+           bursts, burst, done, errors, elapsed, done / elapsed);
+    hist_print(stdout, "connect -> echo", hist);
+
+    // One line for scripts.
+    printf("RESULT %.0f %.1f %.1f %.1f %lu\n",
+           done / elapsed,
+           hist_percentile(hist, 50.0) / 1000.0,
+           hist_percentile(hist, 99.0) / 1000.0,
+           hist->max / 1000.0,
+           errors);
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * coro.h
+ *
+ * Stackless coroutines.
+ * - echo_server_v0.c's serve_connection is the easiest code in this
+ *   directory to read: recv, send, repeat. But it blocks, so the
+ *   server serves one client at a time. The event loop servers get
+ *   concurrency by cutting that loop into pieces which run whenever
+ *   poll/epoll says so, with the state in between kept by hand.
+ * - A coroutine lets us write the loop like v0 and still not block.
+ *   Where v0 would block (recv or send returning EAGAIN), the
+ *   coroutine yields: it returns to the event loop, saying what it
+ *   waits for. When the event loop calls it again, it carries on
+ *   right after the point where it yielded.
+ * - Stackless: there is no stack per coroutine. CORO_BEGIN is a
+ *   switch on the line number we yielded at, and every yield point
+ *   is a case label (the protothreads / Duff's device trick).
+ *   Resuming is a function call and a jump. A coroutine costs the
+ *   few bytes of coro_t plus whatever the caller keeps next to it.
+ * - The catch: local variables don't survive a yield - the function
+ *   really returns. Anything needed after a yield has to live in a
+ *   struct the coroutine is handed (see echo_server_v12.c). Also, no
+ *   switch statements of your own between CORO_BEGIN and CORO_END,
+ *   and no two CORO_ macros on the same line - the line number is
+ *   the label.
+ *
+ * Header only. Just #include it.
+ */
+#ifndef __CORO_H__
+#define __CORO_H__
+
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+typedef struct coro
+{
+    // Where to carry on. 0 is the start.
+    int             line;
+
+    // What the coroutine waits for (EPOLLIN / EPOLLOUT).
+    uint32_t        wait;
+} coro_t;
+
+// What a coroutine function returns.
+enum
+{
+    CORO_WAITING = 0,
+    CORO_DONE,
+};
+
+#define CORO_INIT(co)       do { (co)->line = 0; (co)->wait = 0; } while (0)
+
+#define CORO_BEGIN(co)      switch ((co)->line) { case 0:
+
+#define CORO_END(co)        } (co)->line = 0; (co)->wait = 0; return CORO_DONE
+
+// Return to the caller, waiting for events. The next call
+// carries on from here.
+#define CORO_WAIT(co, events)                                           \
+    do                                                                  \
+    {                                                                   \
+        (co)->wait = (events);                                          \
+        (co)->line = __LINE__;                                          \
+        return CORO_WAITING;                                            \
+        case __LINE__:;                                                 \
+    } while (0)
+
+// Give the others a turn, without waiting for anything.
+#define CORO_YIELD(co)      CORO_WAIT(co, 0)
+
+// ret = recv(fd, buf, len), yielding till there is something.
+// EAGAIN never comes out of this.
+#define CORO_RECV(co, ret, fd, buf, len)                                \
+    do                                                                  \
+    {                                                                   \
+        while (1)                                                       \
+        {                                                               \
+            (ret) = recv((fd), (buf), (len), MSG_DONTWAIT);             \
+            if ((ret) < 0 && errno == EINTR)                            \
+            {                                                           \
+                continue;                                               \
+            }                                                           \
+            if ((ret) >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) \
+            {                                                           \
+                break;                                                  \
+            }                                                           \
+            CORO_WAIT(co, EPOLLIN);                                     \
+        }                                                               \
+    } while (0)
+
+// Sends all len bytes of buf, yielding whenever the socket is full.
+// off counts what is sent and has to survive the yields.
+// ret is < 0 if send failed for real.
+#define CORO_SEND_ALL(co, ret, fd, buf, len, off)                       \
+    do                                                                  \
+    {                                                                   \
+        (ret) = 0;                                                      \
+        (off) = 0;                                                      \
+        while ((off) < (len))                                           \
+        {                                                               \
+            (ret) = send((fd), (buf) + (off), (len) - (off), MSG_DONTWAIT | MSG_NOSIGNAL); \
+            if ((ret) >= 0)                                             \
+            {                                                           \
+                (off) += (ret);                                         \
+                continue;                                               \
+            }                                                           \
+            if (errno == EINTR)                                         \
+            {                                                           \
+                continue;                                               \
+            }                                                           \
+            if (errno != EAGAIN && errno != EWOULDBLOCK)                \
+            {                                                           \
+                break;                                                  \
+            }                                                           \
+            CORO_WAIT(co, EPOLLOUT);                                    \
+        }                                                               \
+    } while (0)
+
+#endif /* __CORO_H__ */
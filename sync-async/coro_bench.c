@@ -0,0 +1,173 @@
+/*
+ * coro_bench.c
+ *
+ * What does a coroutine switch cost?
+ * - stackless: coro.h. N coroutines, each counting and yielding,
+ *   resumed round-robin. One resume + one yield per step.
+ * - ucontext: the stackful way. Two contexts, each with its own stack,
+ *   swapcontext()-ing back and forth. glibc's swapcontext also saves
+ *   and restores the signal mask - that is a syscall per switch.
+ * - call: a plain indirect function call, for scale.
+ *
+ * Usage: $ ./coro_bench [coroutines] [steps]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ucontext.h>
+#include "coro.h"
+
+#define UCONTEXT_STACK_SIZE     (64 * 1024)
+
+typedef struct counter
+{
+    coro_t          co;
+    uint64_t        count;
+} counter_t;
+
+uint64_t now_ns ()
+{
+    struct timespec     ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Counts forever, yielding after every step.
+// Not inlined, and called through a pointer like count_once -
+// otherwise we would time an inlined switch against a real call.
+__attribute__((noinline)) int count_forever (counter_t *counter)
+{
+    CORO_BEGIN(&counter->co);
+    while (1)
+    {
+        counter->count += 1;
+        CORO_YIELD(&counter->co);
+    }
+    CORO_END(&counter->co);
+}
+
+// Same as one step of count_forever, without the coroutine.
+__attribute__((noinline)) int count_once (counter_t *counter)
+{
+    counter->count += 1;
+    return CORO_WAITING;
+}
+
+static ucontext_t       main_ctx;
+static ucontext_t       worker_ctx;
+static uint64_t         worker_count = 0;
+
+void worker_run ()
+{
+    while (1)
+    {
+        worker_count += 1;
+        swapcontext(&worker_ctx, &main_ctx);
+    }
+}
+
+// switches round trips main -> worker -> main.
+// On its own, so that nothing in main lives across getcontext(),
+// which returns twice.
+int measure_ucontext (uint64_t switches)
+{
+    uint64_t        start = 0;
+    uint64_t        end = 0;
+    uint64_t        i = 0;
+
+    getcontext(&worker_ctx);
+    worker_ctx.uc_stack.ss_sp = malloc(UCONTEXT_STACK_SIZE);
+    worker_ctx.uc_stack.ss_size = UCONTEXT_STACK_SIZE;
+    worker_ctx.uc_link = &main_ctx;
+    if (worker_ctx.uc_stack.ss_sp == NULL)
+    {
+        printf("malloc() failed\n");
+        return -1;
+    }
+    makecontext(&worker_ctx, worker_run, 0);
+
+    start = now_ns();
+    for (i = 0; i < switches; i++)
+    {
+        swapcontext(&main_ctx, &worker_ctx);
+    }
+    end = now_ns();
+    printf("ucontext:  %d byte stack each, %.1f ns per switch there and back\n",
+           UCONTEXT_STACK_SIZE, (double)(end - start) / worker_count);
+    return 0;
+}
+
+int main (int argc, char **argv)
+{
+    uint64_t        coroutines = (argc > 1) ? strtoull(argv[1], NULL, 10) : 1000;
+    uint64_t        steps = (argc > 2) ? strtoull(argv[2], NULL, 10) : 10000000;
+    counter_t       *counters = NULL;
+    int             (*step)(counter_t *) = NULL;
+    uint64_t        start = 0;
+    uint64_t        end = 0;
+    uint64_t        i = 0;
+    uint64_t        total = 0;
+
+    if (coroutines == 0 || steps == 0)
+    {
+        printf("coroutines and steps should be positive\n");
+        return -1;
+    }
+
+    counters = calloc(coroutines, sizeof(counter_t));
+    if (counters == NULL)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+
+    // Stackless, through a pointer like the plain call below.
+    step = count_forever;
+    for (i = 0; i < coroutines; i++)
+    {
+        CORO_INIT(&counters[i].co);
+    }
+    start = now_ns();
+    for (i = 0; i < steps; i++)
+    {
+        step(&counters[i % coroutines]);
+    }
+    end = now_ns();
+    for (i = 0; i < coroutines; i++)
+    {
+        total += counters[i].count;
+    }
+    printf("stackless: %lu coroutines (%lu bytes each), %.1f ns per resume + yield\n",
+           coroutines, sizeof(counter_t), (double)(end - start) / total);
+
+    // Plain call, through a pointer so it isn't inlined away.
+    step = count_once;
+    total = 0;
+    for (i = 0; i < coroutines; i++)
+    {
+        counters[i].count = 0;
+    }
+    start = now_ns();
+    for (i = 0; i < steps; i++)
+    {
+        step(&counters[i % coroutines]);
+    }
+    end = now_ns();
+    for (i = 0; i < coroutines; i++)
+    {
+        total += counters[i].count;
+    }
+    printf("call:      %.1f ns per call\n", (double)(end - start) / total);
+
+    // Stackful, with ucontext. Much slower - a tenth of the steps.
+    if (measure_ucontext(steps / 10) < 0)
+    {
+        return -1;
+    }
+
+    return 0;
+}
@@ -29,7 +29,7 @@ enum
 
 int serve_connection (int client_fd)
 {   
-    uint8_t         request_buffer[10000] = {0};
+    uint8_t         request_buffer[10000];
     int             ret = 0;
     int             req_len = 0;
 
@@ -17,6 +17,8 @@
 #include <unistd.h>
 #include <sys/select.h>
 #include <stdbool.h>
+#include "log.h"
+#include "fd_bitmap.h"
 
 // serve_connection can have different return values.
 // Based on it, we need to take action in the main
@@ -30,19 +32,19 @@ enum
 
 int serve_connection (int client_fd)
 {   
-    uint8_t         request_buffer[10000] = {0};
+    uint8_t         request_buffer[10000];
     int             ret = 0;
     int             req_len = 0;
 
-	printf("Inside serve_connection for descriptor %d\n", client_fd);
+	LOG_DEBUG("Inside serve_connection for descriptor %d\n", client_fd);
 
     // Recv it
     // What if the client sends more than 10,000 bytes of data?
     ret = recv(client_fd, request_buffer, sizeof(request_buffer), 0);
-	printf("recv ret = %d\n", ret);
+	LOG_DEBUG("recv ret = %d\n", ret);
     if (ret < 0)
     {
-        printf("recv() failed for fd = %d\n", ret);
+        LOG_WARN("recv() failed for fd = %d\n", client_fd);
         return SERVE_CONN_FAILED;
     }
     else if (ret == 0)
@@ -57,10 +59,10 @@ int serve_connection (int client_fd)
     // Send back response
     // Can this be blocking?
     ret = send(client_fd, request_buffer, req_len, 0);
-    printf("send() for descriptor %d return %d\n", client_fd, ret);
+    LOG_DEBUG("send() for descriptor %d return %d\n", client_fd, ret);
     if (ret < req_len)
     {
-        printf("send() failed for fd = %d\n", ret);
+        LOG_WARN("send() failed for fd = %d\n", client_fd);
         return SERVE_CONN_FAILED;
     }
 
@@ -82,18 +84,24 @@ int main (int argc, char **argv)
     int                 ret = 0;
     int                 i = 0;
     struct sockaddr_in  server_addr = {0};
-    struct sockaddr_in  client_addr = {0};
-    socklen_t           client_addr_len = 0;
     const char          *ip_addr = argv[1];
     uint16_t            port_no = atoi(argv[2]);
-    fd_set              read_set = {0};
-    bool                fds_list[FD_SETSIZE] = {false};
+    fd_bitmap_t         watch_set = {0};
+    fd_bitmap_t         read_set = {0};
+
+    // Start the log drainer.
+    ret = log_init();
+    if (ret < 0)
+    {
+        printf("log_init() failed\n");
+        return -1;
+    }
 
     // Lets create a socket.
     ret = socket(AF_INET, SOCK_STREAM, 0);
     if (ret < 0)
     {
-        printf("socket() failed\n");
+        LOG_ERROR("socket() failed\n");
         return -1;
     }
     sock_fd = ret;
@@ -106,7 +114,7 @@ int main (int argc, char **argv)
     ret = bind(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
     if (ret < 0)
     {
-        printf("bind() failed\n");
+        LOG_ERROR("bind() failed\n");
         return -1;
     }
     
@@ -114,124 +122,100 @@ int main (int argc, char **argv)
     ret = listen(sock_fd, 50);
     if (ret < 0)
     {
-        printf("listen() failed\n");
+        LOG_ERROR("listen() failed\n");
         return -1;
     }
-    printf("Listening at (%s, %u)\n", ip_addr, port_no);
+    LOG_INFO("Listening at (%s, %u)\n", ip_addr, port_no);
 
     // Before entering, initialize everything we need to call select.
-    // This set is passed to select, it gets altered when select succeeds.
-    FD_ZERO(&read_set);
+    // watch_set has every descriptor we want select to monitor.
+    // read_set is what we pass to select, it gets altered when select succeeds.
+    // Both grow as bigger descriptors show up. See fd_bitmap.h
+    if (fd_bitmap_init(&watch_set) < 0 || fd_bitmap_init(&read_set) < 0)
+    {
+        LOG_ERROR("calloc() failed\n");
+        return -1;
+    }
+    if (fd_bitmap_reserve(&watch_set, sock_fd) < 0)
+    {
+        LOG_ERROR("realloc() failed\n");
+        return -1;
+    }
+    fd_bitmap_set(&watch_set, sock_fd);
 
     // Do the thing
     while (1)
     {
-        memset(&client_addr, '\0', sizeof(client_addr));
-
         // Copy.
-        FD_SET(sock_fd, &read_set);
+        // One memcpy, instead of going over every descriptor
+        // and putting it back in read_set.
+        if (fd_bitmap_copy(&read_set, &watch_set) < 0)
+        {
+            LOG_ERROR("realloc() failed\n");
+            return -1;
+        }
 
-        printf("Waiting for select() to succeed\n");
-        ret = select(FD_SETSIZE, &read_set, NULL, NULL, NULL);
+        LOG_DEBUG("Waiting for select() to succeed\n");
+        ret = select(fd_bitmap_nfds(&watch_set), fd_bitmap_fd_set(&read_set), NULL, NULL, NULL);
         if (ret <= 0)
         {
-            printf("select() failed\n");
+            LOG_ERROR("select() failed\n");
             return -1;
         }
-        printf("After select, %d descriptors are ready!\n", ret);
+        LOG_DEBUG("After select, %d descriptors are ready!\n", ret);
         // Suppose it succeeds, we don't know which sockets are ready.
-        // All the "ready" sockets are set in those sets.
-        // We know the socket value, we need to go over them and see
-        // which one to process first.
-        
-        // If this comes true, that means we have an incoming connection
-        // waiting to be accepted.
-        if (FD_ISSET(sock_fd, &read_set))
-        {   
-            printf("Inside sock_fd if\n");
-            ret = accept(sock_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-            if (ret < 0)
-            {
-                printf("accept4() failed\n");
-                return -1;
-            }
-            client_fd = ret;
-            printf("client_fd = %d\n", client_fd);
-
-			// select won't be able to handle any descriptor with value
-			// >= FD_SETSIZE (which is 1024). Check it and kill it
-			// if the descriptor is greater.
-			if (client_fd >= FD_SETSIZE)
-			{
-				close (client_fd);
-			}
-			else
-			{
-            	// We want select to keep an eye on this new socket.
-            	fds_list[client_fd] = true;
-			}
-
-            // When select returns, read_set would be modified
-            // to keep just the "ready" descriptors. A couple of them
-            // might be lost. Need to update read_set before
-            // we pass it to select again.
-            for (i = 0; i < FD_SETSIZE; i++)
+        // All the "ready" sockets are set in read_set.
+        // Go over just those - a word (64 descriptors) at a time.
+        for (i = fd_bitmap_next(&read_set, 0); i >= 0; i = fd_bitmap_next(&read_set, i + 1))
+        {
+            // If this comes true, that means we have an incoming connection
+            // waiting to be accepted.
+            if (i == sock_fd)
             {
-                if (fds_list[i] == true)
+                LOG_DEBUG("Inside sock_fd if\n");
+                ret = accept(sock_fd, NULL, NULL);
+                if (ret < 0)
                 {
-                    FD_SET(i, &read_set);
+                    LOG_ERROR("accept4() failed\n");
+                    return -1;
                 }
-            }
-        }
-        else // This should cover all the other socket descriptors
-        {
-            // Should we iterate through our fds_list and check
-            // which descriptor is present in the read/write/error sets?
-            for (i = 0; i < FD_SETSIZE; i++)
-            {   
-                // Check if this socket exists
-                if (fds_list[i] == true)
+                client_fd = ret;
+                LOG_DEBUG("client_fd = %d\n", client_fd);
+
+                // We want select to keep an eye on this new socket.
+                // Whatever its value - the set grows if it has to.
+                if (fd_bitmap_reserve(&watch_set, client_fd) < 0)
                 {
-                    // If it is ready to read, go for it.
-                    if (FD_ISSET(i, &read_set))
-                    {
-                        printf("FD: %d\n", i);
-
-						// Let us serve it.
-                        ret = serve_connection(i);
-                        if (ret == SERVE_CONN_FAILED || ret == SERVE_CONN_CLIENT_DISCONN)
-                        {
-                            // If something failed, shutdown the client.
-                            // If recv returns 0, it means that the other side
-                            // has closed the connection. We need to do it
-                            // as well.
-                            close(i);
-                            FD_CLR(i, &read_set);
-                            fds_list[i] = false;
-                        }
-
-                        // On success, we should do nothing.
-                        // Just play along.
-                        
-						// Because this is an echo server,
-						// the client can talk to the server
-						// for how much time it wants.
-						// We should not be closing the connection.
-
-                        // The descriptor which was just served
-                        // is already present in read_set.
-                        // Let it be. We want select to monitor it.
-                    }
-                    else
-                    {   
-                        // If it is not ready to be read
-                        // but is a valid descriptor, then
-                        // select should monitor it.
-                        FD_SET(i, &read_set);
-                    }
-                    
+                    LOG_WARN("realloc() failed for fd = %d\n", client_fd);
+                    close(client_fd);
+                    continue;
                 }
+                fd_bitmap_set(&watch_set, client_fd);
+                continue;
             }
+
+            LOG_DEBUG("FD: %d\n", i);
+
+            // Let us serve it.
+            ret = serve_connection(i);
+            if (ret == SERVE_CONN_FAILED || ret == SERVE_CONN_CLIENT_DISCONN)
+            {
+                // If something failed, shutdown the client.
+                // If recv returns 0, it means that the other side
+                // has closed the connection. We need to do it
+                // as well.
+                close(i);
+                fd_bitmap_clear(&watch_set, i);
+            }
+
+            // On success, we should do nothing.
+            // Just play along.
+
+            // Because this is an echo server,
+            // the client can talk to the server
+            // for how much time it wants.
+            // We should not be closing the connection.
+            // It stays in watch_set, so select keeps monitoring it.
         }
     }
 }
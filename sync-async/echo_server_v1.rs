@@ -0,0 +1,564 @@
+/*
+ * echo_server_v1.rs
+ *
+ * Non-blocking echo server on a small epoll reactor.
+ * Uses std only - epoll is called straight through FFI,
+ * declared by hand below. No crates.
+ *
+ * Equivalent to echo_server_v3.c, with epoll in place of poll:
+ * - Client sockets are non-blocking. Whatever write does not take
+ *   right away is parked in the connection's OutRing (out_ring.h)
+ *   and written when epoll says the socket is writable.
+ * - Reading stops once OUT_RING_HIGH_WATER bytes are parked and starts
+ *   again at OUT_RING_LOW_WATER. EPOLLOUT is asked for only while
+ *   something is parked.
+ * - A client which is done sending still gets everything back
+ *   before we close.
+ * - On every wakeup we accept till the backlog is empty, up to
+ *   ACCEPT_BUDGET connections. Out of descriptors, the waiting ones
+ *   are turned away with a spare descriptor, like echo_server_v3.c.
+ * - Level-triggered, like poll. epoll_ctl is called only when what
+ *   a connection waits for changes.
+ * - One read buffer for the whole server, allocated once. Nothing
+ *   is zeroed per read - we only ever look at the bytes read put in.
+ *
+ * No timeouts (timer_wheel.h) yet.
+ */
+
+use std::{env, fs, io, net};
+use std::io::{IoSlice, Read, Write};
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+
+// Maximum number of ready descriptors epoll_wait
+// can hand back in one go.
+const MAX_EVENTS: usize = 1024;
+
+// Connections accepted per wakeup, at most.
+const ACCEPT_BUDGET: usize = 64;
+
+// Same as out_ring.h.
+const OUT_RING_CAPACITY: usize = 65536;
+const OUT_RING_HIGH_WATER: usize = 49152;
+const OUT_RING_LOW_WATER: usize = 16384;
+
+// From <sys/epoll.h>.
+const EPOLLIN: u32 = 0x001;
+const EPOLLOUT: u32 = 0x004;
+const EPOLLERR: u32 = 0x008;
+const EPOLLHUP: u32 = 0x010;
+const EPOLL_CTL_ADD: i32 = 1;
+const EPOLL_CTL_DEL: i32 = 2;
+const EPOLL_CTL_MOD: i32 = 3;
+const EPOLL_CLOEXEC: i32 = 0o2000000;
+
+// From <errno.h>.
+const ENFILE: i32 = 23;
+const EMFILE: i32 = 24;
+
+// struct epoll_event. The kernel packs it on x86_64 (12 bytes),
+// everywhere else it has the natural layout (16 bytes).
+#[repr(C)]
+#[cfg_attr(target_arch = "x86_64", repr(packed))]
+#[derive(Clone, Copy)]
+struct EpollEvent
+{
+    events: u32,
+    data: u64,
+}
+
+extern "C"
+{
+    fn epoll_create1 (flags: i32) -> i32;
+    fn epoll_ctl (epfd: i32, op: i32, fd: i32, event: *mut EpollEvent) -> i32;
+    fn epoll_wait (epfd: i32, events: *mut EpollEvent, maxevents: i32, timeout: i32) -> i32;
+}
+
+// The epoll instance. Closed when dropped.
+struct Epoll
+{
+    fd: OwnedFd,
+}
+
+impl Epoll
+{
+    fn new () -> io::Result<Epoll>
+    {
+        let ret = unsafe { epoll_create1(EPOLL_CLOEXEC) };
+        if ret < 0
+        {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(Epoll { fd: unsafe { OwnedFd::from_raw_fd(ret) } })
+    }
+
+    fn ctl (&self, op: i32, fd: RawFd, events: u32) -> io::Result<()>
+    {
+        // The descriptor is what comes back with the event.
+        let mut event = EpollEvent { events: events, data: fd as u64 };
+        let ret = unsafe { epoll_ctl(self.fd.as_raw_fd(), op, fd, &mut event) };
+        if ret < 0
+        {
+            return Err(io::Error::last_os_error());
+        }
+        Ok(())
+    }
+
+    fn add (&self, fd: RawFd, events: u32) -> io::Result<()>
+    {
+        self.ctl(EPOLL_CTL_ADD, fd, events)
+    }
+
+    fn modify (&self, fd: RawFd, events: u32) -> io::Result<()>
+    {
+        self.ctl(EPOLL_CTL_MOD, fd, events)
+    }
+
+    fn delete (&self, fd: RawFd) -> io::Result<()>
+    {
+        self.ctl(EPOLL_CTL_DEL, fd, 0)
+    }
+
+    // Sleeps till something is ready. Fills events from the start,
+    // returns how many there are.
+    fn wait (&self, events: &mut [EpollEvent]) -> io::Result<usize>
+    {
+        loop
+        {
+            let ret = unsafe
+            {
+                epoll_wait(self.fd.as_raw_fd(), events.as_mut_ptr(), events.len() as i32, -1 /* Infinite timeout */)
+            };
+            if ret >= 0
+            {
+                return Ok(ret as usize);
+            }
+
+            let error = io::Error::last_os_error();
+            if error.kind() != io::ErrorKind::Interrupted
+            {
+                return Err(error);
+            }
+        }
+    }
+}
+
+// Echoed bytes the client hasn't taken yet. out_ring.h in Rust:
+// allocated when something has to be parked, freed once it is empty.
+struct OutRing
+{
+    data: Option<Box<[u8]>>,
+
+    // Both only go up; position = value % OUT_RING_CAPACITY.
+    head: usize,
+    tail: usize,
+}
+
+impl OutRing
+{
+    fn new () -> OutRing
+    {
+        OutRing { data: None, head: 0, tail: 0 }
+    }
+
+    fn len (&self) -> usize
+    {
+        self.tail - self.head
+    }
+
+    fn space (&self) -> usize
+    {
+        OUT_RING_CAPACITY - self.len()
+    }
+
+    // Parks buf at the tail. Caller makes sure it fits.
+    fn push (&mut self, buf: &[u8])
+    {
+        let data = self.data.get_or_insert_with(|| vec![0u8; OUT_RING_CAPACITY].into_boxed_slice());
+        let pos = self.tail % OUT_RING_CAPACITY;
+        let first = buf.len().min(OUT_RING_CAPACITY - pos);
+
+        data[pos..pos + first].copy_from_slice(&buf[..first]);
+        data[..buf.len() - first].copy_from_slice(&buf[first..]);
+        self.tail += buf.len();
+    }
+
+    // Writes as much as the socket takes. A wrapped ring goes
+    // out in one writev. Frees the memory once everything is out.
+    fn flush (&mut self, stream: &mut net::TcpStream) -> io::Result<()>
+    {
+        while self.len() > 0
+        {
+            let data = self.data.as_ref().unwrap();
+            let pos = self.head % OUT_RING_CAPACITY;
+            let first = self.len().min(OUT_RING_CAPACITY - pos);
+            let slices = [IoSlice::new(&data[pos..pos + first]), IoSlice::new(&data[..self.len() - first])];
+
+            match stream.write_vectored(&slices)
+            {
+                Ok(sent) => self.head += sent,
+                Err(ref error) if error.kind() == io::ErrorKind::WouldBlock => return Ok(()),
+                Err(ref error) if error.kind() == io::ErrorKind::Interrupted => continue,
+                Err(error) => return Err(error),
+            }
+        }
+
+        self.data = None;
+        self.head = 0;
+        self.tail = 0;
+        Ok(())
+    }
+}
+
+// Per-connection state.
+struct Connection
+{
+    stream: net::TcpStream,
+    out: OutRing,
+
+    // We stopped reading because out is above the high-water mark.
+    paused: bool,
+
+    // Client is done sending. We close once out is flushed.
+    read_closed: bool,
+
+    // What epoll watches for it right now.
+    events: u32,
+}
+
+// What serve_connection and flush_connection tell the main loop.
+enum Serve
+{
+    Success,
+    Failed,
+    ClientDisconn,
+}
+
+impl Connection
+{
+    // What should epoll watch for this connection?
+    // - EPOLLIN unless we have paused reading or the client is done sending.
+    // - EPOLLOUT only while something is parked. A socket is writable
+    //   almost all the time - asking for EPOLLOUT with nothing to send
+    //   would make epoll_wait return right away, every time.
+    fn wanted_events (&mut self) -> u32
+    {
+        let mut events = 0;
+
+        if self.out.len() >= OUT_RING_HIGH_WATER
+        {
+            self.paused = true;
+        }
+        else if self.out.len() <= OUT_RING_LOW_WATER
+        {
+            self.paused = false;
+        }
+
+        if self.paused == false && self.read_closed == false
+        {
+            events |= EPOLLIN;
+        }
+        if self.out.len() > 0
+        {
+            events |= EPOLLOUT;
+        }
+        events
+    }
+
+    // Reads once into the shared buffer and sends it back.
+    // buffer is the server's; only buffer[..read] is looked at.
+    fn serve_connection (&mut self, buffer: &mut [u8]) -> Serve
+    {
+        // Never read more than we can park.
+        let to_read = buffer.len().min(self.out.space());
+
+        let read = match self.stream.read(&mut buffer[..to_read])
+        {
+            Ok(read) => read,
+            Err(ref error) if error.kind() == io::ErrorKind::WouldBlock ||
+                              error.kind() == io::ErrorKind::Interrupted =>
+            {
+                // Nothing after all. Try again later.
+                return Serve::Success;
+            }
+            Err(_) => return Serve::Failed,
+        };
+
+        if read == 0
+        {
+            // The other side is done sending.
+            // Whatever is parked still goes out.
+            self.read_closed = true;
+            if self.out.len() > 0
+            {
+                return Serve::Success;
+            }
+            return Serve::ClientDisconn;
+        }
+
+        // If something is already parked, this goes behind it.
+        // Otherwise send right away, park what the socket doesn't take.
+        let mut sent = 0;
+        if self.out.len() == 0
+        {
+            sent = match self.stream.write(&buffer[..read])
+            {
+                Ok(sent) => sent,
+                Err(ref error) if error.kind() == io::ErrorKind::WouldBlock ||
+                                  error.kind() == io::ErrorKind::Interrupted => 0,
+                Err(_) => return Serve::Failed,
+            };
+        }
+
+        if sent < read
+        {
+            self.out.push(&buffer[sent..read]);
+        }
+        Serve::Success
+    }
+
+    // Socket is writable. Send what is parked.
+    fn flush_connection (&mut self) -> Serve
+    {
+        if self.out.flush(&mut self.stream).is_err()
+        {
+            return Serve::Failed;
+        }
+
+        // Client was done sending and has got everything back.
+        if self.read_closed && self.out.len() == 0
+        {
+            return Serve::ClientDisconn;
+        }
+        Serve::Success
+    }
+}
+
+struct Server
+{
+    listener: net::TcpListener,
+    epoll: Epoll,
+
+    // Connection table. Indexed by descriptor.
+    conns: Vec<Option<Connection>>,
+
+    // Every read goes here. Allocated once.
+    buffer: Box<[u8]>,
+
+    // Kept open only to be given up when we run out of
+    // descriptors. See turn_away_connection.
+    spare: Option<fs::File>,
+}
+
+impl Server
+{
+    // Out of descriptors (EMFILE/ENFILE). The listener is level-triggered,
+    // so with clients still in the backlog we'd be woken up again right
+    // away and spin. Give up the spare, accept the oldest client with it
+    // and close it, take the spare back.
+    // Returns false if the backlog is empty (or there is no spare).
+    fn turn_away_connection (&mut self) -> bool
+    {
+        if self.spare.is_none()
+        {
+            return false;
+        }
+
+        // Dropping the file closes it, dropping the stream closes that.
+        self.spare = None;
+        let turned_away = loop
+        {
+            match self.listener.accept()
+            {
+                Ok(_) => break true,
+                Err(ref error) if error.kind() == io::ErrorKind::Interrupted ||
+                                  error.kind() == io::ErrorKind::ConnectionAborted =>
+                {
+                    continue;
+                }
+                Err(_) => break false,
+            }
+        };
+
+        self.spare = fs::File::open("/dev/null").ok();
+        turned_away
+    }
+
+    // Accepts pending connections, up to ACCEPT_BUDGET of them.
+    fn accept_connections (&mut self)
+    {
+        for accepted in 0..ACCEPT_BUDGET
+        {
+            let stream = match self.listener.accept()
+            {
+                Ok((stream, _)) => stream,
+                Err(ref error) if error.kind() == io::ErrorKind::WouldBlock =>
+                {
+                    // Backlog is empty.
+                    return;
+                }
+                Err(ref error) if error.kind() == io::ErrorKind::Interrupted ||
+                                  error.kind() == io::ErrorKind::ConnectionAborted =>
+                {
+                    continue;
+                }
+                Err(error) =>
+                {
+                    // Out of descriptors. Turn the waiting ones away,
+                    // within the same budget.
+                    let mut turned_away = 0;
+                    if error.raw_os_error() == Some(EMFILE) || error.raw_os_error() == Some(ENFILE)
+                    {
+                        while accepted + turned_away < ACCEPT_BUDGET && self.turn_away_connection()
+                        {
+                            turned_away += 1;
+                        }
+                    }
+                    println!("accept() failed: {:?}. Turned away {} waiting connections", error, turned_away);
+                    return;
+                }
+            };
+
+            if stream.set_nonblocking(true).is_err()
+            {
+                continue;
+            }
+
+            let fd = stream.as_raw_fd();
+            if self.epoll.add(fd, EPOLLIN).is_err()
+            {
+                println!("epoll_ctl() failed for fd = {}", fd);
+                continue;
+            }
+
+            if self.conns.len() <= fd as usize
+            {
+                self.conns.resize_with(fd as usize + 1, || None);
+            }
+            self.conns[fd as usize] = Some(Connection
+            {
+                stream: stream,
+                out: OutRing::new(),
+                paused: false,
+                read_closed: false,
+                events: EPOLLIN,
+            });
+        }
+    }
+
+    // Takes it out of epoll. Dropping the connection closes it.
+    fn close_connection (&mut self, fd: RawFd)
+    {
+        let _ = self.epoll.delete(fd);
+        self.conns[fd as usize] = None;
+    }
+
+    fn handle_event (&mut self, fd: RawFd, events: u32)
+    {
+        let conn = match self.conns.get_mut(fd as usize)
+        {
+            Some(Some(conn)) => conn,
+            _ => return,
+        };
+
+        // Error, or client closed the connection.
+        if events & (EPOLLERR | EPOLLHUP) != 0
+        {
+            self.close_connection(fd);
+            return;
+        }
+
+        let mut ret = Serve::Success;
+
+        // Send out what is parked first. It might make
+        // room for more reading.
+        if events & EPOLLOUT != 0
+        {
+            ret = conn.flush_connection();
+        }
+
+        if let Serve::Success = ret
+        {
+            if events & EPOLLIN != 0
+            {
+                ret = conn.serve_connection(&mut self.buffer);
+            }
+        }
+
+        if let Serve::Success = ret
+        {
+            // Update what epoll should watch, if it changed.
+            let wanted = conn.wanted_events();
+            if wanted == conn.events
+            {
+                return;
+            }
+            conn.events = wanted;
+            if self.epoll.modify(fd, wanted).is_ok()
+            {
+                return;
+            }
+        }
+
+        self.close_connection(fd);
+    }
+
+    fn run (&mut self) -> io::Result<()>
+    {
+        let listener_fd = self.listener.as_raw_fd();
+        let mut events = vec![EpollEvent { events: 0, data: 0 }; MAX_EVENTS];
+
+        self.epoll.add(listener_fd, EPOLLIN)?;
+
+        loop
+        {
+            let ready_fd_count = self.epoll.wait(&mut events)?;
+
+            for i in 0..ready_fd_count
+            {
+                let fd = events[i].data as RawFd;
+                let ready = events[i].events;
+
+                if fd == listener_fd
+                {
+                    self.accept_connections();
+                }
+                else
+                {
+                    self.handle_event(fd, ready);
+                }
+            }
+        }
+    }
+}
+
+fn main () -> io::Result<()>
+{
+    // Get the arguments
+    let args: Vec<String> = env::args().collect();
+    if args.len() != 3
+    {
+        println!("Usage: {} [ipv4 address] [port number]", args[0]);
+        return Ok(())
+    }
+
+    // Generate the address tuple
+    let address = format!("{}:{}", args[1], args[2]);
+
+    // Create the listener. Non-blocking, so that we can
+    // accept till the backlog is empty.
+    let listener = net::TcpListener::bind(&address)?;
+    listener.set_nonblocking(true)?;
+    println!("Listening at {}", address);
+
+    let mut server = Server
+    {
+        listener: listener,
+        epoll: Epoll::new()?,
+        conns: Vec::new(),
+        buffer: vec![0u8; 10000].into_boxed_slice(),
+
+        // One descriptor in reserve, for when we run out.
+        spare: fs::File::open("/dev/null").ok(),
+    };
+    server.run()
+}
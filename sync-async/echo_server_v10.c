@@ -0,0 +1,654 @@
+/*
+ * echo_server_v10.c
+ *
+ * echo_server_v4.c with request framing and pipelining.
+ * - The other echo servers treat whatever one recv() returns as one
+ *   request. TCP is a byte stream - one recv() can have half a request,
+ *   or ten of them.
+ * - Here every message is a frame: a 4 byte length (network byte order)
+ *   followed by that many bytes of payload. The response to a frame
+ *   is the same frame.
+ * - The parser works on a per-connection input buffer. It takes as many
+ *   whole frames as it finds and keeps a partial frame at the end for
+ *   the next recv().
+ * - Responses for all the frames parsed out of one recv() go out in
+ *   a single writev(), pointing straight into the input buffer.
+ *   A client can pipeline - send many requests without waiting for
+ *   each response - and we answer the whole lot with one syscall.
+ * - A frame has to fit in a pool buffer (FRAME_MAX_LEN). Bigger
+ *   ones are a protocol error and the connection is closed.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include "buf_pool.h"
+#include "out_ring.h"
+
+// Maximum number of ready descriptors epoll_wait
+// can hand back in one go.
+// If more are ready, we get them in the next epoll_wait.
+#define MAX_EVENTS  1024
+
+// Frame = 4 byte length + payload. Both have to fit in one buffer.
+#define FRAME_HEADER_LEN    4
+#define FRAME_MAX_LEN       BUF_POOL_BUF_SIZE
+
+// Most frames answered by one writev().
+#define FRAME_BATCH         64
+
+// I/O buffers. A connection leases one only while it is being served.
+static buf_pool_t   pool;
+
+// Per-connection state. Indexed by descriptor.
+typedef struct conn
+{
+    // Bytes received but not parsed yet - a partial frame, or whole
+    // frames we had no room to answer. Leased from the pool,
+    // NULL while there is nothing.
+    uint8_t         *in;
+    uint32_t        in_len;
+
+    // Echoed bytes the client hasn't taken yet.
+    out_ring_t      out;
+
+    // We stopped reading because out is above the high-water mark,
+    // or has no room for the next frame.
+    bool            paused;
+
+    // Client is done sending. We close once out is flushed.
+    bool            read_closed;
+
+    // What epoll is watching right now.
+    uint32_t        events;
+} conn_t;
+
+// Connection table. Grows as bigger descriptors show up.
+static conn_t       *conns = NULL;
+static uint64_t     conns_capacity = 0;
+
+// Kept open only to be given up when we run out of
+// descriptors. See turn_away_connection.
+static int          spare_fd = -1;
+
+// A note on edge-triggered mode (EPOLLET)
+//
+// - In level-triggered mode (which is what poll does),
+//   a descriptor is reported as long as it is ready.
+// - In edge-triggered mode, a descriptor is reported only
+//   when its state changes. Suppose a client sends 20,000 bytes
+//   and we read 10,000 of it, epoll will NOT report it again
+//   till the client sends more data.
+// - So, once a descriptor is reported, we need to keep reading
+//   it till recv() returns EAGAIN. That is the only way we can
+//   be sure that nothing is left behind.
+// - In return, epoll_wait does not keep waking us up for the
+//   same data again and again.
+
+// serve_connection can have different return values.
+// Based on it, we need to take action in the main
+// function.
+enum
+{
+    SERVE_CONN_SUCCESS = 0,
+    SERVE_CONN_FAILED,
+    SERVE_CONN_CLIENT_DISCONN,
+};
+
+// Makes sure the connection table can hold the passed descriptor.
+int conns_reserve (int fd)
+{
+    uint64_t    new_capacity = 0;
+    conn_t      *temp = NULL;
+
+    if ((uint64_t)fd < conns_capacity)
+    {
+        return 0;
+    }
+
+    new_capacity = conns_capacity ? conns_capacity : 1024;
+    while (new_capacity <= (uint64_t)fd)
+    {
+        new_capacity *= 2;
+    }
+
+    temp = realloc(conns, sizeof(conn_t) * new_capacity);
+    if (temp == NULL)
+    {
+        return -1;
+    }
+
+    conns = temp;
+    conns_capacity = new_capacity;
+    return 0;
+}
+
+// Sends the responses. Whatever the socket doesn't take is parked.
+// Caller made sure out has room for all of it.
+int send_batch (int client_fd, conn_t *conn, struct iovec *iov, int iov_count)
+{
+    ssize_t     sent = 0;
+    int         i = 0;
+
+    if (iov_count == 0)
+    {
+        return SERVE_CONN_SUCCESS;
+    }
+
+    // Behind what is already parked? Then just queue up.
+    if (out_ring_len(&conn->out) == 0)
+    {
+        sent = writev(client_fd, iov, iov_count);
+        if (sent < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                printf("writev() failed for fd = %d\n", client_fd);
+                return SERVE_CONN_FAILED;
+            }
+            sent = 0;
+        }
+    }
+
+    // Park the rest. Skip over what went out.
+    for (i = 0; i < iov_count; i++)
+    {
+        if ((size_t)sent >= iov[i].iov_len)
+        {
+            sent -= iov[i].iov_len;
+            continue;
+        }
+        out_ring_push(&conn->out, (uint8_t *)iov[i].iov_base + sent, iov[i].iov_len - sent);
+        sent = 0;
+    }
+
+    if (out_ring_len(&conn->out) >= OUT_RING_HIGH_WATER)
+    {
+        conn->paused = true;
+    }
+    return SERVE_CONN_SUCCESS;
+}
+
+// Answers every whole frame in the input buffer.
+// A partial frame at the end stays for the next recv().
+int process_frames (int client_fd, conn_t *conn)
+{
+    struct iovec    iov[FRAME_BATCH];
+    int             iov_count = 0;
+    uint64_t        batch_len = 0;
+    uint32_t        off = 0;
+    uint32_t        frame_len = 0;
+    int             ret = 0;
+
+    while (conn->in_len - off >= FRAME_HEADER_LEN)
+    {
+        memcpy(&frame_len, conn->in + off, FRAME_HEADER_LEN);
+        frame_len = ntohl(frame_len) + FRAME_HEADER_LEN;
+        if (frame_len > FRAME_MAX_LEN || frame_len < FRAME_HEADER_LEN)
+        {
+            printf("fd = %d sent a frame of %u bytes. Closing\n", client_fd, frame_len);
+            return SERVE_CONN_FAILED;
+        }
+
+        // Not all of it is here yet.
+        if (conn->in_len - off < frame_len)
+        {
+            break;
+        }
+
+        // In the worst case, all of the batch gets parked.
+        // No room? Leave the frame where it is and stop reading
+        // till the client takes some of its responses.
+        if (batch_len + frame_len > out_ring_space(&conn->out))
+        {
+            conn->paused = true;
+            break;
+        }
+
+        // The response is the frame itself. No copy.
+        iov[iov_count].iov_base = conn->in + off;
+        iov[iov_count].iov_len = frame_len;
+        iov_count += 1;
+        batch_len += frame_len;
+        off += frame_len;
+
+        if (iov_count == FRAME_BATCH)
+        {
+            ret = send_batch(client_fd, conn, iov, iov_count);
+            if (ret != SERVE_CONN_SUCCESS)
+            {
+                return ret;
+            }
+            iov_count = 0;
+            batch_len = 0;
+        }
+    }
+
+    ret = send_batch(client_fd, conn, iov, iov_count);
+    if (ret != SERVE_CONN_SUCCESS)
+    {
+        return ret;
+    }
+
+    // Move what is left to the front.
+    memmove(conn->in, conn->in + off, conn->in_len - off);
+    conn->in_len -= off;
+    return SERVE_CONN_SUCCESS;
+}
+
+int serve_connection (int client_fd)
+{
+    conn_t          *conn = &conns[client_fd];
+    int             ret = SERVE_CONN_SUCCESS;
+
+    // We have something to do. Lease a buffer, unless we
+    // are still holding on to one.
+    if (conn->in == NULL)
+    {
+        conn->in = buf_pool_lease(&pool);
+        conn->in_len = 0;
+    }
+
+    // Edge-triggered: Keep going till there is nothing to read.
+    // Or till the client has too much waiting for it. We come
+    // back here once it has taken some (EPOLLOUT).
+    while (1)
+    {
+        // Whatever we have first. There could be frames left over
+        // from when we were paused.
+        ret = process_frames(client_fd, conn);
+        if (ret != SERVE_CONN_SUCCESS || conn->paused == true)
+        {
+            break;
+        }
+
+        // Get the data. After process_frames, the buffer has at
+        // most one partial frame, which is smaller than the buffer.
+        ret = recv(client_fd, conn->in + conn->in_len, FRAME_MAX_LEN - conn->in_len, 0);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // All caught up. epoll will let us know
+                // when there is more.
+                ret = SERVE_CONN_SUCCESS;
+                break;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+
+            printf("recv() failed for fd = %d\n", client_fd);
+            ret = SERVE_CONN_FAILED;
+            break;
+        }
+        else if (ret == 0)
+        {
+            // This is the case when the other side of the
+            // connection has disconnected (at least its sending side).
+            // Whatever is parked still goes out. A partial frame
+            // never will be complete - drop it.
+            conn->read_closed = true;
+            conn->in_len = 0;
+            ret = (out_ring_len(&conn->out) > 0) ? SERVE_CONN_SUCCESS : SERVE_CONN_CLIENT_DISCONN;
+            break;
+        }
+
+        conn->in_len += ret;
+    }
+
+    // Idle connections hold no buffer.
+    if (conn->in_len == 0)
+    {
+        buf_pool_return(&pool, conn->in);
+        conn->in = NULL;
+    }
+    return ret;
+}
+
+// Socket is writable. Send what is parked.
+int flush_connection (int client_fd)
+{
+    conn_t      *conn = &conns[client_fd];
+    int         ret = 0;
+
+    ret = out_ring_flush(&conn->out, client_fd);
+    if (ret < 0)
+    {
+        printf("send() failed for fd = %d\n", client_fd);
+        return SERVE_CONN_FAILED;
+    }
+
+    // Client was done sending and has got everything back.
+    if (conn->read_closed == true && out_ring_len(&conn->out) == 0)
+    {
+        return SERVE_CONN_CLIENT_DISCONN;
+    }
+
+    // Enough room again. Reading resumes.
+    if (out_ring_len(&conn->out) <= OUT_RING_LOW_WATER)
+    {
+        conn->paused = false;
+    }
+    return SERVE_CONN_SUCCESS;
+}
+
+// Asks for EPOLLOUT only while something is parked.
+// A socket is writable almost all the time. With nothing to
+// send, EPOLLOUT would just be noise.
+int update_interest (int epoll_fd, int client_fd)
+{
+    conn_t              *conn = &conns[client_fd];
+    struct epoll_event  event = {0};
+
+    event.events = EPOLLIN | EPOLLET;
+    if (out_ring_len(&conn->out) > 0)
+    {
+        event.events |= EPOLLOUT;
+    }
+    if (event.events == conn->events)
+    {
+        return 0;
+    }
+
+    event.data.fd = client_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_fd, &event) < 0)
+    {
+        printf("epoll_ctl() failed for fd = %d\n", client_fd);
+        return -1;
+    }
+    conn->events = event.events;
+    return 0;
+}
+
+void close_connection (int client_fd)
+{
+    conn_t      *conn = &conns[client_fd];
+
+    out_ring_free(&conn->out);
+    if (conn->in != NULL)
+    {
+        buf_pool_return(&pool, conn->in);
+        conn->in = NULL;
+    }
+
+    // Closing the descriptor removes it from epoll as well.
+    close(client_fd);
+}
+
+// Out of descriptors (EMFILE/ENFILE). The connection requests stay
+// in the backlog, and edge-triggered epoll won't report them again
+// till yet another one comes in - they just hang. So we turn the
+// oldest one away: give up the spare descriptor, accept with it,
+// close right away and take the spare back. The client sees its
+// connection closed instead of waiting forever.
+// Returns 0 if one was turned away, -1 if the backlog is empty
+// (or there is no spare).
+int turn_away_connection (int sock_fd)
+{
+    int     fd = -1;
+
+    if (spare_fd < 0)
+    {
+        return -1;
+    }
+
+    close(spare_fd);
+    while (1)
+    {
+        fd = accept(sock_fd, NULL, NULL);
+        if (fd >= 0 || (errno != EINTR && errno != ECONNABORTED))
+        {
+            break;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    // With ENFILE somebody else might beat us to it. Then there
+    // is no spare next time, and we are back to hanging clients.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return (fd >= 0) ? 0 : -1;
+}
+
+// Accepts all outstanding connection requests and asks
+// epoll to monitor them.
+// Returns 0 on success, -1 if the server socket has a problem.
+int accept_connections (int epoll_fd, int sock_fd)
+{
+    int                 ret = 0;
+    int                 client_fd = 0;
+    struct epoll_event  event = {0};
+    int                 err = 0;
+    int                 turned_away = 0;
+
+    // Edge-triggered: Accept till there is nothing left in the backlog.
+    while (1)
+    {
+        ret = accept4(sock_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Backlog is empty.
+                return 0;
+            }
+            else if (errno == EINTR || errno == ECONNABORTED)
+            {
+                // Client gave up before we could accept it.
+                // Nothing to worry.
+                continue;
+            }
+
+            // Out of descriptors. Whoever waits in the backlog
+            // would hang. Turn them all away.
+            err = errno;
+            if (err == EMFILE || err == ENFILE)
+            {
+                while (turn_away_connection(sock_fd) == 0)
+                {
+                    turned_away += 1;
+                }
+            }
+            printf("accept() failed, errno = %d. Turned away %d waiting connections\n", err, turned_away);
+            return 0;
+        }
+        client_fd = ret;
+
+        // Fresh state for the connection.
+        if (conns_reserve(client_fd) < 0)
+        {
+            printf("realloc() failed for fd = %d\n", client_fd);
+            close(client_fd);
+            continue;
+        }
+        memset(&conns[client_fd], '\0', sizeof(conn_t));
+
+        // We have a new socket descriptor. Let us add it.
+        // EPOLLOUT is added only when something is parked.
+        memset(&event, '\0', sizeof(event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = client_fd;
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+        if (ret < 0)
+        {
+            printf("epoll_ctl() failed for fd = %d\n", client_fd);
+            close(client_fd);
+            continue;
+        }
+        conns[client_fd].events = event.events;
+    }
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number]\n", argv[0]);
+        return 0;
+    }
+
+    int                 sock_fd = 0;
+    int                 epoll_fd = 0;
+    int                 client_fd = 0;
+    int                 ret = 0;
+    int                 i = 0;
+    struct sockaddr_in  server_addr = {0};
+    const char          *ip_addr = argv[1];
+    uint16_t            port_no = atoi(argv[2]);
+    struct epoll_event  event = {0};
+    struct epoll_event  events[MAX_EVENTS];
+    int                 ready_fd_count = 0;
+
+    buf_pool_init(&pool);
+
+    // Lets create a socket.
+    // The server socket is non-blocking, so that we can
+    // accept till the backlog is empty.
+    ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    sock_fd = ret;
+
+    // Bind the socket to the passed (ip_address, port_no).
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    ret = bind(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("bind() failed\n");
+        return -1;
+    }
+
+    // Start listening
+    ret = listen(sock_fd, 50);
+    if (ret < 0)
+    {
+        printf("listen() failed\n");
+        return -1;
+    }
+
+    // One descriptor in reserve, for when we run out.
+    // Without it we still run, clients just hang then.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    printf("Listening at (%s, %u)\n", ip_addr, port_no);
+
+    // Create the epoll instance.
+    ret = epoll_create1(EPOLL_CLOEXEC);
+    if (ret < 0)
+    {
+        printf("epoll_create1() failed\n");
+        return -1;
+    }
+    epoll_fd = ret;
+
+    // Add the server socket.
+    // EPOLLEXCLUSIVE: If more than one epoll instance (one per
+    // process or thread) is monitoring this server socket, only
+    // one of them is woken up per connection request instead of
+    // all of them (thundering herd).
+    // With a single epoll instance, it makes no difference.
+    // Older kernels (< 4.5) don't know about it. Fall back.
+    event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    event.data.fd = sock_fd;
+    ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event);
+    if (ret < 0 && errno == EINVAL)
+    {
+        event.events = EPOLLIN | EPOLLET;
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event);
+    }
+    if (ret < 0)
+    {
+        printf("epoll_ctl() failed for server descriptor\n");
+        return -1;
+    }
+
+    // Do the thing
+    while (1)
+    {
+        ret = epoll_wait(epoll_fd, events, MAX_EVENTS, -1 /* Infinite timeout */);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("epoll_wait() failed\n");
+            return -1;
+        }
+        ready_fd_count = ret;
+
+        // Unlike poll, we only go over the ready descriptors.
+        for (i = 0; i < ready_fd_count; i++)
+        {
+            // Server socket related things.
+            if (events[i].data.fd == sock_fd)
+            {
+                if (events[i].events & EPOLLERR)
+                {
+                    // Some error occured while monitoring the server socket.
+                    // Let us kill the server.
+                    printf("epoll_wait() error(EPOLLERR) on server descriptor. Exiting...\n");
+                    exit(-1);
+                }
+
+                // There are new connection requests, process them.
+                accept_connections(epoll_fd, sock_fd);
+                continue;
+            }
+
+            // Onto the clients.
+            client_fd = events[i].data.fd;
+
+            // Check for error or if client closed connection.
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                close_connection(client_fd);
+                continue;
+            }
+
+            ret = SERVE_CONN_SUCCESS;
+
+            // Send out what is parked first. It might make
+            // room for more reading.
+            if (events[i].events & EPOLLOUT)
+            {
+                ret = flush_connection(client_fd);
+            }
+
+            // Let us serve the connection. Also when reading was
+            // paused and the flush above made room - there might be
+            // data we left in the socket, and edge-triggered epoll
+            // won't tell us about it again.
+            if (ret == SERVE_CONN_SUCCESS && conns[client_fd].read_closed == false &&
+                (events[i].events & (EPOLLIN | EPOLLOUT)))
+            {
+                ret = serve_connection(client_fd);
+            }
+
+            if (ret != SERVE_CONN_SUCCESS || update_interest(epoll_fd, client_fd) < 0)
+            {
+                close_connection(client_fd);
+            }
+        }
+    }
+}
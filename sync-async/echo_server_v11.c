@@ -0,0 +1,419 @@
+/*
+ * echo_server_v11.c
+ *
+ * UDP echo server, batched.
+ * - All the other servers are TCP. For small messages, most of the
+ *   time goes into the syscalls, not into the bytes. One recvfrom()
+ *   and one sendto() per datagram is two trips into the kernel for
+ *   a few dozen bytes.
+ * - recvmmsg() picks up to --batch datagrams in one go and sendmmsg()
+ *   sends all the echoes back in one go. Two syscalls per batch.
+ * - Where the kernel supports it, UDP GRO is turned on: datagrams
+ *   from the same sender can come up coalesced into one big buffer,
+ *   with the size of each datagram in a control message. We send the
+ *   whole buffer back with UDP GSO (UDP_SEGMENT) and the kernel splits
+ *   it into the same datagrams again. We turn on GRO only if GSO works
+ *   too - otherwise we could not echo it back as it came.
+ * - Like echo_server_v6.c: N threads, each pinned to one of our CPUs
+ *   (affinity.h) with its own socket bound with SO_REUSEPORT. The
+ *   kernel spreads the senders across them. Nothing is shared.
+ * - Send SIGUSR1 to print how many datagrams each thread echoed and
+ *   how many it got per recvmmsg().
+ *
+ * Try it with udp_load_gen.c.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include "affinity.h"
+
+// A GRO buffer can hold up to 64KB worth of datagrams.
+// Without GRO this is the largest datagram there is.
+#define UDP_BUF_SIZE    65536
+
+// recvmmsg()/sendmmsg() take at most these many messages.
+#define MAX_BATCH       1024
+
+// Room for one UDP_GRO/UDP_SEGMENT control message.
+#define CMSG_BUF_SIZE   CMSG_SPACE(sizeof(int))
+
+// Everything one thread owns.
+typedef struct worker
+{
+    int                 id;
+    int                 sock_fd;
+
+    // CPU it pins itself to. -1 if we don't know which
+    // CPUs are ours.
+    int                 cpu;
+
+    // Is GRO on for this socket?
+    bool                gro;
+
+    // What recvmmsg() fills in. One buffer, one address and one
+    // control message per slot.
+    struct mmsghdr      *in;
+    struct iovec        *in_iov;
+    struct sockaddr_in  *addrs;
+    uint8_t             *bufs;
+    uint8_t             *in_cmsgs;
+
+    // What sendmmsg() sends. Points at the same buffers.
+    struct mmsghdr      *out;
+    struct iovec        *out_iov;
+    uint8_t             *out_cmsgs;
+
+    // Only this thread writes these. main reads them.
+    uint64_t            datagrams;
+    uint64_t            calls;
+    uint64_t            coalesced;
+
+    pthread_t           tinfo;
+} worker_t;
+
+// Address all the threads are bound to.
+static struct sockaddr_in   server_addr;
+
+// Datagrams per recvmmsg()/sendmmsg().
+static int                  batch = 32;
+
+#define STAT_STORE(field, value)    __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define STAT_LOAD(field)            __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+// Creates the thread's own socket and its batch of buffers.
+int worker_init (worker_t *worker, int id)
+{
+    int     ret = 0;
+    int     one = 1;
+    int     zero = 0;
+    int     i = 0;
+
+    memset(worker, '\0', sizeof(worker_t));
+    worker->id = id;
+
+    ret = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    worker->sock_fd = ret;
+
+    // Every thread binds to the same (address, port). The kernel
+    // picks a socket per datagram based on a hash of the sender's
+    // address, so one sender always lands on the same thread.
+    ret = setsockopt(worker->sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (ret < 0)
+    {
+        printf("setsockopt(SO_REUSEPORT) failed\n");
+        return -1;
+    }
+
+    // Can we send with GSO? Setting a segment size of 0 just
+    // checks - it means "no GSO unless a control message says so".
+    // Only then do we ask for GRO.
+    if (setsockopt(worker->sock_fd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0 &&
+        setsockopt(worker->sock_fd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0)
+    {
+        worker->gro = true;
+    }
+
+    ret = bind(worker->sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("bind() failed\n");
+        return -1;
+    }
+
+    worker->in = calloc(batch, sizeof(struct mmsghdr));
+    worker->in_iov = calloc(batch, sizeof(struct iovec));
+    worker->addrs = calloc(batch, sizeof(struct sockaddr_in));
+    worker->bufs = malloc((size_t)batch * UDP_BUF_SIZE);
+    worker->in_cmsgs = calloc(batch, CMSG_BUF_SIZE);
+    worker->out = calloc(batch, sizeof(struct mmsghdr));
+    worker->out_iov = calloc(batch, sizeof(struct iovec));
+    worker->out_cmsgs = calloc(batch, CMSG_BUF_SIZE);
+    if (worker->in == NULL || worker->in_iov == NULL || worker->addrs == NULL ||
+        worker->bufs == NULL || worker->in_cmsgs == NULL || worker->out == NULL ||
+        worker->out_iov == NULL || worker->out_cmsgs == NULL)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+
+    // Only lengths, addresses and control messages change
+    // from one batch to the next. Set up the rest once.
+    for (i = 0; i < batch; i++)
+    {
+        worker->in_iov[i].iov_base = worker->bufs + (size_t)i * UDP_BUF_SIZE;
+        worker->in_iov[i].iov_len = UDP_BUF_SIZE;
+        worker->in[i].msg_hdr.msg_iov = &worker->in_iov[i];
+        worker->in[i].msg_hdr.msg_iovlen = 1;
+        worker->in[i].msg_hdr.msg_name = &worker->addrs[i];
+        worker->out_iov[i].iov_base = worker->in_iov[i].iov_base;
+        worker->out[i].msg_hdr.msg_iov = &worker->out_iov[i];
+        worker->out[i].msg_hdr.msg_iovlen = 1;
+        worker->out[i].msg_hdr.msg_name = &worker->addrs[i];
+    }
+
+    return 0;
+}
+
+// Size of each datagram in a coalesced buffer, 0 if it isn't one.
+int gro_segment_size (struct msghdr *msg)
+{
+    struct cmsghdr  *cmsg = NULL;
+    int             size = 0;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+        {
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size;
+        }
+    }
+    return 0;
+}
+
+// Turns what recvmmsg() got into what sendmmsg() sends.
+// The echoes go out of the same buffers.
+void prepare_echoes (worker_t *worker, int count)
+{
+    struct msghdr   *in = NULL;
+    struct msghdr   *out = NULL;
+    struct cmsghdr  *cmsg = NULL;
+    int             segment_size = 0;
+    uint16_t        gso_size = 0;
+    int             i = 0;
+
+    for (i = 0; i < count; i++)
+    {
+        in = &worker->in[i].msg_hdr;
+        out = &worker->out[i].msg_hdr;
+
+        worker->out_iov[i].iov_len = worker->in[i].msg_len;
+        out->msg_namelen = in->msg_namelen;
+        out->msg_control = NULL;
+        out->msg_controllen = 0;
+
+        segment_size = worker->gro ? gro_segment_size(in) : 0;
+        if (segment_size > 0 && (unsigned int)segment_size < worker->in[i].msg_len)
+        {
+            // Several datagrams in one buffer.
+            // Ask the kernel to cut it up the same way.
+            out->msg_control = worker->out_cmsgs + (size_t)i * CMSG_BUF_SIZE;
+            out->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+            cmsg = CMSG_FIRSTHDR(out);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            gso_size = segment_size;
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+
+            STAT_STORE(worker->datagrams,
+                       worker->datagrams + (worker->in[i].msg_len + segment_size - 1) / segment_size);
+            STAT_STORE(worker->coalesced, worker->coalesced + 1);
+        }
+        else
+        {
+            STAT_STORE(worker->datagrams, worker->datagrams + 1);
+        }
+    }
+}
+
+// Sends all count echoes, however many sendmmsg() calls it takes.
+void send_echoes (worker_t *worker, int count)
+{
+    int     sent = 0;
+    int     ret = 0;
+
+    while (sent < count)
+    {
+        ret = sendmmsg(worker->sock_fd, worker->out + sent, count - sent, 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            // The first message of what is left failed.
+            // It's UDP - drop it and go on with the rest.
+            sent += 1;
+            continue;
+        }
+        sent += ret;
+    }
+}
+
+void* worker_run (void *arg)
+{
+    worker_t        *worker = arg;
+    int             ret = 0;
+    int             count = 0;
+    int             i = 0;
+
+    // Pin ourselves to our CPU, like echo_server_v6.c does.
+    ret = affinity_pin(worker->cpu);
+    if (ret != 0)
+    {
+        printf("worker %d: pthread_setaffinity_np() failed for CPU %d\n", worker->id, worker->cpu);
+    }
+
+    while (1)
+    {
+        // recvmmsg() overwrites these. Reset them every time.
+        for (i = 0; i < batch; i++)
+        {
+            worker->in[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            worker->in[i].msg_hdr.msg_control = worker->in_cmsgs + (size_t)i * CMSG_BUF_SIZE;
+            worker->in[i].msg_hdr.msg_controllen = CMSG_BUF_SIZE;
+        }
+
+        // Block till there is at least one datagram, then take
+        // whatever else is already there, up to batch.
+        ret = recvmmsg(worker->sock_fd, worker->in, batch, MSG_WAITFORONE, NULL);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("worker %d: recvmmsg() failed, errno = %d\n", worker->id, errno);
+            exit(-1);
+        }
+        count = ret;
+
+        prepare_echoes(worker, count);
+        send_echoes(worker, count);
+
+        STAT_STORE(worker->calls, worker->calls + 1);
+    }
+
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 3 || argc % 2 == 0)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number] [--threads N] [--batch B]\n", argv[0]);
+        printf("N defaults to the number of CPUs we may run on, B to 32\n");
+        return 0;
+    }
+
+    int                 ret = 0;
+    int                 i = 0;
+    const char          *ip_addr = argv[1];
+    uint16_t            port_no = atoi(argv[2]);
+    long                thread_count = 0;
+    int                 cpus[CPU_SETSIZE];
+    int                 cpu_count = 0;
+    worker_t            *workers = NULL;
+    sigset_t            sigs;
+    uint64_t            datagrams = 0;
+    uint64_t            calls = 0;
+    uint64_t            coalesced = 0;
+
+    // Before any thread pins itself.
+    cpu_count = affinity_cpus(cpus);
+    thread_count = cpu_count;
+    for (i = 3; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--threads") == 0)
+        {
+            thread_count = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--batch") == 0)
+        {
+            batch = atoi(argv[i + 1]);
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+    if (thread_count <= 0)
+    {
+        thread_count = 1;
+    }
+    if (batch <= 0 || batch > MAX_BATCH)
+    {
+        printf("batch should be in [1, %d]\n", MAX_BATCH);
+        return -1;
+    }
+
+    server_addr.sin_port = htons(port_no);
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(ip_addr);
+
+    workers = calloc(thread_count, sizeof(worker_t));
+    if (workers == NULL)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+
+    // Set up all the sockets before starting any thread.
+    for (i = 0; i < thread_count; i++)
+    {
+        ret = worker_init(&workers[i], i);
+        if (ret < 0)
+        {
+            printf("worker_init() failed for worker %d\n", i);
+            return -1;
+        }
+        workers[i].cpu = (cpu_count > 0) ? cpus[i % cpu_count] : -1;
+    }
+    printf("Listening at (%s, %u) with %ld threads, batch %d, GRO/GSO %s\n",
+           ip_addr, port_no, thread_count, batch, workers[0].gro ? "on" : "off");
+
+    // SIGUSR1 is for us, not the workers.
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    for (i = 0; i < thread_count; i++)
+    {
+        ret = pthread_create(&workers[i].tinfo, NULL, worker_run, &workers[i]);
+        if (ret != 0)
+        {
+            printf("pthread_create() failed for worker %d\n", i);
+            return -1;
+        }
+    }
+
+    while (1)
+    {
+        if (sigwaitinfo(&sigs, NULL) != SIGUSR1)
+        {
+            continue;
+        }
+
+        for (i = 0; i < thread_count; i++)
+        {
+            datagrams = STAT_LOAD(workers[i].datagrams);
+            calls = STAT_LOAD(workers[i].calls);
+            coalesced = STAT_LOAD(workers[i].coalesced);
+            printf("worker %d: %lu datagrams, %lu recvmmsg() calls (%.1f per call), %lu GRO buffers\n",
+                   i, datagrams, calls, calls ? (double)datagrams / calls : 0.0, coalesced);
+        }
+        fflush(stdout);
+    }
+
+    return 0;
+}
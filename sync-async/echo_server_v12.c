@@ -0,0 +1,414 @@
+/*
+ * echo_server_v12.c
+ *
+ * echo_server_v0.c's serve_connection, run as coroutines on an
+ * epoll reactor.
+ * - serve_connection below reads like v0's: recv, send it all back,
+ *   repeat till the client goes away. Where v0 blocks, it yields
+ *   (coro.h) and the reactor serves somebody else.
+ * - One coroutine per connection. What has to survive a yield -
+ *   the buffer, lengths - lives in conn_t. That is all a coroutine
+ *   costs: CONN_BUF_SIZE plus a few bytes.
+ * - Edge-triggered epoll, EPOLLIN | EPOLLOUT registered once. A
+ *   coroutine is resumed only for the events it waits for, so no
+ *   epoll_ctl when it switches between waiting to read and waiting
+ *   to write.
+ * - A client which never stops sending would keep its coroutine
+ *   going forever. After CONN_BUDGET echoes it yields and goes to
+ *   the back of the run queue.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include "coro.h"
+
+// Maximum number of ready descriptors epoll_wait
+// can hand back in one go.
+#define MAX_EVENTS      1024
+
+// Per-connection buffer. Few KB per coroutine.
+#define CONN_BUF_SIZE   4096
+
+// Echoes before a coroutine lets the others run.
+#define CONN_BUDGET     16
+
+// Everything a connection's coroutine needs across yields.
+typedef struct conn
+{
+    coro_t          co;
+    int             fd;
+
+    uint8_t         buf[CONN_BUF_SIZE];
+    int             len;
+    int             off;
+    int             ret;
+    int             echoes;
+
+    // On the run queue?
+    bool            queued;
+    struct conn     *next;
+} conn_t;
+
+// Connection table. Indexed by descriptor, grows as bigger
+// descriptors show up. Connections themselves are malloc'd, so
+// a conn_t never moves while its coroutine is suspended.
+static conn_t       **conns = NULL;
+static uint64_t     conns_capacity = 0;
+
+// Kept open only to be given up when we run out of
+// descriptors. See turn_away_connection.
+static int          spare_fd = -1;
+
+// Coroutines which yielded without waiting for anything.
+static conn_t       *run_head = NULL;
+static conn_t       *run_tail = NULL;
+
+// Makes sure the connection table can hold the passed descriptor.
+int conns_reserve (int fd)
+{
+    uint64_t    new_capacity = 0;
+    conn_t      **temp = NULL;
+
+    if ((uint64_t)fd < conns_capacity)
+    {
+        return 0;
+    }
+
+    new_capacity = conns_capacity ? conns_capacity : 1024;
+    while (new_capacity <= (uint64_t)fd)
+    {
+        new_capacity *= 2;
+    }
+
+    temp = realloc(conns, sizeof(conn_t *) * new_capacity);
+    if (temp == NULL)
+    {
+        return -1;
+    }
+    memset(temp + conns_capacity, '\0', sizeof(conn_t *) * (new_capacity - conns_capacity));
+
+    conns = temp;
+    conns_capacity = new_capacity;
+    return 0;
+}
+
+// The echo loop from echo_server_v0.c.
+// Returns CORO_WAITING when it yields, CORO_DONE once the
+// connection should be closed.
+int serve_connection (conn_t *conn)
+{
+    coro_t      *co = &conn->co;
+
+    CORO_BEGIN(co);
+
+    while (1)
+    {
+        // Wait here till you get some data.
+        CORO_RECV(co, conn->ret, conn->fd, conn->buf, sizeof(conn->buf));
+        if (conn->ret < 0)
+        {
+            printf("recv() failed for fd = %d\n", conn->fd);
+            break;
+        }
+        else if (conn->ret == 0)
+        {
+            // This is the case when the other side of the
+            // connection has disconnected.
+            break;
+        }
+        conn->len = conn->ret;
+
+        // You send back the same data.
+        // Waits here while the client isn't reading.
+        CORO_SEND_ALL(co, conn->ret, conn->fd, conn->buf, conn->len, conn->off);
+        if (conn->ret < 0)
+        {
+            printf("send() failed for fd = %d\n", conn->fd);
+            break;
+        }
+
+        // Let the others have a go.
+        conn->echoes += 1;
+        if (conn->echoes == CONN_BUDGET)
+        {
+            conn->echoes = 0;
+            CORO_YIELD(co);
+        }
+    }
+
+    CORO_END(co);
+}
+
+void close_connection (conn_t *conn)
+{
+    // Closing also takes it out of epoll.
+    close(conn->fd);
+    conns[conn->fd] = NULL;
+    free(conn);
+}
+
+// Runs the coroutine till it yields. Cleans up if it is done.
+void resume (conn_t *conn)
+{
+    if (serve_connection(conn) == CORO_DONE)
+    {
+        close_connection(conn);
+        return;
+    }
+
+    // Yielded without waiting for anything. Run it again soon.
+    if (conn->co.wait == 0)
+    {
+        conn->queued = true;
+        conn->next = NULL;
+        if (run_tail != NULL)
+        {
+            run_tail->next = conn;
+        }
+        else
+        {
+            run_head = conn;
+        }
+        run_tail = conn;
+    }
+}
+
+// Out of descriptors (EMFILE/ENFILE). The connection requests stay
+// in the backlog, and edge-triggered epoll won't report them again
+// till yet another one comes in - they just hang. So we turn the
+// oldest one away: give up the spare descriptor, accept with it,
+// close right away and take the spare back. The client sees its
+// connection closed instead of waiting forever.
+// Returns 0 if one was turned away, -1 if the backlog is empty
+// (or there is no spare).
+int turn_away_connection (int sock_fd)
+{
+    int     fd = -1;
+
+    if (spare_fd < 0)
+    {
+        return -1;
+    }
+
+    close(spare_fd);
+    while (1)
+    {
+        fd = accept(sock_fd, NULL, NULL);
+        if (fd >= 0 || (errno != EINTR && errno != ECONNABORTED))
+        {
+            break;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    // With ENFILE somebody else might beat us to it. Then there
+    // is no spare next time, and we are back to hanging clients.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return (fd >= 0) ? 0 : -1;
+}
+
+// Accepts all outstanding connection requests and
+// starts a coroutine for each.
+void accept_connections (int epoll_fd, int sock_fd)
+{
+    int                 ret = 0;
+    int                 client_fd = 0;
+    conn_t              *conn = NULL;
+    struct epoll_event  event = {0};
+    int                 err = 0;
+    int                 turned_away = 0;
+
+    // Edge-triggered: Accept till there is nothing left in the backlog.
+    while (1)
+    {
+        ret = accept4(sock_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            else if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            // Out of descriptors. Whoever waits in the backlog
+            // would hang. Turn them all away.
+            err = errno;
+            if (err == EMFILE || err == ENFILE)
+            {
+                while (turn_away_connection(sock_fd) == 0)
+                {
+                    turned_away += 1;
+                }
+            }
+            printf("accept() failed, errno = %d. Turned away %d waiting connections\n", err, turned_away);
+            return;
+        }
+        client_fd = ret;
+
+        conn = malloc(sizeof(conn_t));
+        if (conn == NULL || conns_reserve(client_fd) < 0)
+        {
+            printf("malloc() failed for fd = %d\n", client_fd);
+            free(conn);
+            close(client_fd);
+            continue;
+        }
+        CORO_INIT(&conn->co);
+        conn->fd = client_fd;
+        conn->echoes = 0;
+        conn->queued = false;
+        conns[client_fd] = conn;
+
+        memset(&event, '\0', sizeof(event));
+        event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+        event.data.fd = client_fd;
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+        if (ret < 0)
+        {
+            printf("epoll_ctl() failed for fd = %d\n", client_fd);
+            close_connection(conn);
+            continue;
+        }
+
+        // Off it goes, till its first recv has nothing.
+        resume(conn);
+    }
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number]\n", argv[0]);
+        return 0;
+    }
+
+    int                 sock_fd = 0;
+    int                 epoll_fd = 0;
+    int                 ret = 0;
+    int                 i = 0;
+    struct sockaddr_in  server_addr = {0};
+    const char          *ip_addr = argv[1];
+    uint16_t            port_no = atoi(argv[2]);
+    struct epoll_event  event = {0};
+    struct epoll_event  events[MAX_EVENTS];
+    int                 ready_fd_count = 0;
+    conn_t              *conn = NULL;
+    conn_t              *runnable = NULL;
+
+    // Lets create a socket.
+    ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    sock_fd = ret;
+
+    // Bind the socket to the passed (ip_address, port_no).
+    server_addr.sin_port = htons(port_no);
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(ip_addr);
+
+    ret = bind(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("bind() failed\n");
+        return -1;
+    }
+
+    // Start listening
+    ret = listen(sock_fd, SOMAXCONN);
+    if (ret < 0)
+    {
+        printf("listen() failed\n");
+        return -1;
+    }
+
+    // One descriptor in reserve, for when we run out.
+    // Without it we still run, clients just hang then.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    printf("Listening at (%s, %u)\n", ip_addr, port_no);
+
+    ret = epoll_create1(EPOLL_CLOEXEC);
+    if (ret < 0)
+    {
+        printf("epoll_create1() failed\n");
+        return -1;
+    }
+    epoll_fd = ret;
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = sock_fd;
+    ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event);
+    if (ret < 0)
+    {
+        printf("epoll_ctl() failed for server descriptor\n");
+        return -1;
+    }
+
+    while (1)
+    {
+        // Somebody is waiting to run? Just check, don't sleep.
+        ret = epoll_wait(epoll_fd, events, MAX_EVENTS, run_head ? 0 : -1);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("epoll_wait() failed\n");
+            return -1;
+        }
+        ready_fd_count = ret;
+
+        for (i = 0; i < ready_fd_count; i++)
+        {
+            if (events[i].data.fd == sock_fd)
+            {
+                accept_connections(epoll_fd, sock_fd);
+                continue;
+            }
+
+            // Resume it only if this is what it waits for.
+            // Errors and hang-ups wake it up whatever it waits
+            // for - its recv or send will find out.
+            conn = conns[events[i].data.fd];
+            if (conn != NULL && conn->queued == false &&
+                (events[i].events & (conn->co.wait | EPOLLERR | EPOLLHUP)))
+            {
+                resume(conn);
+            }
+        }
+
+        // Run the ones which yielded. Whoever yields again now
+        // goes on a fresh queue, for the next round.
+        runnable = run_head;
+        run_head = NULL;
+        run_tail = NULL;
+        while (runnable != NULL)
+        {
+            conn = runnable;
+            runnable = runnable->next;
+            conn->queued = false;
+            resume(conn);
+        }
+    }
+}
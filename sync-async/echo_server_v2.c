@@ -1,8 +1,30 @@
 /*
  * echo_server_v2.c
- * 
- * An attempt to implement polling and use non-blocking calls 
+ *
+ * An attempt to implement polling and use non-blocking calls
  * to work our way through the blocking problem.
+ * - The first version of this slept for whole seconds between passes,
+ *   and every pass called recv 100 times on each of 1024 possible
+ *   descriptors. Seconds of latency and ~100k wasted syscalls a pass.
+ * - Now we poll a readiness API instead: epoll_wait with a 0 timeout
+ *   tells us which descriptors have something, without sleeping.
+ *   We only touch those.
+ * - Spinning on it gives the lowest latency - nobody has to wake us
+ *   up - but burns a core even when there is nothing to do. Blocking
+ *   in epoll_wait is the other way round. --mode picks:
+ *      - block:    always block. Cheapest, a wakeup on every event.
+ *      - spin:     never block. For hosts where latency is all that
+ *                  matters and a core is set aside for this.
+ *      - adaptive: (default) spin for a while after the last event,
+ *                  then block. How long to spin adapts, like KVM's
+ *                  halt polling: if the next event came in soon after
+ *                  we gave up, spinning a bit longer would have caught
+ *                  it - double the spin. If it took longer than the
+ *                  longest spin we allow, spinning was a waste - halve
+ *                  it. --spin-us caps it.
+ * - Client sockets are non-blocking, so send can take only part of
+ *   an echo. The rest is parked in the client's out_ring and we
+ *   wait for EPOLLOUT instead of EPOLLIN till it has gone out.
  */
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -16,167 +38,348 @@
 #include <unistd.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include "log.h"
+#include "out_ring.h"
 
-void poll_for_new_conn_requests (int server_fd, bool *fds_list)
+// Maximum number of ready descriptors epoll_wait
+// can hand back in one go.
+#define MAX_EVENTS          1024
+
+// Client descriptors at or above this are turned away.
+// Parked echoes are looked up by descriptor.
+#define MAX_CLIENT_FD       65536
+
+// Where an adaptive spin starts growing from, in ns.
+#define SPIN_GROW_START_NS  2000
+
+enum
 {
-    int                     ret = 0;
-    int                     i = 0;
-    int                     client_fd = 0;
-    struct sockaddr_in      client_addr = {0};
-    socklen_t               client_addr_len = 0;
+    MODE_BLOCK = 0,
+    MODE_SPIN,
+    MODE_ADAPTIVE,
+};
 
-    printf("poll_for_new_conn_requests invoked\n");
+// How we wait for events. See the top of the file.
+typedef struct waiter
+{
+    int         mode;
 
-    // Simply call it 50 times.
-    // Will help when there is a surge of new requests.
-    for (i = 0; i < 50; i++)
+    // Current and maximum spin, in ns.
+    uint64_t    spin_ns;
+    uint64_t    spin_max_ns;
+
+    // How often spinning found something, and how often
+    // we ended up blocking.
+    uint64_t    spin_hits;
+    uint64_t    blocks;
+} waiter_t;
+
+// What send couldn't take yet, per client descriptor.
+out_ring_t  parked[MAX_CLIENT_FD];
+
+uint64_t now_ns ()
+{
+    struct timespec     ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Waits for events the way the mode says.
+// Returns what epoll_wait returns.
+int wait_for_events (waiter_t *waiter, int epoll_fd, struct epoll_event *events)
+{
+    int         ret = 0;
+    uint64_t    start = 0;
+    uint64_t    blocked = 0;
+
+    if (waiter->mode != MODE_BLOCK)
     {
-        // Poll for new requests by calling accept.
-        ret = accept4(server_fd, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_NONBLOCK);
-        printf("accept4() returned %d\n", ret);
-        if (ret > 0)
+        start = now_ns();
+        while (1)
         {
-            // Success case: We have a new socket!
-            client_fd = ret;
-            
-            // Reaching here means accept ret has a new
-            // descriptor. We handle only 1023 descriptors. Note it.
-            if (client_fd >= 1024)
+            // Anything ready? Don't sleep if not.
+            ret = epoll_wait(epoll_fd, events, MAX_EVENTS, 0);
+            if (ret != 0)
             {
-                close(client_fd);
+                waiter->spin_hits += (ret > 0);
+                return ret;
             }
-            else
+            if (waiter->mode == MODE_ADAPTIVE && now_ns() - start >= waiter->spin_ns)
             {
-                fds_list[client_fd] = true;
+                break;
             }
         }
-        else if (ret < 0)
-        {   
+    }
+
+    // Nothing came in while we spun. Sleep till something does.
+    start = now_ns();
+    ret = epoll_wait(epoll_fd, events, MAX_EVENTS, -1 /* Infinite timeout */);
+    blocked = now_ns() - start;
+    waiter->blocks += 1;
+
+    if (waiter->mode == MODE_ADAPTIVE)
+    {
+        if (blocked <= waiter->spin_max_ns)
+        {
+            // A longer spin would have caught it.
+            waiter->spin_ns = (waiter->spin_ns < SPIN_GROW_START_NS) ? SPIN_GROW_START_NS : waiter->spin_ns * 2;
+            if (waiter->spin_ns > waiter->spin_max_ns)
+            {
+                waiter->spin_ns = waiter->spin_max_ns;
+            }
+        }
+        else
+        {
+            // Idle for a while. Spinning didn't help.
+            waiter->spin_ns /= 2;
+        }
+    }
+    return ret;
+}
+
+// Accepts all outstanding connection requests and
+// asks epoll to watch them.
+void poll_for_new_conn_requests (int server_fd, int epoll_fd)
+{
+    int                     ret = 0;
+    int                     i = 0;
+    int                     client_fd = 0;
+    struct epoll_event      event = {0};
+
+    LOG_DEBUG("poll_for_new_conn_requests invoked\n");
+
+    // Call it up to 50 times.
+    // Will help when there is a surge of new requests.
+    // Once the backlog is empty, there is no point going on.
+    for (i = 0; i < 50; i++)
+    {
+        ret = accept4(server_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        LOG_DEBUG("accept4() returned %d\n", ret);
+        if (ret < 0)
+        {
             // Some error occured. What error?
             // errno will have the proper error code, check it.
             if (errno == EAGAIN || errno == EWOULDBLOCK)
             {
                 // Looks like there is no outstanding connection
                 // request. So it is asking us to try later.
-                printf("accept4() returned EAGAIN or EWOULDBLOCK. Try again later\n");
+                LOG_DEBUG("accept4() returned EAGAIN or EWOULDBLOCK. Try again later\n");
+                break;
             }
-            else
+            else if (errno == EINTR || errno == ECONNABORTED)
             {
-                // If it is any other error, it means something else
-                // went wrong. Kill!
-                printf("accept4() failed\n");
-                exit(-1);
+                // Interrupted, or the client gave up before we
+                // got to it. Next one.
+                continue;
             }
+
+            // If it is any other error, it means something else
+            // went wrong. Kill!
+            LOG_ERROR("accept4() failed\n");
+            exit(-1);
+        }
+
+        // Success case: We have a new socket!
+        client_fd = ret;
+        if (client_fd >= MAX_CLIENT_FD)
+        {
+            LOG_WARN("Too many clients. Dropping fd = %d\n", client_fd);
+            close(client_fd);
+            continue;
+        }
+        event.events = EPOLLIN;
+        event.data.fd = client_fd;
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+        if (ret < 0)
+        {
+            LOG_WARN("epoll_ctl() failed for fd = %d\n", client_fd);
+            close(client_fd);
+        }
+    }
+    LOG_DEBUG("poll_for_new_conn_requests done\n");
+}
+
+void close_client (int client_fd)
+{
+    // Closing also takes it out of epoll.
+    out_ring_free(&parked[client_fd]);
+    close(client_fd);
+}
+
+// Switches the client between waiting to read and waiting to write.
+int watch_client (int epoll_fd, int client_fd, uint32_t events)
+{
+    struct epoll_event  event = {0};
+
+    event.events = events;
+    event.data.fd = client_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_fd, &event) < 0)
+    {
+        LOG_WARN("epoll_ctl() failed for fd = %d\n", client_fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Socket is writable again. Sends what is parked and goes back
+// to reading once all of it is out.
+void flush_client (int epoll_fd, int client_fd)
+{
+    if (out_ring_flush(&parked[client_fd], client_fd) < 0)
+    {
+        LOG_WARN("send() on descriptor %d failed\n", client_fd);
+        close_client(client_fd);
+        return;
+    }
+
+    if (out_ring_len(&parked[client_fd]) == 0)
+    {
+        if (watch_client(epoll_fd, client_fd, EPOLLIN) < 0)
+        {
+            close_client(client_fd);
         }
     }
-    printf("poll_for_new_conn_requests done\n");
 }
 
-void poll_for_client_data (bool *fds_list)
+// Reads what the client sent and sends it back.
+// Closes the connection if it is done or broken.
+void serve_client (int epoll_fd, int client_fd)
 {
     int                     ret = 0;
-    int                     i = 0, j = 0;
-    int                     client_fd = 0;
-    uint8_t                 request_buffer[10000] = {0};
-
-    printf("poll_for_client_data invoked\n");
-
-    // All numbers in fds_list may not be valid
-    // descriptors. Check each one and if it is, call recv on it.
-    for (i = 0; i < 1024; i++)
-    {       
-        // For every valid socket, call "recv" a 100 times.
-        // Why?
-        // If there is large amounts of data coming in from client,
-        // calling a couple of times helps instead of calling
-        // it just once.
-        //
-        // We have two choices:
-        // 1. Calling recv 100 times on one socket and then
-        //      moving forward to the next.
-        // 2. Call recv once on one socket, then move to
-        //      the next. Do this for 100 times.
-        //
-        // (2) seemed fairer and would result in a
-        //      responsive server(considering all clients).
-        // So going for it.
-        for (j = 0; j < 100; j++)
+    int                     sent = 0;
+    uint8_t                 request_buffer[10000];
+
+    // Still sending the last echo. Don't read more till it is out.
+    if (out_ring_len(&parked[client_fd]) > 0)
+    {
+        flush_client(epoll_fd, client_fd);
+        return;
+    }
+
+    ret = recv(client_fd, request_buffer, sizeof(request_buffer), 0);
+    LOG_DEBUG("recv() on descriptor %d returned %d\n", client_fd, ret);
+    if (ret > 0)
+    {
+        // recv returned success - it has received some data.
+        // We need to send back that data.
+        sent = send(client_fd, request_buffer, ret, MSG_NOSIGNAL);
+        if (sent < 0)
         {
-            // Check if it is a valid socket descriptor
-            if (fds_list[i] == true)
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
             {
-                // If it is, then call recv on it.
-                ret = recv(i, request_buffer, sizeof(request_buffer), 0);
-                printf("recv() on descriptor %d returned %d\n", i, ret);
-                if (ret > 0)
-                {
-                    // recv returned success - it has received some data.
-                    // We need to send back that data.
-                    ret = send(i, request_buffer, sizeof(request_buffer), 0);
-                    if (ret < 0)
-                    {
-                        // If send failed, let us close the connection,
-                        // remove from our descriptor list.
-                        printf("send() on descriptor %d failed\n", i);
-                        close(i);
-                        fds_list[i] = false;
-                    }
-                    else
-                    {
-                        printf("send() succeeded on %d\n", i);
-                    }
-                }
-                else if (ret == 0)
-                {
-                    // If recv has returned 0,
-                    // it means that the client has disconnected.
-                    // Let us also cleanup.
-                    close(i);
-                    fds_list[i] = false;
-                }
-                else // ret < 0 
-                {
-                    // recv has errored out.
-                    // Time to check errno.
-                    if (errno == EAGAIN || errno == EWOULDBLOCK)
-                    {
-                        printf("recv() returned EAGAIN or EWOULDBLOCK. Try again later\n");
-                    }
-                    else
-                    {
-                        // Something fatal. Kill the server.
-                        printf("recv() failed\n");
-                        exit(-1);
-                    }
-                }
+                // If send failed, let us close the connection.
+                LOG_WARN("send() on descriptor %d failed\n", client_fd);
+                close_client(client_fd);
+                return;
             }
+            sent = 0;
         }
+
+        if (sent < ret)
+        {
+            // The socket took only part of it. Park the rest and
+            // wait for the socket to be writable, not readable.
+            // At most one recv worth is ever parked.
+            LOG_DEBUG("send() on %d took %d of %d bytes\n", client_fd, sent, ret);
+            out_ring_push(&parked[client_fd], request_buffer + sent, ret - sent);
+            if (watch_client(epoll_fd, client_fd, EPOLLOUT) < 0)
+            {
+                close_client(client_fd);
+            }
+        }
+        else
+        {
+            LOG_DEBUG("send() succeeded on %d\n", client_fd);
+        }
+    }
+    else if (ret == 0)
+    {
+        // If recv has returned 0,
+        // it means that the client has disconnected.
+        // Let us also cleanup.
+        close_client(client_fd);
+    }
+    else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+    {
+        // Connection reset or similar. Only this client is affected.
+        LOG_WARN("recv() on descriptor %d failed\n", client_fd);
+        close_client(client_fd);
     }
-    printf("poll_for_client_data done\n");
 }
 
 int main (int argc, char **argv)
 {
-    if (argc != 4)
+    if (argc < 3 || argc % 2 == 0)
     {
-        printf("Usage: $ %s [host-ipv4-address] [port-number] [poll-time-interval]\n", argv[0]);
+        printf("Usage: $ %s [host-ipv4-address] [port-number] "
+               "[--mode block|spin|adaptive] [--spin-us MAX]\n", argv[0]);
         return 0;
     }
 
     int                 server_fd = 0;
+    int                 epoll_fd = 0;
     int                 ret = 0;
     int                 i = 0;
+    int                 ready_fd_count = 0;
     struct sockaddr_in  server_addr = {0};
     const char          *ip_addr = argv[1];
     uint16_t            port_no = atoi(argv[2]);
-    bool                fds_list[1024] = {false};
-    int                 poll_time_interval = atoi(argv[3]);
+    struct epoll_event  event = {0};
+    struct epoll_event  events[MAX_EVENTS];
+    waiter_t            waiter = {0};
+
+    waiter.mode = MODE_ADAPTIVE;
+    waiter.spin_max_ns = 50000;
+
+    for (i = 3; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--mode") == 0)
+        {
+            if (strcmp(argv[i + 1], "block") == 0)
+            {
+                waiter.mode = MODE_BLOCK;
+            }
+            else if (strcmp(argv[i + 1], "spin") == 0)
+            {
+                waiter.mode = MODE_SPIN;
+            }
+            else if (strcmp(argv[i + 1], "adaptive") == 0)
+            {
+                waiter.mode = MODE_ADAPTIVE;
+            }
+            else
+            {
+                printf("Unknown mode %s\n", argv[i + 1]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--spin-us") == 0)
+        {
+            waiter.spin_max_ns = strtoull(argv[i + 1], NULL, 10) * 1000;
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    // Start the log drainer.
+    ret = log_init();
+    if (ret < 0)
+    {
+        printf("log_init() failed\n");
+        return -1;
+    }
 
     // Lets create a socket.
     ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
     if (ret < 0)
     {
-        printf("socket() failed\n");
+        LOG_ERROR("socket() failed\n");
         return -1;
     }
     server_fd = ret;
@@ -185,29 +388,67 @@ int main (int argc, char **argv)
     server_addr.sin_port = htons(atoi(argv[2]));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = inet_addr(argv[1]);
-    
+
     ret = bind(server_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
     if (ret < 0)
     {
-        printf("bind() failed\n");
+        LOG_ERROR("bind() failed\n");
         return -1;
     }
-    
+
     // Start listening
     ret = listen(server_fd, 50);
     if (ret < 0)
     {
-        printf("listen() failed\n");
+        LOG_ERROR("listen() failed\n");
+        return -1;
+    }
+    LOG_INFO("Listening at (%s, %u)\n", ip_addr, port_no);
+
+    ret = epoll_create1(EPOLL_CLOEXEC);
+    if (ret < 0)
+    {
+        LOG_ERROR("epoll_create1() failed\n");
+        return -1;
+    }
+    epoll_fd = ret;
+
+    event.events = EPOLLIN;
+    event.data.fd = server_fd;
+    ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &event);
+    if (ret < 0)
+    {
+        LOG_ERROR("epoll_ctl() failed for server descriptor\n");
         return -1;
     }
-    printf("Listening at (%s, %u)\n", ip_addr, port_no);
 
     // What do we do here?
     while (1)
-    {   
-        poll_for_new_conn_requests(server_fd, fds_list);
-        poll_for_client_data(fds_list);
-        printf("Polling done. Going back to sleep\n");
-        sleep(poll_time_interval);
+    {
+        ret = wait_for_events(&waiter, epoll_fd, events);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            LOG_ERROR("epoll_wait() failed\n");
+            return -1;
+        }
+        ready_fd_count = ret;
+        LOG_DEBUG("No of ready descriptors: %d, spin %lu ns, %lu spin hits, %lu blocks\n",
+                  ready_fd_count, waiter.spin_ns, waiter.spin_hits, waiter.blocks);
+
+        for (i = 0; i < ready_fd_count; i++)
+        {
+            if (events[i].data.fd == server_fd)
+            {
+                poll_for_new_conn_requests(server_fd, epoll_fd);
+            }
+            else
+            {
+                serve_client(epoll_fd, events[i].data.fd);
+            }
+        }
     }
-}
\ No newline at end of file
+}
@@ -3,6 +3,43 @@
  * 
  * Uses poll as an event notifier.
  * Can handle any number of clients that hit the server.
+ * - Client sockets are non-blocking. Whatever send does not take
+ *   right away is parked in the connection's out_ring and sent
+ *   when poll says the socket is writable (POLLOUT).
+ * - So a client which reads slowly doesn't stall everyone else.
+ * - Every connection has a deadline on a timer wheel (timer_wheel.h),
+ *   moved on every read and write. Connections which miss it are
+ *   closed. poll's timeout is when the next deadline might be up.
+ *      - read timeout: a new connection has to send something by then.
+ *      - idle timeout: an established connection with nothing parked
+ *        has to send something by then.
+ *      - write timeout: while something is parked, the client has to
+ *        take some of it by then.
+ *   All in milliseconds, 0 turns one off.
+ * - The listening socket is non-blocking. On every wakeup we accept
+ *   till the backlog is empty, up to --accept-budget connections, so
+ *   a burst of connects doesn't take a poll round each. The budget
+ *   makes sure existing clients get served in between.
+ *   --backlog sets listen()'s backlog (the kernel caps it at
+ *   net.core.somaxconn).
+ * - A readable connection is read up to READS_PER_PASS times per poll
+ *   round, till a read comes back short. --flush says when the echo
+ *   goes out:
+ *      - pass: (default) reads land straight in the out_ring, no copy
+ *              through a buffer of ours. Once we are done with the
+ *              connection for this round, everything is sent with one
+ *              sendmsg. Several small messages, one send.
+ *      - read: every read is sent back right away. One send per read.
+ *   --cork tells the kernel how to packetize the sends of a round
+ *   (only matters with --flush read, pass already sends once):
+ *      - off:  (default) every send goes out as is.
+ *      - on:   TCP_CORK is set before the first send of a round and
+ *              cleared after the last. Two extra setsockopt calls.
+ *      - more: sends carry MSG_MORE, and the round ends with clearing
+ *              TCP_CORK, which pushes out what MSG_MORE held back.
+ * - Connections, accepts, bytes, errors, timeouts and the pfds_t
+ *   size are counted in /dev/shm/sastat.<port> (stats.h).
+ *   $ ./sastat <port> watches them.
  */
 #define _GNU_SOURCE
 #include <stdio.h>
@@ -12,60 +49,78 @@
 #include <netdb.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <stdbool.h>
 #include <poll.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include "out_ring.h"
+#include "log.h"
+#include "timer_wheel.h"
+#include "stats.h"
 
 // A pollfd dynamic array implementation
 // In order to support any number of incoming connections,
 // we need this.
+//
+// It is also the hot half of the connection table. After every
+// poll() the client loop looks at every connection, and for most
+// of them all it wants to know is: did anything happen (revents),
+// did it miss its deadline (PFD_TIMED_OUT)? Both answers are in
+// dense arrays indexed by slot - list and flags - so walking N
+// connections reads 9 * N bytes front to back. The rest of a
+// connection (conn_t, below) is indexed by descriptor and only
+// touched for the ones which have something to do.
 typedef struct pfds
 {   
     // Points to the pollfd array.
     // Is subject to callocs, reallocs.
+    // fd, interest (events) and revents of every slot.
     struct pollfd   *list;
 
+    // PFD_ bits of every slot. Moves along with list.
+    uint8_t         *flags;
+
     // Total capacity of the array.
     uint64_t        capacity;
 
-    // Largest index which has a valid descriptor.
-    // The moment max_index == capacity-1, we need
-    // to increase the list size.
-    uint64_t        max_index;
-
-    // This points to a pollfd instance which does not
-    // have a valid descriptor.
-    // Note: free_index need not be same as max_index.
-    //       Suppose 100 connection requests come in.
-    //       max_index will be equal to free_index.
-    //       One connection whose socket is in list[5]
-    //       closes. Then free_index will point to 5.
-    // It is going to point to the smallest free index.
-    uint64_t        free_index;
+    // Number of pollfd instances in use.
+    // They are always list[0] to list[count-1].
+    uint64_t        count;
+
+    // Descriptor -> slot. So that a timer, which knows only the
+    // descriptor, can find its flags.
+    int32_t         *slot_of;
+    uint64_t        slot_of_capacity;
 } pfds_t;
 
+// Start with these many. We never shrink below this.
+#define PFDS_MIN_CAPACITY   1024
+
+// Missed its deadline. Closed unless something happened on it.
+#define PFD_TIMED_OUT       0x01
+
 // Idea behind the implementation
 //
-// Suppose we start with a list can hold 10 pollfd instances.
-// - [-1, -1, -1, -1, -1, -1, -1, -1, -1, -1]
-// - capacity = 10, max_index = 0, free_index = 0
-// - Now 5 connections come in.
-//      - [3, 4, 5, 6, 7, -1, -1, -1, -1, -1]
-//      - max_index = 5, free_index = 5.
-//
-// - Connection with descriptor (4) close. What do we do?
-//      - We need to invalidate its entry in the list.
-//      - [3, -1, 5, 6, 7, -1, -1, -1, -1, -1]
-//      - max_index = 5, free_index = 1;
-// - Note that free_index will always point to the smallest
-//   free pollfd instance. Idea is to reuse that memory
-//   instead of simply allocating more memory when there
-//   is free memory here.
-// - Everytime a descriptor is added, free_index will
-//   definitely change. max_index might change depending
-//   free_index's value.
-
+// - The list never has holes. poll() is handed exactly the
+//   descriptors we monitor, nothing else.
+// - add() appends at list[count]. O(1).
+// - remove() moves the last instance into the hole. O(1).
+//      - [3, 4, 5, 6, 7], count = 5
+//      - Connection with descriptor (4) closes.
+//      - [3, 7, 5, 6], count = 4
+// - Order in the list changes, but poll() doesn't care.
+//   The caller does: after removing index i, list[i] is
+//   a different descriptor which still needs to be looked at.
+// - flags moves the same way, and slot_of of the moved
+//   descriptor is updated.
+// - The list doubles when it is full and halves when only
+//   a quarter of it is used. Halving at a quarter (and not
+//   at a half) makes sure one connection going back and forth
+//   around the boundary doesn't realloc every time.
 
 // Initialize a pfds_t structure.
 // Generally a stack allocated pfds_t structure
@@ -77,127 +132,111 @@ int pfds_init (pfds_t *pfds)
         return -1;
     }
 
-    uint64_t    i = 0;
-
     memset(pfds, '\0', sizeof(pfds_t));
 
-    // Let us start with 1000 descriptors.
-    pfds->list = calloc(1000, sizeof(struct pollfd));
-    if (pfds->list == NULL)
+    pfds->list = calloc(PFDS_MIN_CAPACITY, sizeof(struct pollfd));
+    pfds->flags = calloc(PFDS_MIN_CAPACITY, sizeof(uint8_t));
+    if (pfds->list == NULL || pfds->flags == NULL)
     {   
         // No memory. Kill the server.
-        printf("calloc() failed\n");
+        LOG_ERROR("calloc() failed\n");
         exit(-1);
     }
 
     // Update the members
-    pfds->capacity = 1000;
-    pfds->max_index = 0;
-    pfds->free_index = 0;
-
-    // Initialize the list
-    for (i = 0; i < pfds->capacity; i++)
-    {
-        pfds->list[i].fd = -1;
-        pfds->list[i].events = 0;
-        pfds->list[i].revents = 0;
-    }
+    pfds->capacity = PFDS_MIN_CAPACITY;
+    pfds->count = 0;
 
     // All set.
     return 0;
 }
 
-// Adding to this means you are asking poll
-// to monitor it.
-int pfds_add (pfds_t *pfds, struct pollfd *pfd)
+// Changes the capacity of the list.
+void pfds_resize (pfds_t *pfds, uint64_t capacity)
 {
-    // Basic checks
-    if (pfds == NULL || pfd == NULL)
+    struct pollfd   *temp = NULL;
+    uint8_t         *temp_flags = NULL;
+
+    temp = realloc(pfds->list, sizeof(struct pollfd) * capacity);
+    if (temp == NULL)
     {
-        return -1;
+        // This means no memory - system may not be doing good.
+        // kill the server.
+        LOG_ERROR("realloc() failed. Exiting...\n");
+        exit(-1);
     }
+    pfds->list = temp;
 
-    uint64_t        i = 0;
-    struct pollfd   *temp = NULL;
+    temp_flags = realloc(pfds->flags, sizeof(uint8_t) * capacity);
+    if (temp_flags == NULL)
+    {
+        LOG_ERROR("realloc() failed. Exiting...\n");
+        exit(-1);
+    }
+    pfds->flags = temp_flags;
+
+    pfds->capacity = capacity;
+}
 
-    // General strategy is to copy pfd
-    // into the instance pointed by free_index.
-    // Note that free_index will always point to
-    // a valid pollfd instance.
-    pfds->list[pfds->free_index].fd = pfd->fd;
-    pfds->list[pfds->free_index].events = pfd->events;
-    pfds->list[pfds->free_index].revents = pfd->revents;
+// Makes sure slot_of can hold the passed descriptor.
+void pfds_reserve_fd (pfds_t *pfds, int fd)
+{
+    uint64_t    new_capacity = 0;
+    int32_t     *temp = NULL;
 
-    // If we just populated the instance pointed by
-    // max_index+1, then update max_index.
-    if (pfds->free_index == pfds->max_index + 1)
+    if ((uint64_t)fd < pfds->slot_of_capacity)
     {
-        pfds->max_index += 1;
+        return;
     }
 
-    // Now, our job is to find out the next free_index.
-    // The new free_index will be used by the next add()
-
-    // There are two cases:
+    new_capacity = pfds->slot_of_capacity ? pfds->slot_of_capacity : 1024;
+    while (new_capacity <= (uint64_t)fd)
+    {
+        new_capacity *= 2;
+    }
 
-    // 1. If the current free_index is found before max_index,
-    //    - There might be a usable pollfd instance before
-    //      max_index.
-    if (pfds->free_index < pfds->max_index)
+    temp = realloc(pfds->slot_of, sizeof(int32_t) * new_capacity);
+    if (temp == NULL)
     {
-        for(i = pfds->free_index+1; i <= pfds->max_index; i++)
-        {   
-            // If there is a usable instance?
-            if (pfds->list[i].fd == -1)
-            {   
-                // Assign it. We are all set 
-                // for the next add().
-                pfds->free_index = i;
-                return 0;
-            }
-        }
-    }                  
-
-    // 2. We are here means there are no usable pollfd instances
-    // till max_index (including it).
-    // - This simply means that the next free_index is
-    //   max_index+1.
-    // - What if max_index points to the last pollfd instance?
-    if (pfds->max_index == pfds->capacity - 1)
-    {
-        // This means that there is no memory for the next
-        // add(). Let us allocate some.
-        temp = realloc(pfds->list, sizeof(struct pollfd) * (pfds->capacity + 100));
-        if (temp == NULL)
-        {
-            // This means no memory - system may not be doing good.
-            // kill the server.
-            printf("realloc() failed. Exiting...\n");
-            exit(-1);
-        }
+        LOG_ERROR("realloc() failed. Exiting...\n");
+        exit(-1);
+    }
 
-        // Let us update the members.
-        pfds->list = temp;
-        pfds->capacity += 100;
+    pfds->slot_of = temp;
+    pfds->slot_of_capacity = new_capacity;
+}
 
-        // Let us initialize the 100 new instances.
-        for (i = pfds->max_index+1; i < pfds->capacity; i++)
-        {
-            pfds->list[i].fd = -1;
-            pfds->list[i].events = 0;
-            pfds->list[i].revents = 0;
-        }
+// Adding to this means you are asking poll
+// to monitor it.
+int pfds_add (pfds_t *pfds, struct pollfd *pfd)
+{
+    // Basic checks
+    if (pfds == NULL || pfd == NULL)
+    {
+        return -1;
     }
 
-    // At this point, max_index+1 points to a valid pollfd instance.
-    // We can set the next free_index.
-    pfds->free_index = pfds->max_index+1;
+    // Full? Double it.
+    if (pfds->count == pfds->capacity)
+    {
+        pfds_resize(pfds, pfds->capacity * 2);
+    }
+    pfds_reserve_fd(pfds, pfd->fd);
+
+    // Append.
+    pfds->list[pfds->count].fd = pfd->fd;
+    pfds->list[pfds->count].events = pfd->events;
+    pfds->list[pfds->count].revents = pfd->revents;
+    pfds->flags[pfds->count] = 0;
+    pfds->slot_of[pfd->fd] = pfds->count;
+    pfds->count += 1;
 
     // Go to go.
     return 0;
 }
 
 // Remove a descriptor from monitoring.
+// The last instance takes its place.
 int pfds_remove (pfds_t *pfds, uint64_t index)
 {
     // Basic checks
@@ -207,57 +246,199 @@ int pfds_remove (pfds_t *pfds, uint64_t index)
     }
 
     // We need to ensure index is well within limits.
-    if (index > pfds->max_index)
-    {
-        return -1;
-    }
-
-    // Make sure it is a valid descriptor.
-    if (pfds->list[index].fd == -1)
+    if (index >= pfds->count)
     {
         return -1;
     }
 
     // Clean up.
     close(pfds->list[index].fd);
-    pfds->list[index].fd = -1;
-    pfds->list[index].events = 0;
-    pfds->list[index].revents = 0;
-
-    // We might need to update max_index and free_index
-    // based on index.
-    if (index == pfds->max_index)
-    {
-        // If free_index points to
-        // pfds->max_index+1, then it should
-        // be updated. Because pfds->max_index
-        // just got cleaned up.
-        if (pfds->free_index == pfds->max_index+1)
-        {
-            pfds->free_index -= 1;
-        }
-        
-        // If the last instance was just cleaned up,
-        // that is not the last instance anymore.
-        pfds->max_index -= 1;
-    }
-    else
-    {
-        // This is the case where index is somewhere
-        // in the middle of the array.
-        // Here, there is a possibility of index
-        // being less than free_index. Meaning,
-        // index can be the new free_index.
-        if (index < pfds->free_index)
-        {
-            pfds->free_index = index;
-        }
+
+    // Fill the hole with the last one.
+    pfds->count -= 1;
+    pfds->list[index] = pfds->list[pfds->count];
+    pfds->flags[index] = pfds->flags[pfds->count];
+    pfds->slot_of[pfds->list[index].fd] = index;
+
+    // Mostly empty? Give some memory back.
+    if (pfds->capacity > PFDS_MIN_CAPACITY && pfds->count < pfds->capacity / 4)
+    {
+        pfds_resize(pfds, pfds->capacity / 2);
     }
 
     // Good to go.
     return 0;
 }
 
+// Per-connection state. The cold half of the connection table,
+// indexed by descriptor. Only looked at when something happened
+// on the connection - see pfds_t.
+typedef struct conn
+{
+    // Echoed bytes the client hasn't taken yet.
+    out_ring_t      out;
+
+    // We stopped reading because out is above the high-water mark.
+    bool            paused;
+
+    // Client is done sending. We close once out is flushed.
+    bool            read_closed;
+
+    // Client has sent something. Till then, the read timeout applies.
+    bool            got_data;
+
+    // Sent with TCP_CORK or MSG_MORE this round. Has to be
+    // uncorked at the end of it.
+    bool            corked;
+
+    // Who is on the other side.
+    struct sockaddr_in  peer;
+} conn_t;
+
+// Connection table. Indexed by descriptor.
+// Grows as bigger descriptors show up.
+conn_t      *conns = NULL;
+uint64_t    conns_capacity = 0;
+
+// Kept open only to be given up when we run out of
+// descriptors. See turn_away_connection.
+int         spare_fd = -1;
+
+// Makes sure the connection table can hold the passed descriptor.
+int conns_reserve (int fd)
+{
+    uint64_t    new_capacity = 0;
+    conn_t      *temp = NULL;
+
+    if ((uint64_t)fd < conns_capacity)
+    {
+        return 0;
+    }
+
+    new_capacity = conns_capacity ? conns_capacity : 1024;
+    while (new_capacity <= (uint64_t)fd)
+    {
+        new_capacity *= 2;
+    }
+
+    temp = realloc(conns, sizeof(conn_t) * new_capacity);
+    if (temp == NULL)
+    {
+        return -1;
+    }
+
+    conns = temp;
+    conns_capacity = new_capacity;
+    return 0;
+}
+
+// Deadlines of all connections, indexed by descriptor.
+// One tick is a millisecond.
+tw_t        wheel;
+
+// Timeouts in milliseconds. 0 means none.
+uint64_t    read_timeout = 10000;
+uint64_t    idle_timeout = 60000;
+uint64_t    write_timeout = 10000;
+
+// Connections accepted per wakeup, at most.
+int         accept_budget = 64;
+
+// Our counters. See stats.h.
+stats_counters_t    *stats = NULL;
+
+// Reads per connection per poll round, at most. Bounds how long
+// one busy client can keep the others waiting.
+#define READS_PER_PASS      8
+
+enum
+{
+    FLUSH_PASS = 0,
+    FLUSH_READ,
+};
+
+enum
+{
+    CORK_OFF = 0,
+    CORK_ON,
+    CORK_MORE,
+};
+
+// See the top of the file.
+int         flush_mode = FLUSH_PASS;
+int         cork_mode = CORK_OFF;
+
+uint64_t now_ms ()
+{
+    struct timespec     ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Forget about the connection. The descriptor
+// is closed by pfds_remove.
+void conn_release (int fd)
+{
+    conn_t  *conn = &conns[fd];
+
+    tw_cancel(&wheel, fd);
+    out_ring_free(&conn->out);
+    memset(conn, '\0', sizeof(conn_t));
+    STATS_ADD(stats, conns, -1);
+}
+
+// Something happened on the connection. Move its deadline.
+void conn_arm_timer (int fd, conn_t *conn, uint64_t now)
+{
+    uint64_t    timeout = idle_timeout;
+
+    if (out_ring_len(&conn->out) > 0)
+    {
+        timeout = write_timeout;
+    }
+    else if (conn->got_data == false)
+    {
+        timeout = read_timeout;
+    }
+
+    if (timeout == 0)
+    {
+        tw_cancel(&wheel, fd);
+        return;
+    }
+    tw_arm(&wheel, fd, now + timeout);
+}
+
+// What should poll watch for this connection?
+// - POLLIN unless we have paused reading or the client is done sending.
+// - POLLOUT only while something is parked. A socket is writable
+//   almost all the time - asking for POLLOUT with nothing to send
+//   would make poll return right away, every time.
+short conn_events (conn_t *conn)
+{
+    short   events = 0;
+
+    if (out_ring_len(&conn->out) >= OUT_RING_HIGH_WATER)
+    {
+        conn->paused = true;
+    }
+    else if (out_ring_len(&conn->out) <= OUT_RING_LOW_WATER)
+    {
+        conn->paused = false;
+    }
+
+    if (conn->paused == false && conn->read_closed == false)
+    {
+        events |= POLLIN;
+    }
+    if (out_ring_len(&conn->out) > 0)
+    {
+        events |= POLLOUT;
+    }
+    return events;
+}
+
 // serve_connection can have different return values.
 // Based on it, we need to take action in the main
 // function.
@@ -268,80 +449,409 @@ enum
     SERVE_CONN_CLIENT_DISCONN,
 };
 
-int serve_connection (int client_fd)
+// Sends back what was just read, with --flush read.
+// Whatever the socket doesn't take is parked.
+int echo_now (int client_fd, conn_t *conn, uint8_t *buf, int len)
+{
+    int     ret = 0;
+    int     sent = 0;
+    int     flags = MSG_NOSIGNAL;
+    int     one = 1;
+
+    // If something is already parked, this goes behind it.
+    // Otherwise send right away, park what the socket doesn't take.
+    if (out_ring_len(&conn->out) == 0)
+    {
+        if (cork_mode == CORK_ON && conn->corked == false)
+        {
+            setsockopt(client_fd, IPPROTO_TCP, TCP_CORK, &one, sizeof(one));
+        }
+        else if (cork_mode == CORK_MORE)
+        {
+            flags |= MSG_MORE;
+        }
+        conn->corked = (cork_mode != CORK_OFF);
+
+        ret = send(client_fd, buf, len, flags);
+        LOG_DEBUG("send() for descriptor %d return %d\n", client_fd, ret);
+        if (ret < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                LOG_WARN("send() failed for fd = %d\n", client_fd);
+                return SERVE_CONN_FAILED;
+            }
+            ret = 0;
+        }
+        sent = ret;
+        STATS_ADD(stats, bytes_out, sent);
+    }
+
+    if (sent < len)
+    {
+        out_ring_push(&conn->out, buf + sent, len - sent);
+    }
+    return SERVE_CONN_SUCCESS;
+}
+
+int serve_connection (int client_fd, conn_t *conn)
 {   
-    uint8_t         request_buffer[10000] = {0};
+    uint8_t         request_buffer[10000];
     int             ret = 0;
     int             req_len = 0;
+    int             reads = 0;
+    uint64_t        to_read = 0;
 
-    printf("serve_connection on descriptor %d invoked\n", client_fd);
+    LOG_DEBUG("serve_connection on descriptor %d invoked\n", client_fd);
+
+    for (reads = 0; reads < READS_PER_PASS; reads++)
+    {
+        // Never read more than we can park.
+        to_read = out_ring_space(&conn->out);
+        if (flush_mode == FLUSH_READ && to_read > sizeof(request_buffer))
+        {
+            to_read = sizeof(request_buffer);
+        }
+        if (to_read == 0)
+        {
+            break;
+        }
 
-    // Get the data.
-    ret = recv(client_fd, request_buffer, sizeof(request_buffer), 0);
-    printf("recv ret = %d\n", ret);
+        // Get the data.
+        if (flush_mode == FLUSH_PASS)
+        {
+            ret = out_ring_recv(&conn->out, client_fd, to_read);
+        }
+        else
+        {
+            ret = recv(client_fd, request_buffer, to_read, 0);
+        }
+        LOG_DEBUG("recv ret = %d\n", ret);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                // Nothing (more) after all. Try again later.
+                break;
+            }
+            LOG_WARN("recv() failed for fd = %d\n", client_fd);
+            return SERVE_CONN_FAILED;
+        }
+        else if (ret == 0)
+        {
+            // This is the case when the other side of the
+            // connection has disconnected (at least its sending side).
+            // Whatever is parked still goes out.
+            conn->read_closed = true;
+            if (out_ring_len(&conn->out) > 0)
+            {
+                break;
+            }
+            return SERVE_CONN_CLIENT_DISCONN;
+        }
+
+        req_len = ret;
+        conn->got_data = true;
+        STATS_ADD(stats, bytes_in, req_len);
+
+        // With --flush pass, it is parked already. end_pass sends it.
+        if (flush_mode == FLUSH_READ)
+        {
+            ret = echo_now(client_fd, conn, request_buffer, req_len);
+            if (ret != SERVE_CONN_SUCCESS)
+            {
+                return ret;
+            }
+        }
+
+        // A short read means the socket is most likely empty.
+        // Don't spend a recv finding out.
+        if ((uint64_t)req_len < to_read)
+        {
+            break;
+        }
+    }
+
+    LOG_DEBUG("serve_connection on descriptor %d done\n", client_fd);
+    return SERVE_CONN_SUCCESS;
+}
+
+// Socket is writable. Send what is parked.
+int flush_connection (int client_fd, conn_t *conn)
+{
+    int         ret = 0;
+    uint64_t    parked = out_ring_len(&conn->out);
+
+    ret = out_ring_flush(&conn->out, client_fd);
+    STATS_ADD(stats, bytes_out, parked - out_ring_len(&conn->out));
     if (ret < 0)
     {
-        printf("recv() failed for fd = %d\n", ret);
+        LOG_WARN("send() failed for fd = %d\n", client_fd);
         return SERVE_CONN_FAILED;
     }
-    else if (ret == 0)
+
+    // Client was done sending and has got everything back.
+    if (conn->read_closed == true && out_ring_len(&conn->out) == 0)
     {
-        // This is the case when the other side of the
-        // connection has disconnected.
-        // XXX: We should never hit this case
-        //      because POLLHUP should take care of this.
         return SERVE_CONN_CLIENT_DISCONN;
     }
+    return SERVE_CONN_SUCCESS;
+}
 
-    req_len = ret;
+// Done with the connection for this poll round.
+// - --flush pass: send what piled up, in one go.
+// - Corked: let the kernel send what it held back.
+int end_pass (int client_fd, conn_t *conn)
+{
+    int     zero = 0;
 
-    // You send back the same data
-    ret = send(client_fd, request_buffer, req_len, 0);
-    printf("send() for descriptor %d return %d\n", client_fd, ret);
-    if (ret < req_len)
+    if (conn->corked)
     {
-        printf("send() failed for fd = %d\n", ret);
-        return SERVE_CONN_FAILED;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_CORK, &zero, sizeof(zero));
+        conn->corked = false;
     }
 
-    printf("serve_connection on descriptor %d done\n", client_fd);
+    if (flush_mode == FLUSH_PASS && out_ring_len(&conn->out) > 0)
+    {
+        return flush_connection(client_fd, conn);
+    }
     return SERVE_CONN_SUCCESS;
 }
 
+// Out of descriptors (EMFILE/ENFILE). poll is level-triggered: with
+// clients still in the backlog, the listener is ready again in the
+// very next round and we'd spin, failing accept every time. So the
+// oldest client is turned away - give up the spare descriptor, accept
+// with it, close right away and take the spare back.
+// Returns 0 if one was turned away, -1 if the backlog is empty
+// (or there is no spare).
+int turn_away_connection (int sock_fd)
+{
+    int     fd = -1;
+
+    if (spare_fd < 0)
+    {
+        return -1;
+    }
+
+    close(spare_fd);
+    while (1)
+    {
+        fd = accept(sock_fd, NULL, NULL);
+        if (fd >= 0 || (errno != EINTR && errno != ECONNABORTED))
+        {
+            break;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return (fd >= 0) ? 0 : -1;
+}
+
+// Accepts pending connections, up to accept_budget of them.
+// New clients are added to pfds.
+void accept_connections (pfds_t *pfds, int sock_fd, uint64_t now)
+{
+    int                 ret = 0;
+    int                 client_fd = 0;
+    int                 accepted = 0;
+    int                 err = 0;
+    int                 turned_away = 0;
+    struct pollfd       pfd = {0};
+    struct sockaddr_in  peer = {0};
+    socklen_t           peer_len = 0;
+
+    while (accepted < accept_budget)
+    {
+        // Client sockets are non-blocking (see out_ring.h), and
+        // are not inherited by anything we might exec.
+        peer_len = sizeof(peer);
+        ret = accept4(sock_fd, (struct sockaddr *)&peer, &peer_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        LOG_DEBUG("accept4() returned %d\n", ret);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Backlog is empty.
+                return;
+            }
+            else if (errno == EINTR || errno == ECONNABORTED)
+            {
+                // Interrupted, or the client gave up before we
+                // got to it. Next one.
+                continue;
+            }
+
+            // Out of descriptors. Turn the waiting ones away,
+            // within the same budget. Whoever is left over gets
+            // turned away next round.
+            err = errno;
+            if (err == EMFILE || err == ENFILE)
+            {
+                while (accepted < accept_budget && turn_away_connection(sock_fd) == 0)
+                {
+                    accepted += 1;
+                    turned_away += 1;
+                }
+            }
+            LOG_WARN("accept4() failed, errno = %d. Turned away %d waiting connections\n", err, turned_away);
+            return;
+        }
+        client_fd = ret;
+        accepted += 1;
+
+        // Fresh state for the connection.
+        if (conns_reserve(client_fd) < 0 || tw_reserve(&wheel, client_fd) < 0)
+        {
+            LOG_WARN("realloc() failed for fd = %d\n", client_fd);
+            close(client_fd);
+            continue;
+        }
+        memset(&conns[client_fd], '\0', sizeof(conn_t));
+        conns[client_fd].peer = peer;
+        conn_arm_timer(client_fd, &conns[client_fd], now);
+        STATS_ADD(stats, accepts, 1);
+        STATS_ADD(stats, conns, 1);
+
+        // We have a new socket descriptor. Let us add it.
+        memset(&pfd, '\0', sizeof(struct pollfd));
+        pfd.fd = client_fd;
+        pfd.events |= POLLIN;
+        ret = pfds_add(pfds, &pfd);
+        if (ret < 0)
+        {
+            LOG_ERROR("pfds_add() failed\n");
+            exit(-1);
+        }
+    }
+}
+
 int main (int argc, char **argv)
 {
-    if (argc != 3)
+    if (argc < 3 || argc % 2 == 0)
     {
-        printf("Usage: $ %s [host-ipv4-address] [port-number]\n", argv[0]);
+        printf("Usage: $ %s [host-ipv4-address] [port-number] "
+               "[--read-timeout MS] [--idle-timeout MS] [--write-timeout MS] "
+               "[--backlog N] [--accept-budget N] [--flush pass|read] "
+               "[--cork off|on|more]\n", argv[0]);
         return 0;
     }
 
     int                 sock_fd = 0;
     int                 client_fd = 0;
     int                 ret = 0;
-    int                 i = 0;
+    uint64_t            i = 0;
+    int                 backlog = SOMAXCONN;
     struct sockaddr_in  server_addr = {0};
-    struct sockaddr_in  client_addr = {0};
-    socklen_t           client_addr_len = 0;
     const char          *ip_addr = argv[1];
     uint16_t            port_no = atoi(argv[2]);
     pfds_t              pfds = {0};
     struct pollfd       pfd = {0};
+    conn_t              *conn = NULL;
     int                 ready_fd_count = 0;
+    int64_t             timeout = 0;
+    int32_t             expired_fd = 0;
+    uint64_t            now = 0;
+
+    for (i = 3; i + 1 < (uint64_t)argc; i += 2)
+    {
+        if (strcmp(argv[i], "--read-timeout") == 0)
+        {
+            read_timeout = strtoull(argv[i + 1], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--idle-timeout") == 0)
+        {
+            idle_timeout = strtoull(argv[i + 1], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--write-timeout") == 0)
+        {
+            write_timeout = strtoull(argv[i + 1], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--backlog") == 0)
+        {
+            backlog = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--accept-budget") == 0)
+        {
+            accept_budget = atoi(argv[i + 1]);
+        }
+        else if (strcmp(argv[i], "--flush") == 0)
+        {
+            if (strcmp(argv[i + 1], "pass") == 0)
+            {
+                flush_mode = FLUSH_PASS;
+            }
+            else if (strcmp(argv[i + 1], "read") == 0)
+            {
+                flush_mode = FLUSH_READ;
+            }
+            else
+            {
+                printf("Unknown flush mode %s\n", argv[i + 1]);
+                return -1;
+            }
+        }
+        else if (strcmp(argv[i], "--cork") == 0)
+        {
+            if (strcmp(argv[i + 1], "off") == 0)
+            {
+                cork_mode = CORK_OFF;
+            }
+            else if (strcmp(argv[i + 1], "on") == 0)
+            {
+                cork_mode = CORK_ON;
+            }
+            else if (strcmp(argv[i + 1], "more") == 0)
+            {
+                cork_mode = CORK_MORE;
+            }
+            else
+            {
+                printf("Unknown cork mode %s\n", argv[i + 1]);
+                return -1;
+            }
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    // Start the log drainer.
+    ret = log_init();
+    if (ret < 0)
+    {
+        printf("log_init() failed\n");
+        return -1;
+    }
 
     // Initialize pfds
     ret = pfds_init(&pfds);
     if (ret < 0)
     {
-        printf("pfds_init() failed\n");
+        LOG_ERROR("pfds_init() failed\n");
         return -1;              
     }
+    tw_init(&wheel, now_ms());
+    stats = &stats_open("echo_server_v3", port_no, 1)->thread[0];
+
+    if (accept_budget <= 0)
+    {
+        printf("accept-budget should be positive\n");
+        return -1;
+    }
 
     // Lets create a socket.
-    ret = socket(AF_INET, SOCK_STREAM, 0);
+    // Non-blocking, so that we can accept till the backlog is empty.
+    ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
     if (ret < 0)
     {
-        printf("socket() failed\n");
+        LOG_ERROR("socket() failed\n");
         return -1;
     }
     sock_fd = ret;
@@ -354,18 +864,21 @@ int main (int argc, char **argv)
     ret = bind(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
     if (ret < 0)
     {
-        printf("bind() failed\n");
+        LOG_ERROR("bind() failed\n");
         return -1;
     }
     
     // Start listening
-    ret = listen(sock_fd, 50);
+    ret = listen(sock_fd, backlog);
     if (ret < 0)
     {
-        printf("listen() failed\n");
+        LOG_ERROR("listen() failed\n");
         return -1;
     }
-    printf("Listening at (%s, %u)\n", ip_addr, port_no);
+
+    // One descriptor in reserve, for when we run out.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    LOG_INFO("Listening at (%s, %u), backlog %d\n", ip_addr, port_no, backlog);
 
     // Add the server socket.
     pfd.fd = sock_fd;
@@ -374,21 +887,38 @@ int main (int argc, char **argv)
     ret = pfds_add(&pfds, &pfd);
     if (ret < 0)
     {
-        printf("pfds_add() failed\n");
+        LOG_ERROR("pfds_add() failed\n");
         return -1;
     }
 
     // Do the thing
     while (1)
     {   
-        ret = poll(pfds.list, pfds.max_index+1 /* Number of descriptors */, -1 /* Infinite timeout */);
+        // Sleep till something happens or the next deadline
+        // might be up. -1 (no deadlines) is an infinite timeout.
+        timeout = tw_timeout(&wheel, now_ms());
+        if (timeout > INT32_MAX)
+        {
+            timeout = INT32_MAX;
+        }
+
+        ret = poll(pfds.list, pfds.count /* Number of descriptors */, (int)timeout);
         if (ret < 0)
         {
-            printf("poll() failed\n");
+            LOG_ERROR("poll() failed\n");
             return -1;
         }
         ready_fd_count = ret;
-        printf("No of ready descriptors: %d\n", ready_fd_count);
+        LOG_DEBUG("No of ready descriptors: %d\n", ready_fd_count);
+
+        // Mark whoever missed a deadline. They are closed
+        // when the loop below gets to them.
+        now = now_ms();
+        tw_advance(&wheel, now);
+        while ((expired_fd = tw_pop_expired(&wheel)) != TW_NONE)
+        {
+            pfds.flags[pfds.slot_of[expired_fd]] |= PFD_TIMED_OUT;
+        }
 
         // All server socket related things first.
         // Check for errors.
@@ -396,60 +926,93 @@ int main (int argc, char **argv)
         {
             // Some error occured while monitoring the server socket.
             // Let us kill the server.
-            printf("poll() error(POLLERR) on server descriptor. Exiting...");
+            LOG_ERROR("poll() error(POLLERR) on server descriptor. Exiting...");
             exit(-1);
         }
         else if (pfds.list[0].revents & POLLIN)
         {
             // If it is ready to be read (in other words, there are
-            // new connection requests, process it.)
-            memset(&client_addr, '\0', sizeof(client_addr));
-            ret = accept(pfds.list[0].fd, (struct sockaddr *)&client_addr, &client_addr_len);
-            printf("accept() returned %d\n", ret);
-            if (ret < 0)
-            {
-                printf("accept() failed\n");
-                return -1;
-            }
-            client_fd = ret;
-            
-            // We have a new socket descriptor. Let us add it.
-            memset(&pfd, '\0', sizeof(struct pollfd));
-            pfd.fd = client_fd;
-            pfd.events |= POLLIN;
-            ret = pfds_add(&pfds, &pfd);
-            if (ret < 0)
-            {
-                printf("pfds_add() failed\n");
-                return -1;
-            }
+            // new connection requests, process them.)
+            accept_connections(&pfds, sock_fd, now);
         }
 
         // All server related things are done.
         // Onto the clients.
         // Iterate through the pfds list.
-        for (i = 1; i <= pfds.max_index; i++)
+        // i goes up only if list[i] stays. If it is removed,
+        // the last one moves into list[i] and gets looked at next.
+        i = 1;
+        while (i < pfds.count)
         {   
-            // First make sure it is a valid descriptor.
-            if (pfds.list[i].fd != -1)
-            {   
-                // Check for error or if client closed connection.
-                if (pfds.list[i].revents & POLLERR || pfds.list[i].revents & POLLHUP)
-                {   
-                    printf("Removing descriptor %d\n", pfds.list[i].fd);
+            client_fd = pfds.list[i].fd;
+
+            // Nothing to do for this one. That is most of them,
+            // and for those we never touch conns.
+            if (pfds.list[i].revents == 0)
+            {
+                // Nothing happened on it before its deadline.
+                if (pfds.flags[i] & PFD_TIMED_OUT)
+                {
+                    LOG_DEBUG("Descriptor %d (%s:%u) timed out\n", client_fd,
+                              inet_ntoa(conns[client_fd].peer.sin_addr),
+                              ntohs(conns[client_fd].peer.sin_port));
+                    STATS_ADD(stats, timeouts, 1);
+                    conn_release(client_fd);
                     pfds_remove(&pfds, i);
+                    continue;
                 }
-                // Let us check if it is ready for reading.
-                else if (pfds.list[i].revents & POLLIN)
+                i++;
+                continue;
+            }
+            conn = &conns[client_fd];
+
+            // Check for error or if client closed connection.
+            if (pfds.list[i].revents & POLLERR || pfds.list[i].revents & POLLHUP)
+            {   
+                LOG_DEBUG("Removing descriptor %d\n", client_fd);
+                STATS_ADD(stats, errors, (pfds.list[i].revents & POLLERR) ? 1 : 0);
+                conn_release(client_fd);
+                pfds_remove(&pfds, i);
+                continue;
+            }
+
+            ret = SERVE_CONN_SUCCESS;
+
+            // Send out what is parked first. It might make
+            // room for more reading.
+            if (pfds.list[i].revents & POLLOUT)
+            {
+                ret = flush_connection(client_fd, conn);
+            }
+
+            // Let us check if it is ready for reading.
+            if (ret == SERVE_CONN_SUCCESS && pfds.list[i].revents & POLLIN)
+            {
+                // Let us serve the connection.
+                ret = serve_connection(client_fd, conn);
+                if (ret == SERVE_CONN_SUCCESS)
                 {
-                    // Let us serve the connection.
-                    ret = serve_connection(pfds.list[i].fd);
-                    if (ret != SERVE_CONN_SUCCESS)
-                    {
-                        pfds_remove(&pfds, i);
-                    }
+                    ret = end_pass(client_fd, conn);
                 }
             }
+
+            if (ret != SERVE_CONN_SUCCESS)
+            {
+                STATS_ADD(stats, errors, (ret == SERVE_CONN_FAILED) ? 1 : 0);
+                conn_release(client_fd);
+                pfds_remove(&pfds, i);
+                continue;
+            }
+
+            // Update what poll should watch, and when it has to
+            // hear from this one again.
+            pfds.list[i].events = conn_events(conn);
+            pfds.flags[i] &= ~PFD_TIMED_OUT;
+            conn_arm_timer(client_fd, conn, now);
+            i++;
         }
+
+        STATS_SET(stats, slots, pfds.count);
+        STATS_SET(stats, capacity, pfds.capacity);
     }
 }
\ No newline at end of file
@@ -0,0 +1,525 @@
+/*
+ * echo_server_v4.c
+ *
+ * Uses epoll as an event notifier.
+ * - Same CLI and echo semantics as echo_server_v3.c.
+ * - poll() needs the whole pollfd list on every call and we
+ *   need to walk the whole list after every wakeup. With a lot
+ *   of idle clients, every event costs O(n).
+ * - epoll keeps the interest list inside the kernel and hands
+ *   back only the descriptors which are ready. So every event
+ *   costs O(1) irrespective of number of idle clients.
+ * - Client sockets are non-blocking. Whatever send does not take
+ *   right away is parked in the connection's out_ring and sent
+ *   when epoll says the socket is writable (EPOLLOUT).
+ * - We recv straight into the out_ring and send from there. The
+ *   ring's memory is a buffer leased from a buf_pool.h pool when
+ *   data comes in, and returned once all of it is sent. A client
+ *   which keeps up holds a buffer only while we serve it; one which
+ *   doesn't holds it across events till it catches up. Idle
+ *   connections hold none.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+// One pool buffer is one out_ring.
+#define BUF_POOL_BUF_SIZE   65536
+#include "buf_pool.h"
+
+// Ring memory. Leased when a connection has data, back in the
+// pool once the client has taken all of it.
+static buf_pool_t   pool;
+
+#define OUT_RING_ALLOC()            buf_pool_lease(&pool)
+#define OUT_RING_RELEASE(data)      buf_pool_return(&pool, data)
+#include "out_ring.h"
+
+#if BUF_POOL_BUF_SIZE < OUT_RING_CAPACITY
+#error "A pool buffer has to hold a whole out_ring"
+#endif
+
+// Maximum number of ready descriptors epoll_wait
+// can hand back in one go.
+// If more are ready, we get them in the next epoll_wait.
+#define MAX_EVENTS  1024
+
+// Per-connection state. Indexed by descriptor.
+typedef struct conn
+{
+    // Echoed bytes the client hasn't taken yet.
+    out_ring_t      out;
+
+    // We stopped reading because out is above the high-water mark.
+    bool            paused;
+
+    // Client is done sending. We close once out is flushed.
+    bool            read_closed;
+
+    // What epoll is watching right now.
+    uint32_t        events;
+} conn_t;
+
+// Connection table. Grows as bigger descriptors show up.
+static conn_t       *conns = NULL;
+static uint64_t     conns_capacity = 0;
+
+// Kept open only to be given up when we run out of
+// descriptors. See turn_away_connection.
+static int          spare_fd = -1;
+
+// A note on edge-triggered mode (EPOLLET)
+//
+// - In level-triggered mode (which is what poll does),
+//   a descriptor is reported as long as it is ready.
+// - In edge-triggered mode, a descriptor is reported only
+//   when its state changes. Suppose a client sends 20,000 bytes
+//   and we read 10,000 of it, epoll will NOT report it again
+//   till the client sends more data.
+// - So, once a descriptor is reported, we need to keep reading
+//   it till recv() returns EAGAIN. That is the only way we can
+//   be sure that nothing is left behind.
+// - In return, epoll_wait does not keep waking us up for the
+//   same data again and again.
+
+// serve_connection can have different return values.
+// Based on it, we need to take action in the main
+// function.
+enum
+{
+    SERVE_CONN_SUCCESS = 0,
+    SERVE_CONN_FAILED,
+    SERVE_CONN_CLIENT_DISCONN,
+};
+
+// Makes sure the connection table can hold the passed descriptor.
+int conns_reserve (int fd)
+{
+    uint64_t    new_capacity = 0;
+    conn_t      *temp = NULL;
+
+    if ((uint64_t)fd < conns_capacity)
+    {
+        return 0;
+    }
+
+    new_capacity = conns_capacity ? conns_capacity : 1024;
+    while (new_capacity <= (uint64_t)fd)
+    {
+        new_capacity *= 2;
+    }
+
+    temp = realloc(conns, sizeof(conn_t) * new_capacity);
+    if (temp == NULL)
+    {
+        return -1;
+    }
+
+    conns = temp;
+    conns_capacity = new_capacity;
+    return 0;
+}
+
+int serve_connection (int client_fd)
+{
+    conn_t          *conn = &conns[client_fd];
+    int             ret = 0;
+    uint64_t        parked = 0;
+
+    // Edge-triggered: Keep going till there is nothing to read.
+    // Or till the client has too much waiting for it. We come
+    // back here once it has taken some (EPOLLOUT).
+    while (conn->paused == false)
+    {
+        // Get the data. It goes behind whatever is parked.
+        // The ring leases its buffer if it has none, and gives
+        // it back if nothing came in.
+        parked = out_ring_len(&conn->out);
+        ret = out_ring_recv(&conn->out, client_fd, OUT_RING_CAPACITY);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // All caught up. epoll will let us know
+                // when there is more.
+                ret = SERVE_CONN_SUCCESS;
+                break;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+
+            printf("recv() failed for fd = %d\n", client_fd);
+            ret = SERVE_CONN_FAILED;
+            break;
+        }
+        else if (ret == 0)
+        {
+            // This is the case when the other side of the
+            // connection has disconnected (at least its sending side).
+            // Whatever is parked still goes out.
+            conn->read_closed = true;
+            ret = (out_ring_len(&conn->out) > 0) ? SERVE_CONN_SUCCESS : SERVE_CONN_CLIENT_DISCONN;
+            break;
+        }
+
+        // You send back the same data.
+        // If something was parked already, the socket is full -
+        // EPOLLOUT sends it all. Otherwise send right away. Once
+        // all of it is gone, the buffer goes back to the pool.
+        if (parked == 0 && out_ring_flush(&conn->out, client_fd) < 0)
+        {
+            printf("send() failed for fd = %d\n", client_fd);
+            ret = SERVE_CONN_FAILED;
+            break;
+        }
+
+        if (out_ring_len(&conn->out) >= OUT_RING_HIGH_WATER)
+        {
+            conn->paused = true;
+        }
+        ret = SERVE_CONN_SUCCESS;
+    }
+
+    return ret;
+}
+
+// Socket is writable. Send what is parked.
+int flush_connection (int client_fd)
+{
+    conn_t      *conn = &conns[client_fd];
+    int         ret = 0;
+
+    ret = out_ring_flush(&conn->out, client_fd);
+    if (ret < 0)
+    {
+        printf("send() failed for fd = %d\n", client_fd);
+        return SERVE_CONN_FAILED;
+    }
+
+    // Client was done sending and has got everything back.
+    if (conn->read_closed == true && out_ring_len(&conn->out) == 0)
+    {
+        return SERVE_CONN_CLIENT_DISCONN;
+    }
+
+    // Enough room again. Reading resumes.
+    if (out_ring_len(&conn->out) <= OUT_RING_LOW_WATER)
+    {
+        conn->paused = false;
+    }
+    return SERVE_CONN_SUCCESS;
+}
+
+// Asks for EPOLLOUT only while something is parked.
+// A socket is writable almost all the time. With nothing to
+// send, EPOLLOUT would just be noise.
+int update_interest (int epoll_fd, int client_fd)
+{
+    conn_t              *conn = &conns[client_fd];
+    struct epoll_event  event = {0};
+
+    event.events = EPOLLIN | EPOLLET;
+    if (out_ring_len(&conn->out) > 0)
+    {
+        event.events |= EPOLLOUT;
+    }
+    if (event.events == conn->events)
+    {
+        return 0;
+    }
+
+    event.data.fd = client_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_fd, &event) < 0)
+    {
+        printf("epoll_ctl() failed for fd = %d\n", client_fd);
+        return -1;
+    }
+    conn->events = event.events;
+    return 0;
+}
+
+void close_connection (int client_fd)
+{
+    out_ring_free(&conns[client_fd].out);
+
+    // Closing the descriptor removes it from epoll as well.
+    close(client_fd);
+}
+
+// Out of descriptors (EMFILE/ENFILE). The connection requests stay
+// in the backlog, and edge-triggered epoll won't report them again
+// till yet another one comes in - they just hang. So we turn the
+// oldest one away: give up the spare descriptor, accept with it,
+// close right away and take the spare back. The client sees its
+// connection closed instead of waiting forever.
+// Returns 0 if one was turned away, -1 if the backlog is empty
+// (or there is no spare).
+int turn_away_connection (int sock_fd)
+{
+    int     fd = -1;
+
+    if (spare_fd < 0)
+    {
+        return -1;
+    }
+
+    close(spare_fd);
+    while (1)
+    {
+        fd = accept(sock_fd, NULL, NULL);
+        if (fd >= 0 || (errno != EINTR && errno != ECONNABORTED))
+        {
+            break;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    // With ENFILE somebody else might beat us to it. Then there
+    // is no spare next time, and we are back to hanging clients.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return (fd >= 0) ? 0 : -1;
+}
+
+// Accepts all outstanding connection requests and asks
+// epoll to monitor them.
+// Returns 0 on success, -1 if the server socket has a problem.
+int accept_connections (int epoll_fd, int sock_fd)
+{
+    int                 ret = 0;
+    int                 client_fd = 0;
+    struct epoll_event  event = {0};
+    int                 err = 0;
+    int                 turned_away = 0;
+
+    // Edge-triggered: Accept till there is nothing left in the backlog.
+    while (1)
+    {
+        ret = accept4(sock_fd, NULL, NULL, SOCK_NONBLOCK);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Backlog is empty.
+                return 0;
+            }
+            else if (errno == EINTR || errno == ECONNABORTED)
+            {
+                // Client gave up before we could accept it.
+                // Nothing to worry.
+                continue;
+            }
+
+            // Out of descriptors. Whoever waits in the backlog
+            // would hang. Turn them all away.
+            err = errno;
+            if (err == EMFILE || err == ENFILE)
+            {
+                while (turn_away_connection(sock_fd) == 0)
+                {
+                    turned_away += 1;
+                }
+            }
+            printf("accept() failed, errno = %d. Turned away %d waiting connections\n", err, turned_away);
+            return 0;
+        }
+        client_fd = ret;
+
+        // Fresh state for the connection.
+        if (conns_reserve(client_fd) < 0)
+        {
+            printf("realloc() failed for fd = %d\n", client_fd);
+            close(client_fd);
+            continue;
+        }
+        memset(&conns[client_fd], '\0', sizeof(conn_t));
+
+        // We have a new socket descriptor. Let us add it.
+        // EPOLLOUT is added only when something is parked.
+        memset(&event, '\0', sizeof(event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = client_fd;
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+        if (ret < 0)
+        {
+            printf("epoll_ctl() failed for fd = %d\n", client_fd);
+            close(client_fd);
+            continue;
+        }
+        conns[client_fd].events = event.events;
+    }
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number]\n", argv[0]);
+        return 0;
+    }
+
+    int                 sock_fd = 0;
+    int                 epoll_fd = 0;
+    int                 client_fd = 0;
+    int                 ret = 0;
+    int                 i = 0;
+    struct sockaddr_in  server_addr = {0};
+    const char          *ip_addr = argv[1];
+    uint16_t            port_no = atoi(argv[2]);
+    struct epoll_event  event = {0};
+    struct epoll_event  events[MAX_EVENTS];
+    int                 ready_fd_count = 0;
+
+    buf_pool_init(&pool);
+
+    // Lets create a socket.
+    // The server socket is non-blocking, so that we can
+    // accept till the backlog is empty.
+    ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    sock_fd = ret;
+
+    // Bind the socket to the passed (ip_address, port_no).
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    ret = bind(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("bind() failed\n");
+        return -1;
+    }
+
+    // Start listening
+    ret = listen(sock_fd, 50);
+    if (ret < 0)
+    {
+        printf("listen() failed\n");
+        return -1;
+    }
+
+    // One descriptor in reserve, for when we run out.
+    // Without it we still run, clients just hang then.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    printf("Listening at (%s, %u)\n", ip_addr, port_no);
+
+    // Create the epoll instance.
+    ret = epoll_create1(EPOLL_CLOEXEC);
+    if (ret < 0)
+    {
+        printf("epoll_create1() failed\n");
+        return -1;
+    }
+    epoll_fd = ret;
+
+    // Add the server socket.
+    // EPOLLEXCLUSIVE: If more than one epoll instance (one per
+    // process or thread) is monitoring this server socket, only
+    // one of them is woken up per connection request instead of
+    // all of them (thundering herd).
+    // With a single epoll instance, it makes no difference.
+    // Older kernels (< 4.5) don't know about it. Fall back.
+    event.events = EPOLLIN | EPOLLET | EPOLLEXCLUSIVE;
+    event.data.fd = sock_fd;
+    ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event);
+    if (ret < 0 && errno == EINVAL)
+    {
+        event.events = EPOLLIN | EPOLLET;
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event);
+    }
+    if (ret < 0)
+    {
+        printf("epoll_ctl() failed for server descriptor\n");
+        return -1;
+    }
+
+    // Do the thing
+    while (1)
+    {
+        ret = epoll_wait(epoll_fd, events, MAX_EVENTS, -1 /* Infinite timeout */);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("epoll_wait() failed\n");
+            return -1;
+        }
+        ready_fd_count = ret;
+
+        // Unlike poll, we only go over the ready descriptors.
+        for (i = 0; i < ready_fd_count; i++)
+        {
+            // Server socket related things.
+            if (events[i].data.fd == sock_fd)
+            {
+                if (events[i].events & EPOLLERR)
+                {
+                    // Some error occured while monitoring the server socket.
+                    // Let us kill the server.
+                    printf("epoll_wait() error(EPOLLERR) on server descriptor. Exiting...\n");
+                    exit(-1);
+                }
+
+                // There are new connection requests, process them.
+                accept_connections(epoll_fd, sock_fd);
+                continue;
+            }
+
+            // Onto the clients.
+            client_fd = events[i].data.fd;
+
+            // Check for error or if client closed connection.
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                close_connection(client_fd);
+                continue;
+            }
+
+            ret = SERVE_CONN_SUCCESS;
+
+            // Send out what is parked first. It might make
+            // room for more reading.
+            if (events[i].events & EPOLLOUT)
+            {
+                ret = flush_connection(client_fd);
+            }
+
+            // Let us serve the connection. Also when reading was
+            // paused and the flush above made room - there might be
+            // data we left in the socket, and edge-triggered epoll
+            // won't tell us about it again.
+            if (ret == SERVE_CONN_SUCCESS && conns[client_fd].read_closed == false &&
+                (events[i].events & (EPOLLIN | EPOLLOUT)))
+            {
+                ret = serve_connection(client_fd);
+            }
+
+            if (ret != SERVE_CONN_SUCCESS || update_interest(epoll_fd, client_fd) < 0)
+            {
+                close_connection(client_fd);
+            }
+        }
+    }
+}
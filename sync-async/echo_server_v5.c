@@ -0,0 +1,821 @@
+/*
+ * echo_server_v5.c
+ *
+ * Uses io_uring. Same CLI and echo semantics as echo_server_v3.c.
+ *
+ * - With select/poll/epoll, we get readiness notification and then
+ *   we call accept/recv/send ourselves. That is one syscall per
+ *   operation.
+ * - With io_uring, we queue operations in a ring shared with the
+ *   kernel (submission queue), the kernel does them and puts the
+ *   results in another shared ring (completion queue).
+ *   A single io_uring_enter() submits everything queued and waits
+ *   for completions. Under load, one io_uring_enter() covers a lot of
+ *   echoed messages.
+ * - We use
+ *      - Multishot accept: One accept request gives us every new
+ *        connection till it is cancelled.
+ *      - Multishot recv with a provided buffer ring: One recv request
+ *        per connection. The kernel picks a free buffer from the ring
+ *        registered by us and tells us which one it used.
+ *      - Linked sends: Buffers received on a connection are sent back
+ *        as a chain of linked send requests, so they go out in order.
+ *
+ * Needs Linux 6.0 or later. liburing is not used, we talk to
+ * the kernel directly.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+// Number of entries in the submission queue.
+// Completion queue is made 4 times bigger.
+#define SQ_ENTRIES      4096
+
+// Provided buffers. Must be a power of 2.
+#define BUF_COUNT       4096
+#define BUF_SIZE        10000
+#define BUF_GROUP_ID    0
+
+// Upper limit on the number of sends linked together.
+#define MAX_LINK_LEN    32
+
+// What a completion is about. Stored in user_data along with
+// the descriptor and the buffer id.
+enum
+{
+    REQ_ACCEPT = 1,
+    REQ_RECV,
+    REQ_SEND,
+};
+
+// user_data layout: | type (8 bits) | buffer id (24 bits) | fd (32 bits) |
+#define MAKE_USER_DATA(type, bid, fd)   (((uint64_t)(type) << 56) | ((uint64_t)(bid) << 32) | (uint32_t)(fd))
+#define USER_DATA_TYPE(ud)              ((int)((ud) >> 56))
+#define USER_DATA_BID(ud)               ((int)(((ud) >> 32) & 0xffffff))
+#define USER_DATA_FD(ud)                ((int)((ud) & 0xffffffff))
+
+// Everything we need to talk to one io_uring instance.
+typedef struct uring
+{
+    int                     fd;
+
+    // Submission queue. Shared with the kernel.
+    unsigned                *sq_head;
+    unsigned                *sq_tail;
+    unsigned                sq_mask;
+    unsigned                sq_entries;
+    struct io_uring_sqe     *sqes;
+
+    // Our copy of the submission tail.
+    // Published to the kernel before io_uring_enter().
+    unsigned                sqe_tail;
+
+    // Number of SQEs queued, but not yet submitted.
+    unsigned                to_submit;
+
+    // Completion queue. Shared with the kernel.
+    unsigned                *cq_head;
+    unsigned                *cq_tail;
+    unsigned                cq_mask;
+    struct io_uring_cqe     *cqes;
+
+    // Provided buffer ring.
+    struct io_uring_buf_ring    *buf_ring;
+    uint8_t                     *buf_base;
+    uint16_t                    buf_ring_tail;
+} uring_t;
+
+// Per-connection state. Indexed by descriptor.
+typedef struct conn
+{
+    // Number of requests which are with the kernel.
+    // The descriptor is closed only once this becomes 0.
+    // Otherwise a new connection could get the same descriptor
+    // and get a completion meant for the old one.
+    uint32_t        ops;
+
+    // Number of sends with the kernel.
+    uint32_t        sending;
+
+    // Buffers received, waiting to be sent back.
+    // Singly linked through buf_next[].
+    int32_t         pending_head;
+    int32_t         pending_tail;
+
+    // Next connection waiting for buffers (-1 terminates).
+    int32_t         starved_next;
+
+    bool            in_use;
+    bool            recv_armed;
+
+    // Client is done sending (recv got 0). Closed once
+    // everything it sent has been echoed back.
+    bool            read_closed;
+    bool            starved;
+    bool            closing;
+    bool            shut;
+} conn_t;
+
+// Connection table. Grows as bigger descriptors show up.
+static conn_t       *conns = NULL;
+static uint64_t     conns_capacity = 0;
+
+// Per-buffer bookkeeping.
+static uint32_t     buf_len[BUF_COUNT];
+static int32_t      buf_next[BUF_COUNT];
+
+// Connections whose multishot recv stopped because all
+// buffers were in use. Re-armed once the ring has some free.
+static int32_t      starved_head = -1;
+
+// Buffers the kernel has handed us and we haven't given back.
+// The rest are in the buffer ring, free for the next recv.
+static uint32_t     bufs_held = 0;
+
+int io_uring_setup (unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+int io_uring_enter (int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+int io_uring_register (int ring_fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// Sets up the io_uring instance and maps the queues.
+int uring_init (uring_t *ring)
+{
+    struct io_uring_params  params = {0};
+    uint8_t                 *sq_ptr = NULL;
+    uint8_t                 *cq_ptr = NULL;
+    size_t                  sq_size = 0;
+    size_t                  cq_size = 0;
+    unsigned                *sq_array = NULL;
+    unsigned                i = 0;
+    int                     ret = 0;
+
+    memset(ring, '\0', sizeof(uring_t));
+
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = SQ_ENTRIES * 4;
+    ret = io_uring_setup(SQ_ENTRIES, &params);
+    if (ret < 0)
+    {
+        printf("io_uring_setup() failed, errno = %d\n", errno);
+        return -1;
+    }
+    ring->fd = ret;
+
+    // Map the submission and completion queues.
+    // Newer kernels let us map both with a single mmap.
+    sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (cq_size > sq_size)
+        {
+            sq_size = cq_size;
+        }
+        cq_size = sq_size;
+    }
+
+    sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                  ring->fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED)
+    {
+        printf("mmap() failed for the submission queue\n");
+        return -1;
+    }
+
+    if (params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        cq_ptr = sq_ptr;
+    }
+    else
+    {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+        {
+            printf("mmap() failed for the completion queue\n");
+            return -1;
+        }
+    }
+
+    ring->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        printf("mmap() failed for the SQE array\n");
+        return -1;
+    }
+
+    ring->sq_head = (unsigned *)(sq_ptr + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq_ptr + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq_ptr + params.sq_off.ring_mask);
+    ring->sq_entries = *(unsigned *)(sq_ptr + params.sq_off.ring_entries);
+    ring->sqe_tail = *ring->sq_tail;
+
+    // The SQ ring holds indices into the SQE array.
+    // We always use SQE i for slot i. Set it up once.
+    sq_array = (unsigned *)(sq_ptr + params.sq_off.array);
+    for (i = 0; i < ring->sq_entries; i++)
+    {
+        sq_array[i] = i;
+    }
+
+    ring->cq_head = (unsigned *)(cq_ptr + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq_ptr + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq_ptr + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq_ptr + params.cq_off.cqes);
+
+    return 0;
+}
+
+// Publishes queued SQEs and enters the kernel.
+// Waits for at least min_complete completions.
+int uring_submit (uring_t *ring, unsigned min_complete)
+{
+    int     ret = 0;
+
+    // Make the SQEs visible before the kernel sees the new tail.
+    __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+
+    while (1)
+    {
+        ret = io_uring_enter(ring->fd, ring->to_submit, min_complete,
+                             min_complete ? IORING_ENTER_GETEVENTS : 0);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("io_uring_enter() failed, errno = %d\n", errno);
+            return -1;
+        }
+        ring->to_submit -= ret;
+        return 0;
+    }
+}
+
+// Number of SQEs we can still queue.
+unsigned uring_sq_space (uring_t *ring)
+{
+    return ring->sq_entries - (ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+}
+
+// Gets a free SQE. If the queue is full, submits what we
+// have to make space.
+struct io_uring_sqe *uring_get_sqe (uring_t *ring)
+{
+    struct io_uring_sqe *sqe = NULL;
+
+    while (uring_sq_space(ring) == 0)
+    {
+        if (uring_submit(ring, 0) < 0)
+        {
+            exit(-1);
+        }
+    }
+
+    sqe = &ring->sqes[ring->sqe_tail & ring->sq_mask];
+    memset(sqe, '\0', sizeof(struct io_uring_sqe));
+    ring->sqe_tail += 1;
+    ring->to_submit += 1;
+    return sqe;
+}
+
+// Gives a buffer back to the kernel.
+void uring_recycle_buffer (uring_t *ring, int bid)
+{
+    struct io_uring_buf *buf = NULL;
+
+    buf = &ring->buf_ring->bufs[ring->buf_ring_tail & (BUF_COUNT - 1)];
+    buf->addr = (uint64_t)(uintptr_t)(ring->buf_base + (size_t)bid * BUF_SIZE);
+    buf->len = BUF_SIZE;
+    buf->bid = bid;
+    ring->buf_ring_tail += 1;
+
+    // Make the buffer visible to the kernel.
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_ring_tail, __ATOMIC_RELEASE);
+    bufs_held -= 1;
+}
+
+// Allocates the buffers and registers them as a provided buffer ring.
+int uring_setup_buffers (uring_t *ring)
+{
+    struct io_uring_buf_reg reg = {0};
+    int                     ret = 0;
+    int                     i = 0;
+
+    // The ring itself.
+    ring->buf_ring = mmap(NULL, BUF_COUNT * sizeof(struct io_uring_buf),
+                          PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring->buf_ring == MAP_FAILED)
+    {
+        printf("mmap() failed for the buffer ring\n");
+        return -1;
+    }
+
+    // The buffers. Pages are allocated only when touched.
+    ring->buf_base = mmap(NULL, (size_t)BUF_COUNT * BUF_SIZE,
+                          PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    if (ring->buf_base == MAP_FAILED)
+    {
+        printf("mmap() failed for the buffers\n");
+        return -1;
+    }
+
+    reg.ring_addr = (uint64_t)(uintptr_t)ring->buf_ring;
+    reg.ring_entries = BUF_COUNT;
+    reg.bgid = BUF_GROUP_ID;
+    ret = io_uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1);
+    if (ret < 0)
+    {
+        printf("io_uring_register() failed for the buffer ring, errno = %d\n", errno);
+        return -1;
+    }
+
+    // Hand over every buffer.
+    ring->buf_ring_tail = 0;
+    bufs_held = BUF_COUNT;
+    for (i = 0; i < BUF_COUNT; i++)
+    {
+        uring_recycle_buffer(ring, i);
+    }
+    return 0;
+}
+
+// Makes sure the connection table can hold the passed descriptor.
+int conns_reserve (int fd)
+{
+    uint64_t    new_capacity = 0;
+    conn_t      *temp = NULL;
+
+    if ((uint64_t)fd < conns_capacity)
+    {
+        return 0;
+    }
+
+    new_capacity = conns_capacity ? conns_capacity : 1024;
+    while (new_capacity <= (uint64_t)fd)
+    {
+        new_capacity *= 2;
+    }
+
+    temp = realloc(conns, sizeof(conn_t) * new_capacity);
+    if (temp == NULL)
+    {
+        return -1;
+    }
+    memset(temp + conns_capacity, '\0', sizeof(conn_t) * (new_capacity - conns_capacity));
+
+    conns = temp;
+    conns_capacity = new_capacity;
+    return 0;
+}
+
+void queue_accept (uring_t *ring, int sock_fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sock_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->user_data = MAKE_USER_DATA(REQ_ACCEPT, 0, sock_fd);
+}
+
+void queue_recv (uring_t *ring, int client_fd)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+
+    // No buffer is passed. The kernel picks one from
+    // our buffer group when data arrives.
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = client_fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = BUF_GROUP_ID;
+    sqe->user_data = MAKE_USER_DATA(REQ_RECV, 0, client_fd);
+
+    conns[client_fd].recv_armed = true;
+    conns[client_fd].ops += 1;
+}
+
+// Sends back everything received on this connection so far.
+// The sends are linked, so the kernel starts one only after the
+// previous one is complete. That keeps the echoed data in order.
+void queue_sends (uring_t *ring, int client_fd)
+{
+    conn_t              *conn = &conns[client_fd];
+    struct io_uring_sqe *sqe = NULL;
+    int                 bid = 0;
+    int                 link_len = 0;
+
+    // A chain must be submitted in one go.
+    // Make space for it up front.
+    while (uring_sq_space(ring) < MAX_LINK_LEN)
+    {
+        if (uring_submit(ring, 0) < 0)
+        {
+            exit(-1);
+        }
+    }
+
+    while (conn->pending_head != -1 && link_len < MAX_LINK_LEN)
+    {
+        bid = conn->pending_head;
+        conn->pending_head = buf_next[bid];
+        if (conn->pending_head == -1)
+        {
+            conn->pending_tail = -1;
+        }
+
+        sqe = uring_get_sqe(ring);
+        sqe->opcode = IORING_OP_SEND;
+        sqe->fd = client_fd;
+        sqe->addr = (uint64_t)(uintptr_t)(ring->buf_base + (size_t)bid * BUF_SIZE);
+        sqe->len = buf_len[bid];
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        sqe->user_data = MAKE_USER_DATA(REQ_SEND, bid, client_fd);
+        sqe->flags = IOSQE_IO_LINK;
+
+        conn->sending += 1;
+        conn->ops += 1;
+        link_len += 1;
+    }
+
+    // The last one ends the chain.
+    if (sqe != NULL)
+    {
+        sqe->flags &= ~IOSQE_IO_LINK;
+    }
+}
+
+// Starts tearing down a connection.
+// The descriptor is closed once the kernel is done with it.
+void close_connection (uring_t *ring, int client_fd)
+{
+    conn_t      *conn = &conns[client_fd];
+    int         bid = 0;
+
+    conn->closing = true;
+
+    // Buffers which never made it to a send can go back right away.
+    while (conn->pending_head != -1)
+    {
+        bid = conn->pending_head;
+        conn->pending_head = buf_next[bid];
+        uring_recycle_buffer(ring, bid);
+    }
+    conn->pending_tail = -1;
+
+    if (conn->ops > 0 || conn->starved)
+    {
+        // A starved connection is still on the starved list.
+        // rearm_starved() finishes the job.
+
+        // shutdown() finishes the multishot recv (it gets 0)
+        // and fails the outstanding sends.
+        if (conn->shut == false)
+        {
+            shutdown(client_fd, SHUT_RDWR);
+            conn->shut = true;
+        }
+        return;
+    }
+
+    close(client_fd);
+    memset(conn, '\0', sizeof(conn_t));
+}
+
+void handle_accept (uring_t *ring, int sock_fd, struct io_uring_cqe *cqe)
+{
+    int     client_fd = cqe->res;
+
+    // Multishot accept stopped. Queue another one.
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+    {
+        queue_accept(ring, sock_fd);
+    }
+
+    if (client_fd < 0)
+    {
+        printf("accept() failed, errno = %d\n", -client_fd);
+        return;
+    }
+
+    if (conns_reserve(client_fd) < 0)
+    {
+        printf("realloc() failed for fd = %d\n", client_fd);
+        close(client_fd);
+        return;
+    }
+
+    memset(&conns[client_fd], '\0', sizeof(conn_t));
+    conns[client_fd].in_use = true;
+    conns[client_fd].pending_head = -1;
+    conns[client_fd].pending_tail = -1;
+    conns[client_fd].starved_next = -1;
+    queue_recv(ring, client_fd);
+}
+
+void handle_recv (uring_t *ring, int client_fd, struct io_uring_cqe *cqe)
+{
+    conn_t      *conn = &conns[client_fd];
+    int         bid = 0;
+
+    if ((cqe->flags & IORING_CQE_F_MORE) == 0)
+    {
+        // This was the last completion of the multishot recv.
+        conn->recv_armed = false;
+        conn->ops -= 1;
+    }
+
+    if (cqe->res > 0)
+    {
+        // Got some data in buffer bid. Queue it for sending.
+        bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        bufs_held += 1;
+        buf_len[bid] = cqe->res;
+        buf_next[bid] = -1;
+
+        if (conn->closing)
+        {
+            uring_recycle_buffer(ring, bid);
+        }
+        else
+        {
+            if (conn->pending_tail == -1)
+            {
+                conn->pending_head = bid;
+            }
+            else
+            {
+                buf_next[conn->pending_tail] = bid;
+            }
+            conn->pending_tail = bid;
+
+            // Only one chain of sends at a time.
+            // The rest goes out when it completes.
+            if (conn->sending == 0)
+            {
+                queue_sends(ring, client_fd);
+            }
+        }
+    }
+    else if (cqe->res == -ENOBUFS)
+    {
+        // All buffers are in use. Wait till some come back.
+        if (conn->closing)
+        {
+            if (conn->ops == 0)
+            {
+                close_connection(ring, client_fd);
+            }
+        }
+        else if (conn->starved == false)
+        {
+            conn->starved = true;
+            conn->starved_next = starved_head;
+            starved_head = client_fd;
+        }
+        return;
+    }
+    else if (cqe->res == 0 && conn->closing == false)
+    {
+        // The client is done sending, but may still be reading.
+        // Closing now would drop the echoes not yet sent.
+        conn->read_closed = true;
+        if (conn->sending == 0 && conn->pending_head == -1)
+        {
+            close_connection(ring, client_fd);
+        }
+        return;
+    }
+    else
+    {
+        // recv failed.
+        close_connection(ring, client_fd);
+        return;
+    }
+
+    if (conn->recv_armed == false && conn->closing == false)
+    {
+        queue_recv(ring, client_fd);
+    }
+    else if (conn->closing && conn->ops == 0)
+    {
+        close_connection(ring, client_fd);
+    }
+}
+
+void handle_send (uring_t *ring, int client_fd, struct io_uring_cqe *cqe)
+{
+    conn_t      *conn = &conns[client_fd];
+    int         bid = USER_DATA_BID(cqe->user_data);
+
+    conn->sending -= 1;
+    conn->ops -= 1;
+
+    // The buffer can be used for another recv.
+    uring_recycle_buffer(ring, bid);
+
+    if (cqe->res < (int)buf_len[bid])
+    {
+        // Short send or a failed one.
+        // Just like echo_server_v3.c, the connection is dropped.
+        close_connection(ring, client_fd);
+        return;
+    }
+
+    if (conn->closing)
+    {
+        if (conn->ops == 0)
+        {
+            close_connection(ring, client_fd);
+        }
+        return;
+    }
+
+    if (conn->sending == 0 && conn->pending_head != -1)
+    {
+        queue_sends(ring, client_fd);
+    }
+    else if (conn->sending == 0 && conn->read_closed)
+    {
+        // Everything has been echoed back.
+        close_connection(ring, client_fd);
+    }
+}
+
+// Re-arms recv on connections which ran out of buffers.
+void rearm_starved (uring_t *ring)
+{
+    int32_t     client_fd = starved_head;
+    int32_t     next = 0;
+
+    starved_head = -1;
+    while (client_fd != -1)
+    {
+        next = conns[client_fd].starved_next;
+        conns[client_fd].starved = false;
+        conns[client_fd].starved_next = -1;
+
+        if (conns[client_fd].closing)
+        {
+            if (conns[client_fd].ops == 0)
+            {
+                close_connection(ring, client_fd);
+            }
+        }
+        else if (conns[client_fd].recv_armed == false)
+        {
+            queue_recv(ring, client_fd);
+        }
+        client_fd = next;
+    }
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number]\n", argv[0]);
+        return 0;
+    }
+
+    int                 sock_fd = 0;
+    int                 ret = 0;
+    struct sockaddr_in  server_addr = {0};
+    const char          *ip_addr = argv[1];
+    uint16_t            port_no = atoi(argv[2]);
+    uring_t             ring = {0};
+    struct io_uring_cqe *cqe = NULL;
+    unsigned            head = 0;
+    unsigned            tail = 0;
+    int                 fd = 0;
+
+    // Lets create a socket.
+    ret = socket(AF_INET, SOCK_STREAM, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    sock_fd = ret;
+
+    // Bind the socket to the passed (ip_address, port_no).
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    ret = bind(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("bind() failed\n");
+        return -1;
+    }
+
+    // Start listening
+    ret = listen(sock_fd, 50);
+    if (ret < 0)
+    {
+        printf("listen() failed\n");
+        return -1;
+    }
+    printf("Listening at (%s, %u)\n", ip_addr, port_no);
+
+    // Setup io_uring and the buffers.
+    ret = uring_init(&ring);
+    if (ret < 0)
+    {
+        return -1;
+    }
+
+    ret = uring_setup_buffers(&ring);
+    if (ret < 0)
+    {
+        return -1;
+    }
+
+    ret = conns_reserve(sock_fd);
+    if (ret < 0)
+    {
+        printf("realloc() failed\n");
+        return -1;
+    }
+
+    // One accept request for all connections to come.
+    queue_accept(&ring, sock_fd);
+
+    // Do the thing
+    while (1)
+    {
+        // Submit everything queued in the last round
+        // and wait for something to complete.
+        // This is the only syscall in the loop.
+        ret = uring_submit(&ring, 1);
+        if (ret < 0)
+        {
+            return -1;
+        }
+
+        // Go over all the completions.
+        head = *ring.cq_head;
+        tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail)
+        {
+            cqe = &ring.cqes[head & ring.cq_mask];
+            fd = USER_DATA_FD(cqe->user_data);
+
+            switch (USER_DATA_TYPE(cqe->user_data))
+            {
+                case REQ_ACCEPT:
+                    handle_accept(&ring, fd, cqe);
+                    break;
+
+                case REQ_RECV:
+                    handle_recv(&ring, fd, cqe);
+                    break;
+
+                case REQ_SEND:
+                    handle_send(&ring, fd, cqe);
+                    break;
+            }
+
+            head += 1;
+        }
+
+        // Let the kernel reuse the completion slots.
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+        // Not just when buffers came back in this round. One may
+        // have come back in an earlier round, before the recv that
+        // starved had even run out.
+        if (starved_head != -1 && bufs_held < BUF_COUNT)
+        {
+            rearm_starved(&ring);
+        }
+    }
+}
@@ -0,0 +1,504 @@
+/*
+ * echo_server_v6.c
+ *
+ * Multi-reactor version of echo_server_v4.c.
+ * - echo_server_v4.c runs one epoll loop on one thread. It can use
+ *   just one core, however many the machine has.
+ * - Here we start N threads (reactors). Each one is pinned to one of
+ *   the CPUs we are allowed to run on (affinity.h) and has its own
+ *   listening socket, its own epoll instance and its own clients.
+ *   Nothing is shared between them, so there are no locks.
+ * - All the listening sockets are bound to the same (address, port)
+ *   using SO_REUSEPORT. The kernel spreads the incoming connections
+ *   across them.
+ * - Each reactor records, in its own histograms, how long a ready
+ *   connection waited behind others from the same epoll_wait batch
+ *   and how long each echo took (recv returned -> send returned).
+ *   Send SIGUSR1 to print the percentiles.
+ * - Each reactor also counts connections, bytes and errors in its
+ *   own cache line of /dev/shm/sastat.<port> (stats.h).
+ *   $ ./sastat <port> watches them.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include "affinity.h"
+#include "hdr_hist.h"
+#include "stats.h"
+
+// Maximum number of ready descriptors epoll_wait
+// can hand back in one go.
+#define MAX_EVENTS  1024
+
+// Everything one reactor owns.
+// This is what pfds_t is to echo_server_v3.c, but per thread.
+typedef struct reactor
+{
+    // Index of this reactor.
+    int                 id;
+
+    // CPU it pins itself to. -1 if we don't know which
+    // CPUs are ours.
+    int                 cpu;
+
+    // Its own listening socket and epoll instance.
+    int                 sock_fd;
+    int                 epoll_fd;
+
+    // Kept open only to be given up when we run out of
+    // descriptors. See turn_away_connection.
+    int                 spare_fd;
+
+    // Number of clients this reactor is serving.
+    uint64_t            conn_count;
+
+    // Latencies. Only this reactor records into them.
+    hist_t              wait;
+    hist_t              service;
+
+    // Its line in the stats block.
+    stats_counters_t    *stats;
+
+    pthread_t           tinfo;
+} reactor_t;
+
+// Address all the reactors listen on.
+static struct sockaddr_in   server_addr;
+
+// serve_connection can have different return values.
+// Based on it, we need to take action in the main
+// function.
+enum
+{
+    SERVE_CONN_SUCCESS = 0,
+    SERVE_CONN_FAILED,
+    SERVE_CONN_CLIENT_DISCONN,
+};
+
+uint64_t now_ns ()
+{
+    struct timespec     ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int serve_connection (reactor_t *reactor, int client_fd)
+{
+    uint8_t         request_buffer[10000];
+    int             ret = 0;
+    int             req_len = 0;
+    uint64_t        start_ns = 0;
+
+    // Edge-triggered: Keep going till there is nothing to read.
+    while (1)
+    {
+        ret = recv(client_fd, request_buffer, sizeof(request_buffer), MSG_DONTWAIT);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return SERVE_CONN_SUCCESS;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+
+            printf("recv() failed for fd = %d\n", client_fd);
+            return SERVE_CONN_FAILED;
+        }
+        else if (ret == 0)
+        {
+            // This is the case when the other side of the
+            // connection has disconnected.
+            return SERVE_CONN_CLIENT_DISCONN;
+        }
+
+        req_len = ret;
+        start_ns = now_ns();
+        STATS_ADD(reactor->stats, bytes_in, req_len);
+
+        // You send back the same data
+        ret = send(client_fd, request_buffer, req_len, 0);
+        if (ret < req_len)
+        {
+            printf("send() failed for fd = %d\n", client_fd);
+            return SERVE_CONN_FAILED;
+        }
+        STATS_ADD(reactor->stats, bytes_out, ret);
+
+        hist_record(&reactor->service, now_ns() - start_ns);
+    }
+}
+
+// Out of descriptors (EMFILE/ENFILE). Like echo_server_v4.c: the
+// listener is edge-triggered, so whoever waits in the backlog would
+// hang. Give up the spare, accept and close the oldest one with it,
+// take the spare back.
+// Descriptors are shared by all reactors. Another one may grab ours
+// before we get it back - then we try again next time.
+// Returns 0 if one was turned away, -1 if the backlog is empty
+// (or there is no spare).
+int turn_away_connection (reactor_t *reactor)
+{
+    int     fd = -1;
+
+    if (reactor->spare_fd < 0)
+    {
+        reactor->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        if (reactor->spare_fd < 0)
+        {
+            return -1;
+        }
+    }
+
+    close(reactor->spare_fd);
+    while (1)
+    {
+        fd = accept(reactor->sock_fd, NULL, NULL);
+        if (fd >= 0 || (errno != EINTR && errno != ECONNABORTED))
+        {
+            break;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    reactor->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return (fd >= 0) ? 0 : -1;
+}
+
+// Accepts all outstanding connection requests on this
+// reactor's listening socket.
+void accept_connections (reactor_t *reactor)
+{
+    int                 ret = 0;
+    int                 client_fd = 0;
+    struct epoll_event  event = {0};
+    int                 err = 0;
+    int                 turned_away = 0;
+
+    while (1)
+    {
+        ret = accept(reactor->sock_fd, NULL, NULL);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            else if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            // Out of descriptors. Whoever waits in the backlog
+            // would hang. Turn them all away.
+            err = errno;
+            if (err == EMFILE || err == ENFILE)
+            {
+                while (turn_away_connection(reactor) == 0)
+                {
+                    turned_away += 1;
+                }
+            }
+            printf("reactor %d: accept() failed, errno = %d. Turned away %d waiting connections\n",
+                   reactor->id, err, turned_away);
+            return;
+        }
+        client_fd = ret;
+
+        memset(&event, '\0', sizeof(event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = client_fd;
+        ret = epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+        if (ret < 0)
+        {
+            printf("reactor %d: epoll_ctl() failed for fd = %d\n", reactor->id, client_fd);
+            close(client_fd);
+            continue;
+        }
+        reactor->conn_count += 1;
+        STATS_ADD(reactor->stats, accepts, 1);
+        STATS_ADD(reactor->stats, conns, 1);
+    }
+}
+
+// Creates the reactor's own listening socket and epoll instance.
+int reactor_init (reactor_t *reactor, int id)
+{
+    int                 ret = 0;
+    int                 one = 1;
+    struct epoll_event  event = {0};
+
+    memset(reactor, '\0', sizeof(reactor_t));
+    reactor->id = id;
+    hist_init(&reactor->wait);
+    hist_init(&reactor->service);
+
+    ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    reactor->sock_fd = ret;
+
+    // Every reactor binds to the same (address, port).
+    // The kernel picks one listening socket per connection
+    // based on a hash of the connection's 4-tuple.
+    ret = setsockopt(reactor->sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (ret < 0)
+    {
+        printf("setsockopt(SO_REUSEPORT) failed\n");
+        return -1;
+    }
+
+    ret = bind(reactor->sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("bind() failed\n");
+        return -1;
+    }
+
+    ret = listen(reactor->sock_fd, 50);
+    if (ret < 0)
+    {
+        printf("listen() failed\n");
+        return -1;
+    }
+
+    // One descriptor in reserve, for when we run out.
+    reactor->spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    ret = epoll_create1(EPOLL_CLOEXEC);
+    if (ret < 0)
+    {
+        printf("epoll_create1() failed\n");
+        return -1;
+    }
+    reactor->epoll_fd = ret;
+
+    // Nobody else watches this listening socket.
+    // So no EPOLLEXCLUSIVE here.
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = reactor->sock_fd;
+    ret = epoll_ctl(reactor->epoll_fd, EPOLL_CTL_ADD, reactor->sock_fd, &event);
+    if (ret < 0)
+    {
+        printf("epoll_ctl() failed for server descriptor\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+// The event loop. Same as echo_server_v4.c's main loop.
+void* reactor_run (void *arg)
+{
+    reactor_t           *reactor = arg;
+    struct epoll_event  events[MAX_EVENTS];
+    int                 ready_fd_count = 0;
+    int                 client_fd = 0;
+    int                 ret = 0;
+    int                 i = 0;
+    uint64_t            wakeup_ns = 0;
+
+    // Pin ourselves to our CPU.
+    // Keeps the reactor's clients warm in that CPU's caches.
+    ret = affinity_pin(reactor->cpu);
+    if (ret != 0)
+    {
+        printf("reactor %d: pthread_setaffinity_np() failed for CPU %d\n", reactor->id, reactor->cpu);
+    }
+
+    while (1)
+    {
+        ret = epoll_wait(reactor->epoll_fd, events, MAX_EVENTS, -1 /* Infinite timeout */);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("reactor %d: epoll_wait() failed\n", reactor->id);
+            exit(-1);
+        }
+        ready_fd_count = ret;
+        wakeup_ns = now_ns();
+
+        for (i = 0; i < ready_fd_count; i++)
+        {
+            if (events[i].data.fd == reactor->sock_fd)
+            {
+                if (events[i].events & EPOLLERR)
+                {
+                    printf("reactor %d: epoll_wait() error(EPOLLERR) on server descriptor. Exiting...\n", reactor->id);
+                    exit(-1);
+                }
+
+                accept_connections(reactor);
+                continue;
+            }
+
+            client_fd = events[i].data.fd;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                close(client_fd);
+                reactor->conn_count -= 1;
+                STATS_ADD(reactor->stats, conns, -1);
+                STATS_ADD(reactor->stats, errors, (events[i].events & EPOLLERR) ? 1 : 0);
+            }
+            else if (events[i].events & EPOLLIN)
+            {
+                // Everything before this in the batch made it wait.
+                hist_record(&reactor->wait, now_ns() - wakeup_ns);
+
+                ret = serve_connection(reactor, client_fd);
+                if (ret != SERVE_CONN_SUCCESS)
+                {
+                    close(client_fd);
+                    reactor->conn_count -= 1;
+                    STATS_ADD(reactor->stats, conns, -1);
+                    STATS_ADD(reactor->stats, errors, (ret == SERVE_CONN_FAILED) ? 1 : 0);
+                }
+            }
+        }
+    }
+
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 3 && !(argc == 5 && strcmp(argv[3], "--threads") == 0))
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number] [--threads N]\n", argv[0]);
+        printf("N defaults to the number of CPUs we may run on\n");
+        return 0;
+    }
+
+    int                 ret = 0;
+    int                 i = 0;
+    const char          *ip_addr = argv[1];
+    uint16_t            port_no = atoi(argv[2]);
+    long                thread_count = 0;
+    int                 cpus[CPU_SETSIZE];
+    int                 cpu_count = 0;
+    reactor_t           *reactors = NULL;
+    stats_block_t       *stats = NULL;
+    sigset_t            sigs;
+    hist_t              *wait = NULL;
+    hist_t              *service = NULL;
+
+    // Before any thread pins itself. This is what we got
+    // from whoever started us.
+    cpu_count = affinity_cpus(cpus);
+    thread_count = cpu_count;
+    if (argc == 5)
+    {
+        thread_count = atoi(argv[4]);
+    }
+    if (thread_count <= 0)
+    {
+        thread_count = 1;
+    }
+
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    reactors = calloc(thread_count, sizeof(reactor_t));
+    if (reactors == NULL)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+
+    // Set up all the reactors before starting any.
+    // That way a bind() failure stops us before we serve anybody.
+    for (i = 0; i < thread_count; i++)
+    {
+        ret = reactor_init(&reactors[i], i);
+        if (ret < 0)
+        {
+            printf("reactor_init() failed for reactor %d\n", i);
+            return -1;
+        }
+        reactors[i].cpu = (cpu_count > 0) ? cpus[i % cpu_count] : -1;
+    }
+
+    // One line of counters per reactor.
+    stats = stats_open("echo_server_v6", port_no, thread_count);
+    for (i = 0; i < thread_count; i++)
+    {
+        reactors[i].stats = &stats->thread[i];
+    }
+    printf("Listening at (%s, %u) with %ld reactors\n", ip_addr, port_no, thread_count);
+
+    // SIGUSR1 is for us, not the reactors. Block it here,
+    // the reactors inherit that.
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    for (i = 0; i < thread_count; i++)
+    {
+        ret = pthread_create(&reactors[i].tinfo, NULL, reactor_run, &reactors[i]);
+        if (ret != 0)
+        {
+            printf("pthread_create() failed for reactor %d\n", i);
+            return -1;
+        }
+    }
+
+    wait = malloc(sizeof(hist_t));
+    service = malloc(sizeof(hist_t));
+    if (wait == NULL || service == NULL)
+    {
+        printf("malloc() failed\n");
+        return -1;
+    }
+
+    // The reactors never return. We print their latencies
+    // whenever somebody asks.
+    while (1)
+    {
+        if (sigwaitinfo(&sigs, NULL) != SIGUSR1)
+        {
+            continue;
+        }
+
+        hist_init(wait);
+        hist_init(service);
+        for (i = 0; i < thread_count; i++)
+        {
+            hist_merge(wait, &reactors[i].wait);
+            hist_merge(service, &reactors[i].service);
+        }
+        hist_print(stdout, "batch wait", wait);
+        hist_print(stdout, "service", service);
+        fflush(stdout);
+    }
+
+    return 0;
+}
@@ -0,0 +1,608 @@
+/*
+ * echo_server_v7.c
+ *
+ * epoll reactor + work-stealing thread pool.
+ * - echo_server_v4.c serves every ready connection on one thread.
+ *   server_v3.c uses a thread per connection. Neither uses the cores
+ *   well when some clients send a lot more than others.
+ * - Here one thread (the reactor) runs epoll and pushes ready
+ *   connections onto its deque. Worker threads take connections
+ *   off the deques and run serve_connection on them.
+ * - A connection gets a fixed budget of recv/send rounds. If it still
+ *   has data after that, the worker pushes it onto its own deque and
+ *   picks up something else. Idle workers steal from busy ones. So a
+ *   few heavy clients can't starve everybody else.
+ * - The deques are Chase-Lev work-stealing deques. The owner pushes
+ *   and takes at the bottom, thieves steal from the top. The owner
+ *   doesn't need any atomic read-modify-write unless it is down to
+ *   the last element.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+
+// Maximum number of ready descriptors epoll_wait
+// can hand back in one go.
+#define MAX_EVENTS          1024
+
+// Number of recv/send rounds a connection gets before it
+// has to let others run.
+#define SERVE_BUDGET        16
+
+// Initial number of slots in a deque. It grows when full.
+#define DEQUE_INITIAL_SIZE  1024
+
+// Returned by take/steal when there is nothing to hand out.
+#define DEQUE_EMPTY         (-1)
+
+// Returned by steal when it lost a race with somebody else.
+#define DEQUE_ABORT         (-2)
+
+// The array behind a deque.
+typedef struct deque_array
+{
+    int64_t                 size;
+    int64_t                 *buf;
+
+    // Arrays we grew out of. Thieves might still be reading them,
+    // so they are never freed.
+    struct deque_array      *prev;
+} deque_array_t;
+
+// Chase-Lev work-stealing deque of descriptors.
+// (Based on "Correct and Efficient Work-Stealing for Weak Memory
+// Models", Lê et al.)
+typedef struct deque
+{
+    // Thieves steal from here.
+    int64_t             top __attribute__((aligned(64)));
+
+    // Owner pushes and takes from here.
+    int64_t             bottom __attribute__((aligned(64)));
+
+    deque_array_t       *array;
+} deque_t;
+
+// A worker and its deque.
+typedef struct worker
+{
+    int                 id;
+    deque_t             deque;
+    pthread_t           tinfo;
+} worker_t;
+
+static int          epoll_fd = 0;
+
+// Kept open only to be given up when we run out of
+// descriptors. See turn_away_connection.
+static int          spare_fd = -1;
+
+// The reactor's deque. New ready connections go here.
+static deque_t      reactor_deque;
+
+static worker_t     *workers = NULL;
+static int          worker_count = 0;
+
+// Number of connections sitting in all the deques put together.
+// Idle workers sleep on it.
+static sem_t        work_available;
+
+deque_array_t* deque_array_new (int64_t size)
+{
+    deque_array_t   *a = calloc(1, sizeof(deque_array_t));
+
+    if (a == NULL)
+    {
+        return NULL;
+    }
+
+    a->buf = calloc(size, sizeof(int64_t));
+    if (a->buf == NULL)
+    {
+        free(a);
+        return NULL;
+    }
+    a->size = size;
+    return a;
+}
+
+int deque_init (deque_t *q)
+{
+    memset(q, '\0', sizeof(deque_t));
+    q->array = deque_array_new(DEQUE_INITIAL_SIZE);
+    return q->array == NULL ? -1 : 0;
+}
+
+// Owner only. Adds to the bottom.
+void deque_push (deque_t *q, int64_t x)
+{
+    int64_t         b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+    int64_t         t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    deque_array_t   *a = __atomic_load_n(&q->array, __ATOMIC_RELAXED);
+    deque_array_t   *bigger = NULL;
+    int64_t         i = 0;
+
+    if (b - t > a->size - 1)
+    {
+        // Full. Double it.
+        bigger = deque_array_new(a->size * 2);
+        if (bigger == NULL)
+        {
+            printf("calloc() failed. Exiting...\n");
+            exit(-1);
+        }
+        for (i = t; i < b; i++)
+        {
+            bigger->buf[i % bigger->size] = __atomic_load_n(&a->buf[i % a->size], __ATOMIC_RELAXED);
+        }
+        bigger->prev = a;
+        __atomic_store_n(&q->array, bigger, __ATOMIC_RELEASE);
+        a = bigger;
+    }
+
+    __atomic_store_n(&a->buf[b % a->size], x, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+}
+
+// Owner only. Takes from the bottom (most recently pushed).
+int64_t deque_take (deque_t *q)
+{
+    int64_t         b = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+    deque_array_t   *a = __atomic_load_n(&q->array, __ATOMIC_RELAXED);
+    int64_t         t = 0;
+    int64_t         x = DEQUE_EMPTY;
+
+    __atomic_store_n(&q->bottom, b, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    t = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+
+    if (t <= b)
+    {
+        x = __atomic_load_n(&a->buf[b % a->size], __ATOMIC_RELAXED);
+        if (t == b)
+        {
+            // Last one. A thief might be after it as well.
+            if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, false,
+                                             __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+            {
+                x = DEQUE_EMPTY;
+            }
+            __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+        }
+    }
+    else
+    {
+        // Empty.
+        __atomic_store_n(&q->bottom, b + 1, __ATOMIC_RELAXED);
+    }
+
+    return x;
+}
+
+// Anybody. Takes from the top (least recently pushed).
+int64_t deque_steal (deque_t *q)
+{
+    int64_t         t = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    int64_t         b = 0;
+    int64_t         x = DEQUE_EMPTY;
+    deque_array_t   *a = NULL;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    b = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+
+    if (t < b)
+    {
+        a = __atomic_load_n(&q->array, __ATOMIC_ACQUIRE);
+        x = __atomic_load_n(&a->buf[t % a->size], __ATOMIC_RELAXED);
+        if (!__atomic_compare_exchange_n(&q->top, &t, t + 1, false,
+                                         __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            return DEQUE_ABORT;
+        }
+    }
+
+    return x;
+}
+
+// serve_connection can have different return values.
+// Based on it, we need to take action in the worker.
+enum
+{
+    SERVE_CONN_SUCCESS = 0,
+    SERVE_CONN_FAILED,
+    SERVE_CONN_CLIENT_DISCONN,
+
+    // Used up its budget. There might be more to read.
+    SERVE_CONN_YIELD,
+};
+
+// Same echo logic as echo_server_v4.c, with a budget.
+int serve_connection (int client_fd)
+{
+    uint8_t         request_buffer[10000];
+    int             ret = 0;
+    int             req_len = 0;
+    int             rounds = 0;
+
+    for (rounds = 0; rounds < SERVE_BUDGET; rounds++)
+    {
+        ret = recv(client_fd, request_buffer, sizeof(request_buffer), MSG_DONTWAIT);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return SERVE_CONN_SUCCESS;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+
+            printf("recv() failed for fd = %d\n", client_fd);
+            return SERVE_CONN_FAILED;
+        }
+        else if (ret == 0)
+        {
+            // This is the case when the other side of the
+            // connection has disconnected.
+            return SERVE_CONN_CLIENT_DISCONN;
+        }
+
+        req_len = ret;
+
+        // You send back the same data
+        ret = send(client_fd, request_buffer, req_len, 0);
+        if (ret < req_len)
+        {
+            printf("send() failed for fd = %d\n", client_fd);
+            return SERVE_CONN_FAILED;
+        }
+    }
+
+    return SERVE_CONN_YIELD;
+}
+
+// Asks epoll to report the descriptor once more.
+// EPOLLONESHOT: A descriptor is reported once and then disabled till
+// we re-arm it. That way only one worker works on a connection at a time.
+void rearm_connection (int client_fd)
+{
+    struct epoll_event  event = {0};
+
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = client_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_fd, &event) < 0)
+    {
+        printf("epoll_ctl() failed for fd = %d\n", client_fd);
+        close(client_fd);
+    }
+}
+
+// Finds a connection to work on. The caller holds a token
+// from work_available, so there is at least one somewhere.
+int64_t find_work (worker_t *self)
+{
+    int64_t     fd = DEQUE_EMPTY;
+    int         i = 0;
+
+    while (1)
+    {
+        // Newly ready connections first, so that connections
+        // yielded by the workers don't keep them waiting.
+        fd = deque_steal(&reactor_deque);
+        if (fd >= 0)
+        {
+            return fd;
+        }
+
+        fd = deque_take(&self->deque);
+        if (fd >= 0)
+        {
+            return fd;
+        }
+
+        // Steal from the others, starting with the next one.
+        for (i = 1; i < worker_count; i++)
+        {
+            fd = deque_steal(&workers[(self->id + i) % worker_count].deque);
+            if (fd >= 0)
+            {
+                return fd;
+            }
+        }
+
+        // Somebody is halfway through a push, or we lost a race.
+        sched_yield();
+    }
+}
+
+void* worker_run (void *arg)
+{
+    worker_t    *self = arg;
+    int64_t     client_fd = 0;
+    int         ret = 0;
+
+    while (1)
+    {
+        // Sleep till there is something in the deques.
+        while (sem_wait(&work_available) < 0 && errno == EINTR)
+        {
+        }
+
+        client_fd = find_work(self);
+
+        ret = serve_connection(client_fd);
+        if (ret == SERVE_CONN_SUCCESS)
+        {
+            // All caught up. Let epoll watch it again.
+            rearm_connection(client_fd);
+        }
+        else if (ret == SERVE_CONN_YIELD)
+        {
+            // Still has data. Put it on our deque so that we, or
+            // an idle worker, get to it after others had their turn.
+            deque_push(&self->deque, client_fd);
+            sem_post(&work_available);
+        }
+        else
+        {
+            // Closing the descriptor removes it from epoll as well.
+            close(client_fd);
+        }
+    }
+
+    return NULL;
+}
+
+// Out of descriptors (EMFILE/ENFILE). The listener is level-triggered,
+// so with clients still in the backlog epoll_wait hands it straight
+// back to us, and the reactor spins. Turn the oldest client away: give
+// up the spare descriptor, accept with it, close right away and take
+// the spare back.
+// Returns 0 if one was turned away, -1 if the backlog is empty
+// (or there is no spare).
+int turn_away_connection (int sock_fd)
+{
+    int     fd = -1;
+
+    if (spare_fd < 0)
+    {
+        return -1;
+    }
+
+    close(spare_fd);
+    while (1)
+    {
+        fd = accept(sock_fd, NULL, NULL);
+        if (fd >= 0 || (errno != EINTR && errno != ECONNABORTED))
+        {
+            break;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return (fd >= 0) ? 0 : -1;
+}
+
+// Accepts all outstanding connection requests.
+void accept_connections (int sock_fd)
+{
+    int                 ret = 0;
+    int                 client_fd = 0;
+    struct epoll_event  event = {0};
+    int                 err = 0;
+    int                 turned_away = 0;
+
+    while (1)
+    {
+        ret = accept(sock_fd, NULL, NULL);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            else if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            // Out of descriptors. Empty the backlog, or we are
+            // back here right away.
+            err = errno;
+            if (err == EMFILE || err == ENFILE)
+            {
+                while (turn_away_connection(sock_fd) == 0)
+                {
+                    turned_away += 1;
+                }
+            }
+            printf("accept() failed, errno = %d. Turned away %d waiting connections\n", err, turned_away);
+            return;
+        }
+        client_fd = ret;
+
+        memset(&event, '\0', sizeof(event));
+        event.events = EPOLLIN | EPOLLONESHOT;
+        event.data.fd = client_fd;
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+        if (ret < 0)
+        {
+            printf("epoll_ctl() failed for fd = %d\n", client_fd);
+            close(client_fd);
+        }
+    }
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 3 && !(argc == 5 && strcmp(argv[3], "--threads") == 0))
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number] [--threads N]\n", argv[0]);
+        printf("N is the number of workers. Defaults to the number of online CPUs\n");
+        return 0;
+    }
+
+    int                 sock_fd = 0;
+    int                 client_fd = 0;
+    int                 ret = 0;
+    int                 i = 0;
+    struct sockaddr_in  server_addr = {0};
+    const char          *ip_addr = argv[1];
+    uint16_t            port_no = atoi(argv[2]);
+    struct epoll_event  event = {0};
+    struct epoll_event  events[MAX_EVENTS];
+    int                 ready_fd_count = 0;
+
+    worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (argc == 5)
+    {
+        worker_count = atoi(argv[4]);
+    }
+    if (worker_count <= 0)
+    {
+        worker_count = 1;
+    }
+
+    // Lets create a socket.
+    ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    sock_fd = ret;
+
+    // Bind the socket to the passed (ip_address, port_no).
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    ret = bind(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("bind() failed\n");
+        return -1;
+    }
+
+    // Start listening
+    ret = listen(sock_fd, 50);
+    if (ret < 0)
+    {
+        printf("listen() failed\n");
+        return -1;
+    }
+
+    // One descriptor in reserve, for when we run out.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    printf("Listening at (%s, %u) with %d workers\n", ip_addr, port_no, worker_count);
+
+    ret = epoll_create1(EPOLL_CLOEXEC);
+    if (ret < 0)
+    {
+        printf("epoll_create1() failed\n");
+        return -1;
+    }
+    epoll_fd = ret;
+
+    event.events = EPOLLIN;
+    event.data.fd = sock_fd;
+    ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event);
+    if (ret < 0)
+    {
+        printf("epoll_ctl() failed for server descriptor\n");
+        return -1;
+    }
+
+    // Setup the deques and start the workers.
+    sem_init(&work_available, 0, 0);
+    if (deque_init(&reactor_deque) < 0)
+    {
+        printf("deque_init() failed\n");
+        return -1;
+    }
+
+    workers = calloc(worker_count, sizeof(worker_t));
+    if (workers == NULL)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+
+    for (i = 0; i < worker_count; i++)
+    {
+        workers[i].id = i;
+        if (deque_init(&workers[i].deque) < 0)
+        {
+            printf("deque_init() failed\n");
+            return -1;
+        }
+    }
+
+    for (i = 0; i < worker_count; i++)
+    {
+        ret = pthread_create(&workers[i].tinfo, NULL, worker_run, &workers[i]);
+        if (ret != 0)
+        {
+            printf("pthread_create() failed\n");
+            return -1;
+        }
+    }
+
+    // The reactor.
+    while (1)
+    {
+        ret = epoll_wait(epoll_fd, events, MAX_EVENTS, -1 /* Infinite timeout */);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("epoll_wait() failed\n");
+            return -1;
+        }
+        ready_fd_count = ret;
+
+        for (i = 0; i < ready_fd_count; i++)
+        {
+            if (events[i].data.fd == sock_fd)
+            {
+                if (events[i].events & EPOLLERR)
+                {
+                    printf("epoll_wait() error(EPOLLERR) on server descriptor. Exiting...\n");
+                    exit(-1);
+                }
+
+                accept_connections(sock_fd);
+                continue;
+            }
+
+            client_fd = events[i].data.fd;
+
+            // Hand it over to the workers. Errors and hang ups are
+            // also handed over, recv() tells the worker what happened.
+            deque_push(&reactor_deque, client_fd);
+            sem_post(&work_available);
+        }
+    }
+}
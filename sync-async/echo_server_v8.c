@@ -0,0 +1,582 @@
+/*
+ * echo_server_v8.c
+ *
+ * echo_server_v4.c with a zero-copy echo path.
+ * - serve_connection in the other echo servers copies the data from
+ *   the kernel into request_buffer (recv) and then back into the
+ *   kernel (send). That is two copies of every byte.
+ * - Here the data goes socket -> pipe -> socket using splice().
+ *   A pipe is just a bunch of references to kernel pages. splice()
+ *   moves those references around, so the payload never comes
+ *   to user space.
+ * - Every connection gets its own pipe the first time it has data.
+ *   That is 2 more descriptors per connection.
+ * - If splice() doesn't work for a connection (no descriptors left
+ *   for a pipe, or the kernel doesn't support it), that connection
+ *   falls back to the recv/send path of echo_server_v4.c.
+ *
+ * An optional third argument picks the path for all connections,
+ * so that both can be compared: splice (default) or buffered.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+// Maximum number of ready descriptors epoll_wait
+// can hand back in one go.
+#define MAX_EVENTS  1024
+
+// We ask for pipes this big. The kernel may give us less
+// (see /proc/sys/fs/pipe-max-size), the default is 64 KiB.
+#define PIPE_SIZE   (1024 * 1024)
+
+// Per-connection state. Indexed by descriptor.
+typedef struct conn
+{
+    // The pipe the data goes through.
+    // -1 till the connection has some data.
+    int             pipe_rd;
+    int             pipe_wr;
+
+    // Size of the pipe and number of bytes sitting in it.
+    size_t          pipe_size;
+    size_t          in_pipe;
+
+    // This connection uses recv/send.
+    bool            buffered;
+
+    // What epoll is watching right now.
+    uint32_t        events;
+} conn_t;
+
+// Connection table. Grows as bigger descriptors show up.
+static conn_t       *conns = NULL;
+static uint64_t     conns_capacity = 0;
+
+// Kept open only to be given up when we run out of
+// descriptors. See turn_away_connection.
+static int          spare_fd = -1;
+
+// Use splice() for new connections?
+static bool         use_splice = true;
+
+// serve_connection can have different return values.
+// Based on it, we need to take action in the main
+// function.
+enum
+{
+    SERVE_CONN_SUCCESS = 0,
+    SERVE_CONN_FAILED,
+    SERVE_CONN_CLIENT_DISCONN,
+
+    // splice() is not possible on this connection.
+    SERVE_CONN_NO_SPLICE,
+};
+
+// Makes sure the connection table can hold the passed descriptor.
+int conns_reserve (int fd)
+{
+    uint64_t    new_capacity = 0;
+    conn_t      *temp = NULL;
+
+    if ((uint64_t)fd < conns_capacity)
+    {
+        return 0;
+    }
+
+    new_capacity = conns_capacity ? conns_capacity : 1024;
+    while (new_capacity <= (uint64_t)fd)
+    {
+        new_capacity *= 2;
+    }
+
+    temp = realloc(conns, sizeof(conn_t) * new_capacity);
+    if (temp == NULL)
+    {
+        return -1;
+    }
+
+    conns = temp;
+    conns_capacity = new_capacity;
+    return 0;
+}
+
+// The recv/send path. Same as echo_server_v4.c.
+int serve_connection_buffered (int client_fd)
+{
+    uint8_t         request_buffer[10000];
+    int             ret = 0;
+    int             req_len = 0;
+
+    while (1)
+    {
+        ret = recv(client_fd, request_buffer, sizeof(request_buffer), MSG_DONTWAIT);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return SERVE_CONN_SUCCESS;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+
+            printf("recv() failed for fd = %d\n", client_fd);
+            return SERVE_CONN_FAILED;
+        }
+        else if (ret == 0)
+        {
+            return SERVE_CONN_CLIENT_DISCONN;
+        }
+
+        req_len = ret;
+
+        ret = send(client_fd, request_buffer, req_len, 0);
+        if (ret < req_len)
+        {
+            printf("send() failed for fd = %d\n", client_fd);
+            return SERVE_CONN_FAILED;
+        }
+    }
+}
+
+// Creates the connection's pipe.
+int conn_open_pipe (conn_t *conn)
+{
+    int     pipe_fds[2] = {-1, -1};
+    int     ret = 0;
+
+    ret = pipe2(pipe_fds, O_NONBLOCK | O_CLOEXEC);
+    if (ret < 0)
+    {
+        return -1;
+    }
+
+    conn->pipe_rd = pipe_fds[0];
+    conn->pipe_wr = pipe_fds[1];
+
+    // A bigger pipe means fewer splice() calls per payload.
+    ret = fcntl(conn->pipe_wr, F_SETPIPE_SZ, PIPE_SIZE);
+    if (ret < 0)
+    {
+        ret = fcntl(conn->pipe_wr, F_GETPIPE_SZ);
+    }
+    conn->pipe_size = ret > 0 ? ret : 65536;
+    conn->in_pipe = 0;
+    return 0;
+}
+
+// The splice() path.
+// The socket is non-blocking. Whatever can't be sent right away
+// stays in the pipe, and we get back to it on EPOLLOUT.
+int serve_connection_splice (int client_fd)
+{
+    conn_t      *conn = &conns[client_fd];
+    ssize_t     ret = 0;
+
+    if (conn->pipe_rd == -1)
+    {
+        if (conn_open_pipe(conn) < 0)
+        {
+            printf("pipe2() failed for fd = %d\n", client_fd);
+            return SERVE_CONN_NO_SPLICE;
+        }
+    }
+
+    while (1)
+    {
+        // Whatever is in the pipe goes out first.
+        while (conn->in_pipe > 0)
+        {
+            ret = splice(conn->pipe_rd, NULL, client_fd, NULL, conn->in_pipe,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (ret < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                {
+                    // Client isn't reading fast enough.
+                    // EPOLLOUT will bring us back.
+                    return SERVE_CONN_SUCCESS;
+                }
+                else if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                printf("splice() to fd = %d failed\n", client_fd);
+                return SERVE_CONN_FAILED;
+            }
+            conn->in_pipe -= ret;
+        }
+
+        // Pipe is empty. Move the next chunk in.
+        ret = splice(client_fd, NULL, conn->pipe_wr, NULL, conn->pipe_size,
+                     SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Nothing more to read.
+                return SERVE_CONN_SUCCESS;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+            else if (errno == EINVAL || errno == ENOSYS)
+            {
+                // Nothing was moved, so nothing is lost.
+                return SERVE_CONN_NO_SPLICE;
+            }
+
+            printf("splice() from fd = %d failed\n", client_fd);
+            return SERVE_CONN_FAILED;
+        }
+        else if (ret == 0)
+        {
+            // This is the case when the other side of the
+            // connection has disconnected.
+            return SERVE_CONN_CLIENT_DISCONN;
+        }
+
+        conn->in_pipe += ret;
+    }
+}
+
+// Switches a connection over to recv/send.
+// The buffered path expects a blocking descriptor and no EPOLLOUT.
+int conn_fall_back (int epoll_fd, int client_fd)
+{
+    conn_t              *conn = &conns[client_fd];
+    struct epoll_event  event = {0};
+    int                 flags = 0;
+
+    conn->buffered = true;
+
+    flags = fcntl(client_fd, F_GETFL);
+    if (flags < 0 || fcntl(client_fd, F_SETFL, flags & ~O_NONBLOCK) < 0)
+    {
+        return -1;
+    }
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = client_fd;
+    conn->events = event.events;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_fd, &event);
+}
+
+// Asks for EPOLLOUT only while something sits in the pipe, like
+// echo_server_v10.c does with its out_ring. Under EPOLLET every ACK
+// makes the socket writable again, and would wake us for nothing.
+int update_interest (int epoll_fd, int client_fd)
+{
+    conn_t              *conn = &conns[client_fd];
+    struct epoll_event  event = {0};
+
+    if (conn->buffered)
+    {
+        return 0;
+    }
+
+    event.events = EPOLLIN | EPOLLET;
+    if (conn->in_pipe > 0)
+    {
+        event.events |= EPOLLOUT;
+    }
+    if (event.events == conn->events)
+    {
+        return 0;
+    }
+
+    event.data.fd = client_fd;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_fd, &event) < 0)
+    {
+        printf("epoll_ctl() failed for fd = %d\n", client_fd);
+        return -1;
+    }
+    conn->events = event.events;
+    return 0;
+}
+
+int serve_connection (int epoll_fd, int client_fd)
+{
+    int     ret = 0;
+
+    if (conns[client_fd].buffered == false)
+    {
+        ret = serve_connection_splice(client_fd);
+        if (ret != SERVE_CONN_NO_SPLICE)
+        {
+            return ret;
+        }
+
+        if (conn_fall_back(epoll_fd, client_fd) < 0)
+        {
+            return SERVE_CONN_FAILED;
+        }
+    }
+
+    return serve_connection_buffered(client_fd);
+}
+
+void close_connection (int client_fd)
+{
+    conn_t      *conn = &conns[client_fd];
+
+    if (conn->pipe_rd != -1)
+    {
+        close(conn->pipe_rd);
+        close(conn->pipe_wr);
+        conn->pipe_rd = -1;
+        conn->pipe_wr = -1;
+    }
+
+    // Closing the descriptor removes it from epoll as well.
+    close(client_fd);
+}
+
+// Out of descriptors: turns the oldest client in the backlog away,
+// the way echo_server_v4.c does. Our edge-triggered listener won't
+// report it again, so otherwise it would just hang.
+// Returns 0 if one was turned away, -1 if the backlog is empty
+// (or there is no spare).
+int turn_away_connection (int sock_fd)
+{
+    int     fd = -1;
+
+    if (spare_fd < 0)
+    {
+        return -1;
+    }
+
+    close(spare_fd);
+    while (1)
+    {
+        fd = accept(sock_fd, NULL, NULL);
+        if (fd >= 0 || (errno != EINTR && errno != ECONNABORTED))
+        {
+            break;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    // With ENFILE somebody else might beat us to it. Then there
+    // is no spare next time, and we are back to hanging clients.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return (fd >= 0) ? 0 : -1;
+}
+
+// Accepts all outstanding connection requests and asks
+// epoll to monitor them.
+void accept_connections (int epoll_fd, int sock_fd)
+{
+    int                 ret = 0;
+    int                 client_fd = 0;
+    struct epoll_event  event = {0};
+    int                 err = 0;
+    int                 turned_away = 0;
+
+    while (1)
+    {
+        // splice() needs a non-blocking socket, otherwise the
+        // splice() out of the pipe could block.
+        ret = accept4(sock_fd, NULL, NULL, use_splice ? SOCK_NONBLOCK : 0);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            else if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            // Out of descriptors. Whoever waits in the backlog
+            // would hang. Turn them all away.
+            err = errno;
+            if (err == EMFILE || err == ENFILE)
+            {
+                while (turn_away_connection(sock_fd) == 0)
+                {
+                    turned_away += 1;
+                }
+            }
+            printf("accept() failed, errno = %d. Turned away %d waiting connections\n", err, turned_away);
+            return;
+        }
+        client_fd = ret;
+
+        if (conns_reserve(client_fd) < 0)
+        {
+            printf("realloc() failed for fd = %d\n", client_fd);
+            close(client_fd);
+            continue;
+        }
+        conns[client_fd].pipe_rd = -1;
+        conns[client_fd].pipe_wr = -1;
+        conns[client_fd].in_pipe = 0;
+        conns[client_fd].buffered = !use_splice;
+
+        // EPOLLOUT is added only while something is left in the
+        // pipe. See update_interest.
+        memset(&event, '\0', sizeof(event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = client_fd;
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+        if (ret < 0)
+        {
+            printf("epoll_ctl() failed for fd = %d\n", client_fd);
+            close(client_fd);
+            continue;
+        }
+        conns[client_fd].events = event.events;
+    }
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 3 && argc != 4)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number] [splice|buffered]\n", argv[0]);
+        return 0;
+    }
+
+    int                 sock_fd = 0;
+    int                 epoll_fd = 0;
+    int                 client_fd = 0;
+    int                 ret = 0;
+    int                 i = 0;
+    struct sockaddr_in  server_addr = {0};
+    const char          *ip_addr = argv[1];
+    uint16_t            port_no = atoi(argv[2]);
+    struct epoll_event  event = {0};
+    struct epoll_event  events[MAX_EVENTS];
+    int                 ready_fd_count = 0;
+
+    if (argc == 4)
+    {
+        if (strcmp(argv[3], "buffered") == 0)
+        {
+            use_splice = false;
+        }
+        else if (strcmp(argv[3], "splice") != 0)
+        {
+            printf("Unknown mode %s\n", argv[3]);
+            return -1;
+        }
+    }
+
+    // Lets create a socket.
+    ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    sock_fd = ret;
+
+    // Bind the socket to the passed (ip_address, port_no).
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    ret = bind(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("bind() failed\n");
+        return -1;
+    }
+
+    // Start listening
+    ret = listen(sock_fd, 50);
+    if (ret < 0)
+    {
+        printf("listen() failed\n");
+        return -1;
+    }
+
+    // One descriptor in reserve, for when we run out.
+    // Without it we still run, clients just hang then.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    printf("Listening at (%s, %u), %s path\n", ip_addr, port_no,
+           use_splice ? "splice" : "buffered");
+
+    ret = epoll_create1(EPOLL_CLOEXEC);
+    if (ret < 0)
+    {
+        printf("epoll_create1() failed\n");
+        return -1;
+    }
+    epoll_fd = ret;
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = sock_fd;
+    ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event);
+    if (ret < 0)
+    {
+        printf("epoll_ctl() failed for server descriptor\n");
+        return -1;
+    }
+
+    // Do the thing
+    while (1)
+    {
+        ret = epoll_wait(epoll_fd, events, MAX_EVENTS, -1 /* Infinite timeout */);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("epoll_wait() failed\n");
+            return -1;
+        }
+        ready_fd_count = ret;
+
+        for (i = 0; i < ready_fd_count; i++)
+        {
+            if (events[i].data.fd == sock_fd)
+            {
+                if (events[i].events & EPOLLERR)
+                {
+                    printf("epoll_wait() error(EPOLLERR) on server descriptor. Exiting...\n");
+                    exit(-1);
+                }
+
+                accept_connections(epoll_fd, sock_fd);
+                continue;
+            }
+
+            client_fd = events[i].data.fd;
+
+            if (events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                close_connection(client_fd);
+            }
+            else if (events[i].events & (EPOLLIN | EPOLLOUT))
+            {
+                ret = serve_connection(epoll_fd, client_fd);
+                if (ret != SERVE_CONN_SUCCESS || update_interest(epoll_fd, client_fd) < 0)
+                {
+                    close_connection(client_fd);
+                }
+            }
+        }
+    }
+}
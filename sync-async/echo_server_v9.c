@@ -0,0 +1,605 @@
+/*
+ * echo_server_v9.c
+ *
+ * echo_server_v4.c with an opt-in MSG_ZEROCOPY send path.
+ * - A normal send() copies the data from our buffer into the socket's
+ *   buffers. For large responses, most of the time goes into that copy.
+ * - With MSG_ZEROCOPY, the kernel pins our buffer and sends straight
+ *   out of it. The catch: We can't touch (or reuse) the buffer till
+ *   the kernel says it is done with it. That notification comes on
+ *   the socket's error queue, and epoll reports it as EPOLLERR.
+ * - Pinning pages and reading notifications has its own cost. For
+ *   small messages copying is cheaper. So only messages of at least
+ *   THRESHOLD bytes take the zerocopy path.
+ * - Over loopback the kernel always ends up copying. It tells us so in
+ *   the notification, and we stop using zerocopy on that connection.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
+
+// Maximum number of ready descriptors epoll_wait
+// can hand back in one go.
+#define MAX_EVENTS          1024
+
+// Zerocopy pays off only for big buffers.
+#define ZC_BUF_SIZE         (64 * 1024)
+
+// Maximum number of buffers a connection can have with the kernel.
+// Beyond that we copy, till some notifications come in.
+#define ZC_MAX_INFLIGHT     64
+
+// An I/O buffer. Either free, or with the kernel.
+typedef struct zc_buf
+{
+    struct zc_buf   *next;
+
+    // Zerocopy sends are numbered by the kernel, per socket,
+    // starting from 0. This is the number of the send which
+    // uses this buffer.
+    uint32_t        seq;
+
+    uint8_t         data[ZC_BUF_SIZE];
+} zc_buf_t;
+
+// Per-connection state. Indexed by descriptor.
+typedef struct conn
+{
+    // Buffers with the kernel, oldest first.
+    zc_buf_t        *inflight_head;
+    zc_buf_t        *inflight_tail;
+    uint32_t        inflight_count;
+
+    // Number the kernel gives to our next zerocopy send.
+    uint32_t        next_seq;
+
+    // Does this connection still use zerocopy?
+    bool            zc_enabled;
+
+    // Client is gone, waiting for the kernel to give back our buffers.
+    bool            closing;
+} conn_t;
+
+// Connection table. Grows as bigger descriptors show up.
+static conn_t       *conns = NULL;
+static uint64_t     conns_capacity = 0;
+
+// Kept open only to be given up when we run out of
+// descriptors. See turn_away_connection.
+static int          spare_fd = -1;
+
+// Free buffers.
+static zc_buf_t     *free_bufs = NULL;
+
+// Messages at least this big are sent with MSG_ZEROCOPY.
+// 0 means zerocopy is off.
+static size_t       zc_threshold = 0;
+
+// serve_connection can have different return values.
+// Based on it, we need to take action in the main
+// function.
+enum
+{
+    SERVE_CONN_SUCCESS = 0,
+    SERVE_CONN_FAILED,
+    SERVE_CONN_CLIENT_DISCONN,
+};
+
+zc_buf_t* buf_get ()
+{
+    zc_buf_t    *buf = free_bufs;
+
+    if (buf != NULL)
+    {
+        free_bufs = buf->next;
+        return buf;
+    }
+
+    buf = malloc(sizeof(zc_buf_t));
+    if (buf == NULL)
+    {
+        printf("malloc() failed. Exiting...\n");
+        exit(-1);
+    }
+    return buf;
+}
+
+void buf_put (zc_buf_t *buf)
+{
+    buf->next = free_bufs;
+    free_bufs = buf;
+}
+
+// Makes sure the connection table can hold the passed descriptor.
+int conns_reserve (int fd)
+{
+    uint64_t    new_capacity = 0;
+    conn_t      *temp = NULL;
+
+    if ((uint64_t)fd < conns_capacity)
+    {
+        return 0;
+    }
+
+    new_capacity = conns_capacity ? conns_capacity : 1024;
+    while (new_capacity <= (uint64_t)fd)
+    {
+        new_capacity *= 2;
+    }
+
+    temp = realloc(conns, sizeof(conn_t) * new_capacity);
+    if (temp == NULL)
+    {
+        return -1;
+    }
+
+    conns = temp;
+    conns_capacity = new_capacity;
+    return 0;
+}
+
+// Gives back every buffer of sends up to (and including) number hi.
+void release_inflight (conn_t *conn, uint32_t hi)
+{
+    zc_buf_t    *buf = NULL;
+
+    // Notifications come in order, so do the buffers.
+    // (int32_t) takes care of the counter wrapping around.
+    while (conn->inflight_head != NULL && (int32_t)(conn->inflight_head->seq - hi) <= 0)
+    {
+        buf = conn->inflight_head;
+        conn->inflight_head = buf->next;
+        conn->inflight_count -= 1;
+        buf_put(buf);
+    }
+
+    if (conn->inflight_head == NULL)
+    {
+        conn->inflight_tail = NULL;
+    }
+}
+
+// Reads zerocopy notifications off the error queue.
+// Returns -1 if the socket has a real error.
+int drain_completions (int client_fd)
+{
+    conn_t                      *conn = &conns[client_fd];
+    struct msghdr               msg = {0};
+    struct cmsghdr              *cmsg = NULL;
+    struct sock_extended_err    *serr = NULL;
+    uint8_t                     control[128];
+    int                         ret = 0;
+
+    while (1)
+    {
+        memset(&msg, '\0', sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        ret = recvmsg(client_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return 0;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR))
+            {
+                continue;
+            }
+
+            serr = (struct sock_extended_err *)CMSG_DATA(cmsg);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+
+            // Sends ee_info to ee_data are done.
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                // The kernel had to copy anyway (loopback, or
+                // the device can't do scatter-gather). We only
+                // pay for the notifications. Stop.
+                conn->zc_enabled = false;
+            }
+            release_inflight(conn, serr->ee_data);
+        }
+    }
+}
+
+// Sends the whole buffer. Zerocopy if possible.
+// Returns the number of bytes sent, like send().
+int send_response (int client_fd, zc_buf_t *buf, int len)
+{
+    conn_t      *conn = &conns[client_fd];
+    int         ret = 0;
+
+    if (conn->zc_enabled && (size_t)len >= zc_threshold)
+    {
+        // Too many buffers with the kernel? See if it is done with any.
+        if (conn->inflight_count >= ZC_MAX_INFLIGHT)
+        {
+            drain_completions(client_fd);
+        }
+
+        if (conn->inflight_count < ZC_MAX_INFLIGHT)
+        {
+            ret = send(client_fd, buf->data, len, MSG_ZEROCOPY);
+            if (ret >= 0)
+            {
+                // The buffer belongs to the kernel till the notification.
+                buf->seq = conn->next_seq;
+                buf->next = NULL;
+                conn->next_seq += 1;
+                if (conn->inflight_tail == NULL)
+                {
+                    conn->inflight_head = buf;
+                }
+                else
+                {
+                    conn->inflight_tail->next = buf;
+                }
+                conn->inflight_tail = buf;
+                conn->inflight_count += 1;
+                return ret;
+            }
+            else if (errno != ENOBUFS)
+            {
+                buf_put(buf);
+                return ret;
+            }
+
+            // ENOBUFS: Not enough socket memory to track another
+            // zerocopy send. Nothing was sent, copy instead.
+        }
+    }
+
+    ret = send(client_fd, buf->data, len, 0);
+    buf_put(buf);
+    return ret;
+}
+
+int serve_connection (int client_fd)
+{
+    zc_buf_t        *buf = NULL;
+    int             ret = 0;
+    int             req_len = 0;
+
+    // Edge-triggered: Keep going till there is nothing to read.
+    while (1)
+    {
+        buf = buf_get();
+
+        ret = recv(client_fd, buf->data, ZC_BUF_SIZE, MSG_DONTWAIT);
+        if (ret < 0)
+        {
+            buf_put(buf);
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return SERVE_CONN_SUCCESS;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+
+            printf("recv() failed for fd = %d\n", client_fd);
+            return SERVE_CONN_FAILED;
+        }
+        else if (ret == 0)
+        {
+            // This is the case when the other side of the
+            // connection has disconnected.
+            buf_put(buf);
+            return SERVE_CONN_CLIENT_DISCONN;
+        }
+
+        req_len = ret;
+
+        // You send back the same data
+        ret = send_response(client_fd, buf, req_len);
+        if (ret < req_len)
+        {
+            printf("send() failed for fd = %d\n", client_fd);
+            return SERVE_CONN_FAILED;
+        }
+    }
+}
+
+// Closes the connection once the kernel has given back all our buffers.
+// Till then, the buffers could still be going out on the wire.
+void close_connection (int client_fd)
+{
+    conn_t      *conn = &conns[client_fd];
+
+    if (conn->closing == false)
+    {
+        conn->closing = true;
+
+        // No more data either way. Notifications keep coming.
+        shutdown(client_fd, SHUT_RD);
+    }
+
+    if (conn->inflight_count == 0)
+    {
+        // Closing the descriptor removes it from epoll as well.
+        close(client_fd);
+    }
+}
+
+// Out of descriptors: turns the oldest client in the backlog away,
+// the way echo_server_v4.c does. Our edge-triggered listener won't
+// report it again, so otherwise it would just hang.
+// Returns 0 if one was turned away, -1 if the backlog is empty
+// (or there is no spare).
+int turn_away_connection (int sock_fd)
+{
+    int     fd = -1;
+
+    if (spare_fd < 0)
+    {
+        return -1;
+    }
+
+    close(spare_fd);
+    while (1)
+    {
+        fd = accept(sock_fd, NULL, NULL);
+        if (fd >= 0 || (errno != EINTR && errno != ECONNABORTED))
+        {
+            break;
+        }
+    }
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+
+    // With ENFILE somebody else might beat us to it. Then there
+    // is no spare next time, and we are back to hanging clients.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    return (fd >= 0) ? 0 : -1;
+}
+
+// Accepts all outstanding connection requests and asks
+// epoll to monitor them.
+void accept_connections (int epoll_fd, int sock_fd)
+{
+    int                 ret = 0;
+    int                 client_fd = 0;
+    int                 one = 1;
+    struct epoll_event  event = {0};
+    int                 err = 0;
+    int                 turned_away = 0;
+
+    while (1)
+    {
+        ret = accept(sock_fd, NULL, NULL);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return;
+            }
+            else if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+
+            // Out of descriptors. Whoever waits in the backlog
+            // would hang. Turn them all away.
+            err = errno;
+            if (err == EMFILE || err == ENFILE)
+            {
+                while (turn_away_connection(sock_fd) == 0)
+                {
+                    turned_away += 1;
+                }
+            }
+            printf("accept() failed, errno = %d. Turned away %d waiting connections\n", err, turned_away);
+            return;
+        }
+        client_fd = ret;
+
+        if (conns_reserve(client_fd) < 0)
+        {
+            printf("realloc() failed for fd = %d\n", client_fd);
+            close(client_fd);
+            continue;
+        }
+        memset(&conns[client_fd], '\0', sizeof(conn_t));
+
+        // MSG_ZEROCOPY is ignored unless the socket opts in.
+        if (zc_threshold > 0)
+        {
+            ret = setsockopt(client_fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one));
+            conns[client_fd].zc_enabled = (ret == 0);
+        }
+
+        memset(&event, '\0', sizeof(event));
+        event.events = EPOLLIN | EPOLLET;
+        event.data.fd = client_fd;
+        ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &event);
+        if (ret < 0)
+        {
+            printf("epoll_ctl() failed for fd = %d\n", client_fd);
+            close(client_fd);
+        }
+    }
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 3 && !(argc == 5 && strcmp(argv[3], "--zerocopy") == 0))
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number] [--zerocopy THRESHOLD]\n", argv[0]);
+        printf("Responses of THRESHOLD bytes or more are sent with MSG_ZEROCOPY\n");
+        return 0;
+    }
+
+    int                 sock_fd = 0;
+    int                 epoll_fd = 0;
+    int                 client_fd = 0;
+    int                 ret = 0;
+    int                 i = 0;
+    struct sockaddr_in  server_addr = {0};
+    const char          *ip_addr = argv[1];
+    uint16_t            port_no = atoi(argv[2]);
+    struct epoll_event  event = {0};
+    struct epoll_event  events[MAX_EVENTS];
+    int                 ready_fd_count = 0;
+
+    if (argc == 5)
+    {
+        zc_threshold = strtoul(argv[4], NULL, 10);
+        if (zc_threshold == 0)
+        {
+            printf("THRESHOLD should be positive\n");
+            return -1;
+        }
+
+        // One recv fills at most one buffer. A bigger threshold
+        // would quietly never send anything with zerocopy.
+        if (zc_threshold > ZC_BUF_SIZE)
+        {
+            printf("THRESHOLD can be at most %d, the size of a buffer\n", ZC_BUF_SIZE);
+            return -1;
+        }
+    }
+
+    // Lets create a socket.
+    ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    sock_fd = ret;
+
+    // Bind the socket to the passed (ip_address, port_no).
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    ret = bind(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("bind() failed\n");
+        return -1;
+    }
+
+    // Start listening
+    ret = listen(sock_fd, 50);
+    if (ret < 0)
+    {
+        printf("listen() failed\n");
+        return -1;
+    }
+
+    // One descriptor in reserve, for when we run out.
+    // Without it we still run, clients just hang then.
+    spare_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    printf("Listening at (%s, %u)\n", ip_addr, port_no);
+
+    ret = epoll_create1(EPOLL_CLOEXEC);
+    if (ret < 0)
+    {
+        printf("epoll_create1() failed\n");
+        return -1;
+    }
+    epoll_fd = ret;
+
+    event.events = EPOLLIN | EPOLLET;
+    event.data.fd = sock_fd;
+    ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock_fd, &event);
+    if (ret < 0)
+    {
+        printf("epoll_ctl() failed for server descriptor\n");
+        return -1;
+    }
+
+    // Do the thing
+    while (1)
+    {
+        ret = epoll_wait(epoll_fd, events, MAX_EVENTS, -1 /* Infinite timeout */);
+        if (ret < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("epoll_wait() failed\n");
+            return -1;
+        }
+        ready_fd_count = ret;
+
+        for (i = 0; i < ready_fd_count; i++)
+        {
+            if (events[i].data.fd == sock_fd)
+            {
+                if (events[i].events & EPOLLERR)
+                {
+                    printf("epoll_wait() error(EPOLLERR) on server descriptor. Exiting...\n");
+                    exit(-1);
+                }
+
+                accept_connections(epoll_fd, sock_fd);
+                continue;
+            }
+
+            client_fd = events[i].data.fd;
+
+            // EPOLLERR is how zerocopy notifications show up.
+            // Only a socket without zerocopy sends has a real error.
+            if (events[i].events & EPOLLERR)
+            {
+                if (conns[client_fd].inflight_count == 0 || drain_completions(client_fd) < 0)
+                {
+                    // The connection is dead. No more notifications
+                    // are coming, so take the buffers back.
+                    release_inflight(&conns[client_fd], conns[client_fd].next_seq - 1);
+                    close_connection(client_fd);
+                    continue;
+                }
+            }
+
+            if (conns[client_fd].closing)
+            {
+                close_connection(client_fd);
+            }
+            else if (events[i].events & EPOLLHUP)
+            {
+                close_connection(client_fd);
+            }
+            else if (events[i].events & EPOLLIN)
+            {
+                ret = serve_connection(client_fd);
+                if (ret != SERVE_CONN_SUCCESS)
+                {
+                    close_connection(client_fd);
+                }
+            }
+        }
+    }
+}
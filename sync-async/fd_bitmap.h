@@ -0,0 +1,161 @@
+/*
+ * fd_bitmap.h
+ *
+ * A set of descriptors, one bit per descriptor, that grows as
+ * bigger descriptors show up.
+ * - fd_set is a bitmap of FD_SETSIZE (1024) bits. select() servers
+ *   built on it have to close any descriptor >= 1024, and they keep
+ *   a bool per descriptor next to it which they rescan - all 1024
+ *   slots - on every iteration.
+ * - Here the bitmap is an array of 64-bit words, doubled on demand.
+ *   Walking it goes a word at a time: a zero word skips 64
+ *   descriptors in one comparison, and inside a word count-trailing-
+ *   zeros jumps straight to the next set bit. Only descriptors which
+ *   are in the set are ever looked at.
+ * - On Linux, an fd_set is exactly this layout (bit fd % 64 of word
+ *   fd / 64), and select() takes any nfds up to the descriptor limit,
+ *   not just FD_SETSIZE. So the words can be handed to select() as
+ *   an fd_set - see fd_bitmap_fd_set.
+ *
+ * Header only. Just #include it.
+ */
+#ifndef __FD_BITMAP_H__
+#define __FD_BITMAP_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <sys/select.h>
+
+#define FD_BITMAP_BITS          64
+
+// Start with these many descriptors. Same as FD_SETSIZE.
+#define FD_BITMAP_MIN_FDS       1024
+
+typedef struct fd_bitmap
+{
+    uint64_t        *words;
+    uint64_t        word_count;
+} fd_bitmap_t;
+
+static inline int fd_bitmap_init (fd_bitmap_t *bm)
+{
+    bm->word_count = FD_BITMAP_MIN_FDS / FD_BITMAP_BITS;
+    bm->words = calloc(bm->word_count, sizeof(uint64_t));
+    return (bm->words == NULL) ? -1 : 0;
+}
+
+// Makes sure the bitmap can hold fd.
+static inline int fd_bitmap_reserve (fd_bitmap_t *bm, int fd)
+{
+    uint64_t    new_count = bm->word_count;
+    uint64_t    *temp = NULL;
+
+    if ((uint64_t)fd < bm->word_count * FD_BITMAP_BITS)
+    {
+        return 0;
+    }
+
+    while ((uint64_t)fd >= new_count * FD_BITMAP_BITS)
+    {
+        new_count *= 2;
+    }
+
+    temp = realloc(bm->words, new_count * sizeof(uint64_t));
+    if (temp == NULL)
+    {
+        return -1;
+    }
+    memset(temp + bm->word_count, '\0', (new_count - bm->word_count) * sizeof(uint64_t));
+
+    bm->words = temp;
+    bm->word_count = new_count;
+    return 0;
+}
+
+// fd has to fit. See fd_bitmap_reserve.
+static inline void fd_bitmap_set (fd_bitmap_t *bm, int fd)
+{
+    bm->words[fd / FD_BITMAP_BITS] |= 1ULL << (fd % FD_BITMAP_BITS);
+}
+
+static inline void fd_bitmap_clear (fd_bitmap_t *bm, int fd)
+{
+    if ((uint64_t)fd < bm->word_count * FD_BITMAP_BITS)
+    {
+        bm->words[fd / FD_BITMAP_BITS] &= ~(1ULL << (fd % FD_BITMAP_BITS));
+    }
+}
+
+static inline bool fd_bitmap_test (fd_bitmap_t *bm, int fd)
+{
+    if ((uint64_t)fd >= bm->word_count * FD_BITMAP_BITS)
+    {
+        return false;
+    }
+    return (bm->words[fd / FD_BITMAP_BITS] >> (fd % FD_BITMAP_BITS)) & 1;
+}
+
+// dst = src. dst grows if it has to.
+static inline int fd_bitmap_copy (fd_bitmap_t *dst, fd_bitmap_t *src)
+{
+    if (fd_bitmap_reserve(dst, src->word_count * FD_BITMAP_BITS - 1) < 0)
+    {
+        return -1;
+    }
+    memcpy(dst->words, src->words, src->word_count * sizeof(uint64_t));
+    return 0;
+}
+
+// Smallest descriptor in the set which is >= from. -1 if none.
+// Walk the set with:
+//      for (fd = fd_bitmap_next(bm, 0); fd >= 0; fd = fd_bitmap_next(bm, fd + 1))
+static inline int fd_bitmap_next (fd_bitmap_t *bm, int from)
+{
+    uint64_t    index = from / FD_BITMAP_BITS;
+    uint64_t    word = 0;
+
+    if (index >= bm->word_count)
+    {
+        return -1;
+    }
+
+    // Bits below from don't count.
+    word = bm->words[index] & (~0ULL << (from % FD_BITMAP_BITS));
+    while (word == 0)
+    {
+        index += 1;
+        if (index == bm->word_count)
+        {
+            return -1;
+        }
+        word = bm->words[index];
+    }
+    return index * FD_BITMAP_BITS + __builtin_ctzll(word);
+}
+
+// Highest descriptor in the set + 1. What select() wants as nfds.
+static inline int fd_bitmap_nfds (fd_bitmap_t *bm)
+{
+    uint64_t    index = bm->word_count;
+
+    while (index > 0)
+    {
+        index -= 1;
+        if (bm->words[index] != 0)
+        {
+            return index * FD_BITMAP_BITS + (FD_BITMAP_BITS - __builtin_clzll(bm->words[index]));
+        }
+    }
+    return 0;
+}
+
+// The bitmap as select() sees it.
+static inline fd_set* fd_bitmap_fd_set (fd_bitmap_t *bm)
+{
+    return (fd_set *)bm->words;
+}
+
+#endif /* __FD_BITMAP_H__ */
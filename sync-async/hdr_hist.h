@@ -0,0 +1,188 @@
+/*
+ * hdr_hist.h
+ *
+ * HDR-style latency histogram.
+ * - Averages hide what users see. We want p50, p99, p99.9 and max,
+ *   and we want to record every single request to get them.
+ * - Values (nanoseconds) go into log-linear buckets: every power of 2
+ *   is split into 64 equal sub-buckets. So any recorded value is off
+ *   by at most 1/64 (~1.6%) - from 100ns to a few minutes.
+ * - Recording is an index calculation and an increment.
+ *   No allocation, no locks, no floating point.
+ * - Percentiles report the highest value of the bucket they fall in,
+ *   like HdrHistogram does. We never report better than reality.
+ * - One thread records into a histogram, any thread can read it.
+ *   Give every thread its own histogram and hist_merge them when
+ *   you want numbers. The writer uses plain (relaxed) atomic
+ *   stores, not read-modify-write, so recording costs the same as
+ *   it would without threads. A merge which runs while the owner
+ *   records may miss the last few values - never more.
+ *
+ * Header only. Just #include it.
+ */
+#ifndef __HDR_HIST_H__
+#define __HDR_HIST_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+// Values below this are recorded exactly, one bucket per value.
+#define HIST_LINEAR_COUNT   128
+
+// Every power of 2 above that gets these many sub-buckets.
+#define HIST_SUB_COUNT      64
+
+// Anything at or above 2^HIST_MAX_BITS ns (~18 minutes) is
+// recorded as the largest value we can hold.
+#define HIST_MAX_BITS       40
+
+#define HIST_BUCKETS        (HIST_LINEAR_COUNT + (HIST_MAX_BITS - 7) * HIST_SUB_COUNT)
+
+typedef struct hist
+{
+    uint64_t        counts[HIST_BUCKETS];
+
+    uint64_t        total;
+    uint64_t        min;
+    uint64_t        max;
+    uint64_t        sum;
+} hist_t;
+
+static inline void hist_init (hist_t *hist)
+{
+    memset(hist, '\0', sizeof(hist_t));
+    hist->min = UINT64_MAX;
+}
+
+// Which bucket does the value go to?
+static inline uint32_t hist_index (uint64_t value)
+{
+    uint32_t    msb = 0;
+    uint32_t    shift = 0;
+
+    if (value < HIST_LINEAR_COUNT)
+    {
+        return value;
+    }
+    if (value >= (1ULL << HIST_MAX_BITS))
+    {
+        return HIST_BUCKETS - 1;
+    }
+
+    // value >> shift lands in [64, 128).
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - 6;
+    return HIST_LINEAR_COUNT + (shift - 1) * HIST_SUB_COUNT + ((value >> shift) - HIST_SUB_COUNT);
+}
+
+// The highest value which goes to the bucket.
+static inline uint64_t hist_value (uint32_t index)
+{
+    uint32_t    shift = 0;
+    uint64_t    sub = 0;
+
+    if (index < HIST_LINEAR_COUNT)
+    {
+        return index;
+    }
+
+    shift = (index - HIST_LINEAR_COUNT) / HIST_SUB_COUNT + 1;
+    sub = (index - HIST_LINEAR_COUNT) % HIST_SUB_COUNT + HIST_SUB_COUNT;
+    return ((sub + 1) << shift) - 1;
+}
+
+// Only the owner of the histogram calls this.
+// Stores are atomic so that a reader never sees a torn value.
+#define HIST_STORE(field, value)    __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define HIST_LOAD(field)            __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+static inline void hist_record (hist_t *hist, uint64_t value)
+{
+    uint32_t    index = hist_index(value);
+
+    HIST_STORE(hist->counts[index], hist->counts[index] + 1);
+    HIST_STORE(hist->total, hist->total + 1);
+    HIST_STORE(hist->sum, hist->sum + value);
+    if (value < hist->min)
+    {
+        HIST_STORE(hist->min, value);
+    }
+    if (value > hist->max)
+    {
+        HIST_STORE(hist->max, value);
+    }
+}
+
+// dst += src
+// src may be recorded into while we read it. dst is ours.
+static inline void hist_merge (hist_t *dst, const hist_t *src)
+{
+    uint32_t    i = 0;
+    uint64_t    count = 0;
+    uint64_t    min = HIST_LOAD(src->min);
+    uint64_t    max = HIST_LOAD(src->max);
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        count = HIST_LOAD(src->counts[i]);
+        dst->counts[i] += count;
+
+        // Add up the buckets instead of reading src->total.
+        // Keeps total and buckets in sync for hist_percentile.
+        dst->total += count;
+    }
+    dst->sum += HIST_LOAD(src->sum);
+    if (min < dst->min)
+    {
+        dst->min = min;
+    }
+    if (max > dst->max)
+    {
+        dst->max = max;
+    }
+}
+
+// percentile is in [0, 100].
+static inline uint64_t hist_percentile (const hist_t *hist, double percentile)
+{
+    uint64_t    rank = 0;
+    uint64_t    seen = 0;
+    uint32_t    i = 0;
+
+    if (hist->total == 0)
+    {
+        return 0;
+    }
+
+    // Rank of the value we are after, 1-based.
+    rank = (uint64_t)(percentile / 100.0 * hist->total + 0.5);
+    if (rank < 1)
+    {
+        rank = 1;
+    }
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += hist->counts[i];
+        if (seen >= rank)
+        {
+            // Never more than what was really recorded.
+            return (hist_value(i) < hist->max) ? hist_value(i) : hist->max;
+        }
+    }
+    return hist->max;
+}
+
+// One line, values in microseconds.
+static inline void hist_print (FILE *fp, const char *name, const hist_t *hist)
+{
+    fprintf(fp, "%s: count %lu, p50 %.1fus, p99 %.1fus, p99.9 %.1fus, max %.1fus\n",
+            name, hist->total,
+            hist_percentile(hist, 50.0) / 1000.0,
+            hist_percentile(hist, 99.0) / 1000.0,
+            hist_percentile(hist, 99.9) / 1000.0,
+            hist->max / 1000.0);
+}
+
+#endif /* __HDR_HIST_H__ */
@@ -0,0 +1,681 @@
+/*
+ * load_gen.c
+ *
+ * Load generator and latency benchmark for the servers in this directory.
+ *
+ * - Opens N connections, spread over a few threads. Each thread runs
+ *   its connections off one epoll instance.
+ * - Echo mode (default): a request is --size bytes on a long-lived
+ *   connection. The response has to be the same bytes. Every byte
+ *   is checked.
+ * - Hello mode (--hello): a request is connect, "Hello from client!",
+ *   wait for "Hello from server!", close. That is what server_v1.c
+ *   to server_v6.c serve.
+ * - Framed mode (--framed): every message gets a 4 byte length in
+ *   front, like echo_server_v10.c expects.
+ * - Pipelining (--pipeline N): N messages go out back to back, without
+ *   waiting for responses. Each one's latency is recorded when its
+ *   own response is in.
+ * - Every request's latency goes into an HDR histogram (hdr_hist.h).
+ *   p50/p99/p99.9/max are printed at the end.
+ *
+ * Closed loop vs open loop
+ *
+ * - Closed loop (default): a connection sends its next request as
+ *   soon as the previous response comes in. If the server stalls
+ *   for a second, we simply send less - and the stall shows up as
+ *   one slow request instead of a whole second worth of them.
+ *   This is the "coordinated omission" problem.
+ * - Open loop (--rate R): requests are due at a fixed rate,
+ *   R/sec over all connections, whether or not the server keeps up.
+ *   Latency is measured from when a request was due, not from when
+ *   we managed to send it. So time spent waiting behind a slow
+ *   response is counted.
+ * - A connection has at most one request (N pipelined messages)
+ *   in flight in both modes.
+ * - Requests still in flight when time is up are recorded with
+ *   the time they have waited so far. A server which never answers
+ *   doesn't get to look good.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include "hdr_hist.h"
+
+#define MAX_EVENTS          256
+
+// Bytes generated/checked in one go.
+#define CHUNK_SIZE          65536
+
+// What server_v1.c to server_v6.c send back.
+#define HELLO_REQUEST       "Hello from client!"
+#define HELLO_REQUEST_LEN   19
+#define HELLO_RESPONSE_LEN  19
+
+enum
+{
+    CONN_IDLE = 0,
+    CONN_CONNECTING,
+    CONN_BUSY,
+};
+
+typedef struct conn
+{
+    int             fd;
+    int             state;
+
+    // Unique across threads. Goes into the payload.
+    uint32_t        id;
+
+    // Number of requests started on this connection.
+    uint64_t        seq;
+
+    // Pipelined messages of the current request that are answered.
+    uint32_t        messages_done;
+
+    // When the current request should have gone out.
+    uint64_t        intended_ns;
+
+    // Open loop: when the next request is due.
+    uint64_t        next_ns;
+
+    // Progress of the current request.
+    uint32_t        sent;
+    uint32_t        received;
+} conn_t;
+
+// Per-thread state and results.
+typedef struct client
+{
+    pthread_t       tinfo;
+    int             epoll_fd;
+    conn_t          *conns;
+    int             conn_count;
+    uint8_t         *scratch;
+
+    hist_t          hist;
+    uint64_t        requests;
+    uint64_t        errors;
+    uint64_t        mismatches;
+    uint64_t        unfinished;
+} client_t;
+
+static struct sockaddr_in   server_addr;
+static volatile bool        stop = false;
+static bool                 hello_mode = false;
+static uint32_t             payload_size = 64;
+static bool                 framed = false;
+static uint32_t             pipeline = 1;
+
+// Open loop: time between two requests on one connection.
+// 0 means closed loop.
+static uint64_t             interval_ns = 0;
+
+uint64_t now_ns ()
+{
+    struct timespec ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Byte at offset off of the current request on the connection.
+// Differs between connections and requests, so that a response
+// sent to the wrong client or sent twice doesn't pass the check.
+static inline uint8_t payload_byte (conn_t *conn, uint32_t off)
+{
+    return (uint8_t)(conn->id * 131 + conn->seq * 31 + off);
+}
+
+// One message on the wire: payload, with a length in front if framed.
+static inline uint32_t message_len ()
+{
+    return framed ? 4 + payload_size : payload_size;
+}
+
+// Byte at offset off of the current request, length prefixes included.
+static inline uint8_t request_byte (conn_t *conn, uint32_t off)
+{
+    uint32_t    msg_off = off % message_len();
+
+    // Length prefix, network byte order.
+    if (framed && msg_off < 4)
+    {
+        return (uint8_t)(payload_size >> (8 * (3 - msg_off)));
+    }
+    return payload_byte(conn, off);
+}
+
+void conn_close (conn_t *conn)
+{
+    if (conn->fd >= 0)
+    {
+        // Closing the descriptor removes it from epoll as well.
+        close(conn->fd);
+        conn->fd = -1;
+    }
+}
+
+// Starts connecting. The connection is usable once epoll
+// says it is writable.
+int conn_open (client_t *client, conn_t *conn)
+{
+    int                 ret = 0;
+    int                 one = 1;
+    struct linger       lin = {1, 0};
+    struct epoll_event  event = {0};
+
+    ret = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (ret < 0)
+    {
+        return -1;
+    }
+    conn->fd = ret;
+
+    setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (hello_mode)
+    {
+        // One connection per request. Reset instead of a graceful
+        // close, so that we don't run out of ports due to TIME_WAIT.
+        setsockopt(conn->fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    }
+
+    ret = connect(conn->fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0 && errno != EINPROGRESS)
+    {
+        conn_close(conn);
+        return -1;
+    }
+
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.ptr = conn;
+    ret = epoll_ctl(client->epoll_fd, EPOLL_CTL_ADD, conn->fd, &event);
+    if (ret < 0)
+    {
+        conn_close(conn);
+        return -1;
+    }
+
+    conn->state = CONN_CONNECTING;
+    return 0;
+}
+
+// One message got its response. Record it.
+// All messages of a request were due at the same time.
+void message_done (client_t *client, conn_t *conn, uint64_t now)
+{
+    hist_record(&client->hist, now - conn->intended_ns);
+    client->requests += 1;
+    conn->messages_done += 1;
+}
+
+// Current request is done (or failed).
+// Its messages have been recorded one by one; a failure is
+// recorded here, once.
+void request_done (client_t *client, conn_t *conn, uint64_t now, bool ok)
+{
+    if (ok == false)
+    {
+        hist_record(&client->hist, now - conn->intended_ns);
+        client->errors += 1;
+    }
+
+    if (hello_mode || ok == false)
+    {
+        conn_close(conn);
+    }
+    conn->state = CONN_IDLE;
+}
+
+// Pushes the request out and reads the response, as far as the
+// socket lets us. Returns true once the request is done.
+bool conn_progress (client_t *client, conn_t *conn, uint64_t now)
+{
+    uint32_t    size = hello_mode ? HELLO_REQUEST_LEN : pipeline * message_len();
+    uint32_t    expected = hello_mode ? HELLO_RESPONSE_LEN : size;
+    uint32_t    len = 0;
+    uint32_t    i = 0;
+    int         ret = 0;
+    bool        progress = true;
+
+    // Keep reading while we send. A big echo comes back while we
+    // are still sending it. If we don't read it, the server stops
+    // reading us and both sides wait for each other.
+    while (progress)
+    {
+        progress = false;
+
+        if (conn->sent < size)
+        {
+            len = size - conn->sent;
+            if (len > CHUNK_SIZE)
+            {
+                len = CHUNK_SIZE;
+            }
+
+            if (hello_mode)
+            {
+                memcpy(client->scratch, HELLO_REQUEST + conn->sent, len);
+            }
+            else
+            {
+                for (i = 0; i < len; i++)
+                {
+                    client->scratch[i] = request_byte(conn, conn->sent + i);
+                }
+            }
+
+            ret = send(conn->fd, client->scratch, len, MSG_NOSIGNAL);
+            if (ret < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                {
+                    request_done(client, conn, now, false);
+                    return true;
+                }
+            }
+            else
+            {
+                conn->sent += ret;
+                progress = true;
+            }
+        }
+
+        // The hello servers read once - let them have the
+        // whole request before we wait for the response.
+        if (hello_mode && conn->sent < size)
+        {
+            continue;
+        }
+
+        if (conn->received < expected)
+        {
+            len = expected - conn->received;
+            if (len > CHUNK_SIZE)
+            {
+                len = CHUNK_SIZE;
+            }
+
+            ret = recv(conn->fd, client->scratch, len, 0);
+            if (ret < 0)
+            {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                {
+                    request_done(client, conn, now, false);
+                    return true;
+                }
+            }
+            else if (ret == 0)
+            {
+                // Server closed before the whole response came in.
+                request_done(client, conn, now, false);
+                return true;
+            }
+            else
+            {
+                // Is it what we sent?
+                if (hello_mode == false)
+                {
+                    for (i = 0; i < (uint32_t)ret; i++)
+                    {
+                        if (client->scratch[i] != request_byte(conn, conn->received + i))
+                        {
+                            client->mismatches += 1;
+                            request_done(client, conn, now, false);
+                            return true;
+                        }
+                    }
+                }
+                conn->received += ret;
+                progress = true;
+
+                // We may have been going round this loop for a while,
+                // sending the rest of a pipeline. Don't use a stale clock.
+                now = now_ns();
+
+                // Which messages are complete now?
+                while (hello_mode == false &&
+                       conn->received >= (conn->messages_done + 1) * message_len())
+                {
+                    message_done(client, conn, now);
+                }
+            }
+        }
+
+        if (conn->received == expected)
+        {
+            if (hello_mode)
+            {
+                message_done(client, conn, now);
+            }
+            request_done(client, conn, now, true);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Sends out the next request on the connection.
+void request_start (client_t *client, conn_t *conn, uint64_t now)
+{
+    // Open loop: the request was due at next_ns, maybe a while ago.
+    // Closed loop: it is due now.
+    if (interval_ns)
+    {
+        conn->intended_ns = conn->next_ns;
+        conn->next_ns += interval_ns;
+    }
+    else
+    {
+        conn->intended_ns = now;
+    }
+
+    conn->seq += 1;
+    conn->sent = 0;
+    conn->received = 0;
+    conn->messages_done = 0;
+
+    // Hello mode opens a new connection for every request.
+    // Echo mode only when the last one broke.
+    if (conn->fd < 0)
+    {
+        if (conn_open(client, conn) < 0)
+        {
+            request_done(client, conn, now, false);
+        }
+        return;
+    }
+
+    conn->state = CONN_BUSY;
+    conn_progress(client, conn, now);
+}
+
+// Starts whatever is due. Back to back if we are behind.
+void start_due_requests (client_t *client, conn_t *conn, uint64_t now)
+{
+    while (stop == false && conn->state == CONN_IDLE)
+    {
+        if (interval_ns && conn->next_ns > now)
+        {
+            break;
+        }
+        request_start(client, conn, now);
+    }
+}
+
+void* client_run (void *arg)
+{
+    client_t            *client = arg;
+    conn_t              *conn = NULL;
+    struct epoll_event  events[MAX_EVENTS];
+    int                 ready_count = 0;
+    int                 err = 0;
+    socklen_t           err_len = 0;
+    int                 i = 0;
+    uint64_t            now = 0;
+
+    now = now_ns();
+    for (i = 0; i < client->conn_count; i++)
+    {
+        start_due_requests(client, &client->conns[i], now);
+    }
+
+    while (stop == false)
+    {
+        // Open loop has requests coming due all the time.
+        // Wake up every millisecond to send them.
+        ready_count = epoll_wait(client->epoll_fd, events, MAX_EVENTS, interval_ns ? 1 : 100);
+        if (ready_count < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("epoll_wait() failed\n");
+            exit(-1);
+        }
+        now = now_ns();
+
+        for (i = 0; i < ready_count; i++)
+        {
+            conn = events[i].data.ptr;
+
+            if (conn->state == CONN_CONNECTING)
+            {
+                // Did connect() work out?
+                err = 0;
+                err_len = sizeof(err);
+                getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+                if (err != 0)
+                {
+                    // Closed, and idle again. Falls through to the
+                    // closed loop restart below, like a failed request.
+                    request_done(client, conn, now, false);
+                }
+                else if (events[i].events & EPOLLOUT)
+                {
+                    conn->state = CONN_BUSY;
+                }
+            }
+
+            if (conn->state == CONN_BUSY)
+            {
+                conn_progress(client, conn, now);
+            }
+
+            // Closed loop: next request goes out right away.
+            if (interval_ns == 0)
+            {
+                start_due_requests(client, conn, now);
+            }
+        }
+
+        if (interval_ns)
+        {
+            for (i = 0; i < client->conn_count; i++)
+            {
+                start_due_requests(client, &client->conns[i], now);
+            }
+        }
+    }
+
+    // Whatever is still in flight counts, with the time
+    // it has waited so far.
+    now = now_ns();
+    for (i = 0; i < client->conn_count; i++)
+    {
+        conn = &client->conns[i];
+        if (conn->state != CONN_IDLE)
+        {
+            hist_record(&client->hist, now - conn->intended_ns);
+            client->unfinished += 1;
+        }
+        conn_close(conn);
+    }
+
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 5)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number] [connections] [seconds] "
+               "[--threads N] [--size BYTES] [--rate REQUESTS_PER_SEC] [--hello] "
+               "[--framed] [--pipeline N]\n", argv[0]);
+        return 0;
+    }
+
+    int                 ret = 0;
+    int                 i = 0;
+    int                 conn_count = atoi(argv[3]);
+    int                 seconds = atoi(argv[4]);
+    int                 thread_count = 1;
+    uint64_t            rate = 0;
+    client_t            *clients = NULL;
+    conn_t              *conns = NULL;
+    hist_t              *hist = NULL;
+    uint64_t            requests = 0;
+    uint64_t            errors = 0;
+    uint64_t            mismatches = 0;
+    uint64_t            unfinished = 0;
+    uint64_t            start = 0;
+    uint64_t            end = 0;
+    double              elapsed = 0;
+
+    for (i = 5; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            thread_count = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            payload_size = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc)
+        {
+            rate = strtoull(argv[++i], NULL, 10);
+        }
+        else if (strcmp(argv[i], "--hello") == 0)
+        {
+            hello_mode = true;
+        }
+        else if (strcmp(argv[i], "--framed") == 0)
+        {
+            framed = true;
+        }
+        else if (strcmp(argv[i], "--pipeline") == 0 && i + 1 < argc)
+        {
+            pipeline = atoi(argv[++i]);
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (conn_count <= 0 || seconds <= 0 || thread_count <= 0 || payload_size == 0 || pipeline == 0)
+    {
+        printf("connections, seconds, threads, size and pipeline should be positive\n");
+        return -1;
+    }
+    if (thread_count > conn_count)
+    {
+        thread_count = conn_count;
+    }
+
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    clients = calloc(thread_count, sizeof(client_t));
+    conns = calloc(conn_count, sizeof(conn_t));
+    hist = malloc(sizeof(hist_t));
+    if (clients == NULL || conns == NULL || hist == NULL)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+    hist_init(hist);
+
+    // Open loop: each connection gets rate/conn_count messages per second,
+    // pipeline of them at a time.
+    // Their schedules are spread out, so that they don't all
+    // fire at the same instant.
+    start = now_ns();
+    if (rate)
+    {
+        interval_ns = 1000000000ULL * conn_count * pipeline / rate;
+        if (interval_ns == 0)
+        {
+            interval_ns = 1;
+        }
+    }
+    for (i = 0; i < conn_count; i++)
+    {
+        conns[i].fd = -1;
+        conns[i].id = i;
+        conns[i].next_ns = start + interval_ns * i / conn_count;
+    }
+
+    for (i = 0; i < thread_count; i++)
+    {
+        // Each thread gets a contiguous slice of the connections.
+        clients[i].conns = conns + (uint64_t)conn_count * i / thread_count;
+        clients[i].conn_count = (uint64_t)conn_count * (i + 1) / thread_count -
+                                (uint64_t)conn_count * i / thread_count;
+        hist_init(&clients[i].hist);
+
+        clients[i].scratch = malloc(CHUNK_SIZE);
+        ret = epoll_create1(EPOLL_CLOEXEC);
+        if (clients[i].scratch == NULL || ret < 0)
+        {
+            printf("epoll_create1() failed\n");
+            return -1;
+        }
+        clients[i].epoll_fd = ret;
+    }
+
+    for (i = 0; i < thread_count; i++)
+    {
+        ret = pthread_create(&clients[i].tinfo, NULL, client_run, &clients[i]);
+        if (ret != 0)
+        {
+            printf("pthread_create() failed\n");
+            return -1;
+        }
+    }
+
+    sleep(seconds);
+    stop = true;
+
+    for (i = 0; i < thread_count; i++)
+    {
+        pthread_join(clients[i].tinfo, NULL);
+        hist_merge(hist, &clients[i].hist);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+        mismatches += clients[i].mismatches;
+        unfinished += clients[i].unfinished;
+    }
+    end = now_ns();
+    elapsed = (end - start) / 1e9;
+
+    if (rate)
+    {
+        printf("Open loop, target %lu requests/sec\n", rate);
+    }
+    else
+    {
+        printf("Closed loop\n");
+    }
+    printf("%lu requests, %lu errors (%lu echo mismatches), %lu unfinished in %.2f s: %.0f requests/sec\n",
+           requests, errors, mismatches, unfinished, elapsed, requests / elapsed);
+    hist_print(stdout, "latency", hist);
+
+    // One line for scripts. See bench_all.sh
+    printf("RESULT %.0f %.1f %.1f %.1f %.1f %lu %lu\n",
+           requests / elapsed,
+           hist_percentile(hist, 50.0) / 1000.0,
+           hist_percentile(hist, 99.0) / 1000.0,
+           hist_percentile(hist, 99.9) / 1000.0,
+           hist->max / 1000.0,
+           errors, unfinished);
+
+    return 0;
+}
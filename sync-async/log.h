@@ -0,0 +1,318 @@
+/*
+ * log.h
+ *
+ * Leveled logging.
+ * - The servers used to printf on every event. Formatting and writing
+ *   to stdout, synchronously, costs more than the recv/send it is
+ *   talking about.
+ * - LOG_DEBUG/LOG_INFO/LOG_WARN/LOG_ERROR. Anything below LOG_LEVEL is
+ *   compiled out: the condition is a constant, so the compiler drops
+ *   the call and the arguments are never evaluated. Build with
+ *   -DLOG_LEVEL=LOG_LEVEL_DEBUG to get everything back.
+ * - What is left does not write to stdout from the calling thread.
+ *   The line is formatted into a ring buffer owned by the calling
+ *   thread (single producer, single consumer - no locks). A background
+ *   thread drains all the rings and writes the lines out in batches.
+ * - If a ring is full, the line is dropped and counted. A slow disk
+ *   should not slow down the server.
+ * - LOG_ERROR is written right away, after whatever is still in the
+ *   rings, so that it comes out in order. It is rare, and often comes
+ *   just before an exit(). log_init() also has exit() drain the rings,
+ *   so the lines that led up to it aren't lost.
+ * - The drainer sleeps longer and longer while there is nothing to
+ *   write, up to 100 ms. An idle server shouldn't wake up 1000 times
+ *   a second just for its log.
+ * - Lines go to the file named by the LOG_FILE environment variable,
+ *   stdout otherwise.
+ *
+ * Header only. Just #include it and call log_init() once.
+ */
+#ifndef __LOG_H__
+#define __LOG_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+
+#define LOG_LEVEL_DEBUG     0
+#define LOG_LEVEL_INFO      1
+#define LOG_LEVEL_WARN      2
+#define LOG_LEVEL_ERROR     3
+#define LOG_LEVEL_NONE      4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL           LOG_LEVEL_INFO
+#endif
+
+// Longest line. Longer ones are cut.
+#define LOG_LINE_MAX        248
+
+// Lines per thread ring. Power of 2.
+#define LOG_RING_LINES      1024
+
+// Drainer's sleep when there is nothing to write. Starts at the
+// shortest and doubles up to the longest while it stays that way.
+#define LOG_IDLE_MIN_NS     1000000
+#define LOG_IDLE_MAX_NS     100000000
+
+#define LOG_DEBUG(...)  do { if (LOG_LEVEL <= LOG_LEVEL_DEBUG) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__); } while (0)
+#define LOG_INFO(...)   do { if (LOG_LEVEL <= LOG_LEVEL_INFO) log_write(LOG_LEVEL_INFO, __VA_ARGS__); } while (0)
+#define LOG_WARN(...)   do { if (LOG_LEVEL <= LOG_LEVEL_WARN) log_write(LOG_LEVEL_WARN, __VA_ARGS__); } while (0)
+#define LOG_ERROR(...)  do { if (LOG_LEVEL <= LOG_LEVEL_ERROR) log_write(LOG_LEVEL_ERROR, __VA_ARGS__); } while (0)
+
+typedef struct log_line
+{
+    uint32_t        len;
+    char            text[LOG_LINE_MAX];
+} log_line_t;
+
+// One per thread that logs.
+typedef struct log_ring
+{
+    // tail: next line the thread writes. head: next line the
+    // drainer reads. Both only go up; slot = value & mask.
+    uint64_t        head;
+    uint64_t        tail;
+
+    // Lines lost because the ring was full. The drainer
+    // reports them once it gets to the ring.
+    uint64_t        dropped;
+    uint64_t        dropped_reported;
+
+    struct log_ring *next;
+    log_line_t      lines[LOG_RING_LINES];
+} log_ring_t;
+
+// All the rings. Rings are added at the front, never removed.
+static log_ring_t           *log_rings = NULL;
+static FILE                 *log_fp = NULL;
+static __thread log_ring_t  *log_my_ring = NULL;
+
+// Each ring has one reader at a time. Usually that's the drainer
+// thread, but an error or exit() drains too.
+static pthread_mutex_t      log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *log_level_names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+
+// Finds (or creates) the calling thread's ring.
+static inline log_ring_t* log_ring_get ()
+{
+    log_ring_t  *ring = log_my_ring;
+
+    if (ring != NULL)
+    {
+        return ring;
+    }
+
+    ring = calloc(1, sizeof(log_ring_t));
+    if (ring == NULL)
+    {
+        return NULL;
+    }
+
+    // Push it on the list. Other threads might be doing the same.
+    ring->next = __atomic_load_n(&log_rings, __ATOMIC_RELAXED);
+    while (__atomic_compare_exchange_n(&log_rings, &ring->next, ring, true,
+                                       __ATOMIC_RELEASE, __ATOMIC_RELAXED) == false)
+    {
+    }
+
+    log_my_ring = ring;
+    return ring;
+}
+
+static inline uint64_t log_drain_locked ();
+
+static inline void log_write (int level, const char *fmt, ...)
+{
+    log_ring_t      *ring = NULL;
+    log_line_t      *line = NULL;
+    log_line_t      direct;
+    uint64_t        tail = 0;
+    va_list         args;
+    int             len = 0;
+
+    // Rare and important. Straight out, but after what this
+    // thread (and everybody else) queued before it.
+    if (level >= LOG_LEVEL_ERROR || log_fp == NULL)
+    {
+        len = snprintf(direct.text, LOG_LINE_MAX, "[%s] ", log_level_names[level]);
+        va_start(args, fmt);
+        len += vsnprintf(direct.text + len, LOG_LINE_MAX - len, fmt, args);
+        va_end(args);
+        if (len >= LOG_LINE_MAX)
+        {
+            len = LOG_LINE_MAX - 1;
+        }
+        if (log_fp == NULL)
+        {
+            // No rings yet.
+            fwrite(direct.text, 1, len, stdout);
+            fflush(stdout);
+            return;
+        }
+        pthread_mutex_lock(&log_drain_lock);
+        log_drain_locked();
+        fwrite(direct.text, 1, len, log_fp);
+        fflush(log_fp);
+        pthread_mutex_unlock(&log_drain_lock);
+        return;
+    }
+
+    ring = log_ring_get();
+    if (ring == NULL)
+    {
+        return;
+    }
+
+    // Full? Drop it.
+    tail = ring->tail;
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == LOG_RING_LINES)
+    {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    line = &ring->lines[tail & (LOG_RING_LINES - 1)];
+    len = snprintf(line->text, LOG_LINE_MAX, "[%s] ", log_level_names[level]);
+    va_start(args, fmt);
+    len += vsnprintf(line->text + len, LOG_LINE_MAX - len, fmt, args);
+    va_end(args);
+    line->len = (len < LOG_LINE_MAX) ? len : LOG_LINE_MAX - 1;
+
+    // Hand it over to the drainer.
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Writes out whatever is in the rings.
+// Returns the number of lines written. Caller holds log_drain_lock.
+static inline uint64_t log_drain_locked ()
+{
+    log_ring_t  *ring = NULL;
+    uint64_t    head = 0;
+    uint64_t    tail = 0;
+    uint64_t    count = 0;
+    uint64_t    dropped = 0;
+    log_line_t  *line = NULL;
+
+    for (ring = __atomic_load_n(&log_rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+    {
+        head = ring->head;
+        tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+        for (; head < tail; head++)
+        {
+            line = &ring->lines[head & (LOG_RING_LINES - 1)];
+            fwrite(line->text, 1, line->len, log_fp);
+            count += 1;
+        }
+
+        // Slots are free again.
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+        dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+        if (dropped != ring->dropped_reported)
+        {
+            fprintf(log_fp, "[WARN] log: %lu lines dropped\n", dropped - ring->dropped_reported);
+            ring->dropped_reported = dropped;
+            count += 1;
+        }
+    }
+
+    if (count)
+    {
+        fflush(log_fp);
+    }
+    return count;
+}
+
+static inline uint64_t log_drain ()
+{
+    uint64_t    count = 0;
+
+    pthread_mutex_lock(&log_drain_lock);
+    count = log_drain_locked();
+    pthread_mutex_unlock(&log_drain_lock);
+    return count;
+}
+
+// For atexit(). It wants a void function.
+static void log_drain_at_exit ()
+{
+    log_drain();
+}
+
+static void* log_run (void *arg)
+{
+    struct timespec     idle = {0, LOG_IDLE_MIN_NS};
+
+    (void)arg;
+
+    while (1)
+    {
+        if (log_drain() > 0)
+        {
+            // Busy. Lines are likely to keep coming.
+            idle.tv_nsec = LOG_IDLE_MIN_NS;
+            continue;
+        }
+
+        // Nothing to do. Check back later, and the longer
+        // it stays quiet, the later.
+        nanosleep(&idle, NULL);
+        idle.tv_nsec *= 2;
+        if (idle.tv_nsec > LOG_IDLE_MAX_NS)
+        {
+            idle.tv_nsec = LOG_IDLE_MAX_NS;
+        }
+    }
+
+    return NULL;
+}
+
+// Opens the log file and starts the drainer thread.
+// Till this is called, everything is written right away.
+static inline int log_init ()
+{
+    const char  *path = getenv("LOG_FILE");
+    pthread_t   tinfo;
+    FILE        *fp = stdout;
+
+    if (LOG_LEVEL >= LOG_LEVEL_ERROR)
+    {
+        // Only errors. They are written right away anyway.
+        return 0;
+    }
+
+    if (path != NULL)
+    {
+        // Lines go out in batches. stdio buffers them
+        // till log_drain flushes.
+        fp = fopen(path, "a");
+        if (fp == NULL)
+        {
+            printf("fopen() failed for %s\n", path);
+            return -1;
+        }
+    }
+
+    log_fp = fp;
+
+    if (pthread_create(&tinfo, NULL, log_run, NULL) != 0)
+    {
+        printf("pthread_create() failed\n");
+        log_fp = NULL;
+        return -1;
+    }
+    pthread_detach(tinfo);
+
+    // Whatever is queued when somebody calls exit() goes out.
+    atexit(log_drain_at_exit);
+    return 0;
+}
+
+#endif /* __LOG_H__ */
@@ -0,0 +1,219 @@
+/*
+ * out_ring.h
+ *
+ * Per-connection outbound ring buffer.
+ * - With a blocking send, one client which reads slowly stalls
+ *   the whole event loop. Every other client waits behind it.
+ * - With a non-blocking send, the kernel takes what fits in the
+ *   socket's send buffer and returns EAGAIN for the rest.
+ *   The rest is parked here till the socket is writable again.
+ * - The server stops reading from a connection once the ring is
+ *   above OUT_RING_HIGH_WATER and starts again once it drains
+ *   below OUT_RING_LOW_WATER. A client that doesn't read its
+ *   responses can't make us buffer without limit.
+ * - Memory is allocated when something has to be parked and freed
+ *   once the ring is empty. So a connection which keeps up with
+ *   us holds no ring at all. It comes from malloc, unless the server
+ *   defines OUT_RING_ALLOC/OUT_RING_RELEASE before including this
+ *   (echo_server_v4.c takes it from its buf_pool.h).
+ * - Not thread-safe. A connection is served by one thread at a time.
+ *
+ * Header only. Just #include it.
+ */
+#ifndef __OUT_RING_H__
+#define __OUT_RING_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// Size of the ring. Power of 2, so that wrapping is a mask.
+#define OUT_RING_CAPACITY       65536
+
+// Stop reading from the connection at or above this.
+#define OUT_RING_HIGH_WATER     49152
+
+// Start reading again once we are at or below this.
+#define OUT_RING_LOW_WATER      16384
+
+// Where ring memory comes from. OUT_RING_ALLOC() hands out
+// OUT_RING_CAPACITY bytes or NULL.
+#ifndef OUT_RING_ALLOC
+#define OUT_RING_ALLOC()            malloc(OUT_RING_CAPACITY)
+#define OUT_RING_RELEASE(data)      free(data)
+#endif
+
+typedef struct out_ring
+{
+    // NULL while the ring is empty.
+    uint8_t         *data;
+
+    // head is where the next send starts, tail is where the next
+    // byte is parked. Both only go up; position = value & mask.
+    // tail - head is the number of bytes waiting.
+    uint64_t        head;
+    uint64_t        tail;
+} out_ring_t;
+
+static inline uint64_t out_ring_len (out_ring_t *ring)
+{
+    return ring->tail - ring->head;
+}
+
+static inline uint64_t out_ring_space (out_ring_t *ring)
+{
+    return OUT_RING_CAPACITY - out_ring_len(ring);
+}
+
+static inline void out_ring_free (out_ring_t *ring)
+{
+    if (ring->data != NULL)
+    {
+        OUT_RING_RELEASE(ring->data);
+    }
+    memset(ring, '\0', sizeof(out_ring_t));
+}
+
+// Parks len bytes at the tail.
+// Caller makes sure they fit - see out_ring_space.
+static inline void out_ring_push (out_ring_t *ring, const uint8_t *buf, uint64_t len)
+{
+    uint64_t    pos = 0;
+    uint64_t    first = 0;
+
+    if (ring->data == NULL)
+    {
+        ring->data = OUT_RING_ALLOC();
+        if (ring->data == NULL)
+        {
+            // No memory - system may not be doing good.
+            // kill the server.
+            printf("malloc() failed. Exiting...\n");
+            exit(-1);
+        }
+    }
+
+    // The free part might wrap around the end.
+    pos = ring->tail & (OUT_RING_CAPACITY - 1);
+    first = OUT_RING_CAPACITY - pos;
+    if (first > len)
+    {
+        first = len;
+    }
+    memcpy(ring->data + pos, buf, first);
+    memcpy(ring->data, buf + first, len - first);
+    ring->tail += len;
+}
+
+// Receives straight into the free part of the ring - one readv,
+// no copy through a buffer of our own. What comes in is parked
+// like out_ring_push parks it.
+// Returns what recv returns. Reads at most space bytes.
+static inline ssize_t out_ring_recv (out_ring_t *ring, int fd, uint64_t space)
+{
+    struct iovec    iov[2];
+    struct msghdr   msg = {0};
+    uint64_t        pos = 0;
+    ssize_t         ret = 0;
+
+    if (space > out_ring_space(ring))
+    {
+        space = out_ring_space(ring);
+    }
+
+    if (ring->data == NULL)
+    {
+        ring->data = OUT_RING_ALLOC();
+        if (ring->data == NULL)
+        {
+            printf("malloc() failed. Exiting...\n");
+            exit(-1);
+        }
+    }
+
+    // The free part might wrap around the end.
+    pos = ring->tail & (OUT_RING_CAPACITY - 1);
+    iov[0].iov_base = ring->data + pos;
+    iov[0].iov_len = OUT_RING_CAPACITY - pos;
+    if (iov[0].iov_len > space)
+    {
+        iov[0].iov_len = space;
+    }
+    iov[1].iov_base = ring->data;
+    iov[1].iov_len = space - iov[0].iov_len;
+
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (iov[1].iov_len > 0) ? 2 : 1;
+
+    ret = recvmsg(fd, &msg, MSG_DONTWAIT);
+    if (ret > 0)
+    {
+        ring->tail += ret;
+    }
+    else if (out_ring_len(ring) == 0)
+    {
+        // Nothing came in, nothing to hold on to.
+        out_ring_free(ring);
+    }
+    return ret;
+}
+
+// Sends as much of the ring as the socket takes.
+// Returns 0 if the socket is full or the ring is empty,
+// -1 if send failed for real.
+static inline int out_ring_flush (out_ring_t *ring, int fd)
+{
+    struct iovec    iov[2];
+    struct msghdr   msg = {0};
+    uint64_t        pos = 0;
+    uint64_t        len = 0;
+    ssize_t         ret = 0;
+
+    while (out_ring_len(ring) > 0)
+    {
+        // Waiting bytes might wrap around the end.
+        // One sendmsg with two pieces.
+        pos = ring->head & (OUT_RING_CAPACITY - 1);
+        len = out_ring_len(ring);
+
+        iov[0].iov_base = ring->data + pos;
+        iov[0].iov_len = OUT_RING_CAPACITY - pos;
+        if (iov[0].iov_len > len)
+        {
+            iov[0].iov_len = len;
+        }
+        iov[1].iov_base = ring->data;
+        iov[1].iov_len = len - iov[0].iov_len;
+
+        memset(&msg, '\0', sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (iov[1].iov_len > 0) ? 2 : 1;
+
+        ret = sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (ret < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                // Socket is full. Wait for it to be writable.
+                return 0;
+            }
+            else if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+
+        ring->head += ret;
+    }
+
+    // All gone. Give the memory back.
+    out_ring_free(ring);
+    return 0;
+}
+
+#endif /* __OUT_RING_H__ */
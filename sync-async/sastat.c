@@ -0,0 +1,209 @@
+/*
+ * sastat.c
+ *
+ * Watches a running server's counters, vmstat style.
+ * - The server keeps them in /dev/shm/sastat.<port> (stats.h). We map
+ *   that file read-only and, every interval, add up all threads'
+ *   counters and print how much each one moved per second.
+ * - Reading costs the server nothing. It doesn't know we are here.
+ * - If the server is restarted, the file is replaced. We notice the
+ *   new file and start over with it.
+ *
+ * Usage: $ ./sastat [port] [interval-seconds] [count]
+ *   e.g. $ ./sastat 8000
+ *        $ ./sastat 8000 5 10
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "stats.h"
+
+// Print the column names again after these many lines.
+#define HEADER_EVERY    20
+
+// A mapped stats block, and which file it came from.
+typedef struct watched
+{
+    stats_block_t   *block;
+    uint64_t        size;
+    ino_t           inode;
+} watched_t;
+
+uint64_t now_ns ()
+{
+    struct timespec     ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Maps the stats file. Returns -1 if it isn't there (yet).
+int watched_open (watched_t *watched, const char *path)
+{
+    int             fd = -1;
+    struct stat     st;
+    void            *map = MAP_FAILED;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return -1;
+    }
+
+    if (fstat(fd, &st) == 0 && (uint64_t)st.st_size >= sizeof(stats_block_t))
+    {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+    if (map == MAP_FAILED)
+    {
+        return -1;
+    }
+
+    watched->block = map;
+    watched->size = st.st_size;
+    watched->inode = st.st_ino;
+
+    // Half written, or not a stats file at all.
+    if (__atomic_load_n(&watched->block->header.magic, __ATOMIC_ACQUIRE) != STATS_MAGIC ||
+        stats_size(watched->block->header.threads) > watched->size)
+    {
+        munmap(watched->block, watched->size);
+        watched->block = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void watched_close (watched_t *watched)
+{
+    if (watched->block != NULL)
+    {
+        munmap(watched->block, watched->size);
+        watched->block = NULL;
+    }
+}
+
+// All threads' counters, added up.
+void sum_counters (watched_t *watched, stats_counters_t *sum)
+{
+    uint32_t            i = 0;
+    stats_counters_t    *counters = NULL;
+
+    memset(sum, '\0', sizeof(stats_counters_t));
+    for (i = 0; i < watched->block->header.threads; i++)
+    {
+        counters = &watched->block->thread[i];
+        sum->conns += STATS_LOAD(counters, conns);
+        sum->accepts += STATS_LOAD(counters, accepts);
+        sum->bytes_in += STATS_LOAD(counters, bytes_in);
+        sum->bytes_out += STATS_LOAD(counters, bytes_out);
+        sum->errors += STATS_LOAD(counters, errors);
+        sum->timeouts += STATS_LOAD(counters, timeouts);
+        sum->slots += STATS_LOAD(counters, slots);
+        sum->capacity += STATS_LOAD(counters, capacity);
+    }
+}
+
+void print_header ()
+{
+    printf("%8s %9s %11s %11s %7s %7s %9s %9s\n",
+           "conns", "accept/s", "in(KB/s)", "out(KB/s)", "err/s", "tmo/s", "slots", "capacity");
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 2 || argc > 4)
+    {
+        printf("Usage: $ %s [port] [interval-seconds] [count]\n", argv[0]);
+        return 0;
+    }
+
+    char                path[64];
+    uint16_t            port_no = atoi(argv[1]);
+    uint64_t            interval = (argc > 2) ? strtoull(argv[2], NULL, 10) : 1;
+    uint64_t            count = (argc > 3) ? strtoull(argv[3], NULL, 10) : 0;
+    uint64_t            printed = 0;
+    uint64_t            start = 0;
+    uint64_t            end = 0;
+    double              seconds = 0;
+    watched_t           watched = {0};
+    stats_counters_t    prev = {0};
+    stats_counters_t    cur = {0};
+    struct stat         st;
+
+    if (interval == 0)
+    {
+        printf("interval should be positive\n");
+        return -1;
+    }
+
+    snprintf(path, sizeof(path), STATS_PATH_FORMAT, port_no);
+    if (watched_open(&watched, path) < 0)
+    {
+        printf("No server stats at %s\n", path);
+        return -1;
+    }
+
+    while (1)
+    {
+        printf("%s (pid %d), %u threads\n", watched.block->header.server,
+               watched.block->header.pid, watched.block->header.threads);
+        sum_counters(&watched, &prev);
+        start = now_ns();
+
+        while (1)
+        {
+            sleep(interval);
+
+            // Restarted? The file we have mapped is not the
+            // server's any more.
+            if (stat(path, &st) < 0 || st.st_ino != watched.inode)
+            {
+                break;
+            }
+
+            if (printed % HEADER_EVERY == 0)
+            {
+                print_header();
+            }
+
+            sum_counters(&watched, &cur);
+            end = now_ns();
+            seconds = (double)(end - start) / 1e9;
+
+            // conns, slots and capacity are gauges. The rest count up.
+            printf("%8lu %9.0f %11.1f %11.1f %7.0f %7.0f %9lu %9lu\n",
+                   cur.conns,
+                   (cur.accepts - prev.accepts) / seconds,
+                   (cur.bytes_in - prev.bytes_in) / seconds / 1024,
+                   (cur.bytes_out - prev.bytes_out) / seconds / 1024,
+                   (cur.errors - prev.errors) / seconds,
+                   (cur.timeouts - prev.timeouts) / seconds,
+                   cur.slots, cur.capacity);
+            fflush(stdout);
+
+            printed += 1;
+            if (count != 0 && printed == count)
+            {
+                return 0;
+            }
+            prev = cur;
+            start = end;
+        }
+
+        // Wait for the new one.
+        watched_close(&watched);
+        printf("%s went away, waiting for a new one\n", path);
+        while (watched_open(&watched, path) < 0)
+        {
+            sleep(interval);
+        }
+        printed = 0;
+    }
+}
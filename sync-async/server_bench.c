@@ -0,0 +1,167 @@
+/*
+ * server_bench.c
+ *
+ * Requests/sec benchmark for the single request-response servers
+ * (server_v1.c, server_v2.c, server_v3.c, server_v5.c, server_v6.c).
+ *
+ * - Starts N client threads. Each one does connect, send a request,
+ *   wait for the response, close - in a loop, for the given duration.
+ * - That is exactly one request per connection, which is what
+ *   these servers serve.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+static struct sockaddr_in   server_addr;
+static volatile bool        stop = false;
+
+// Per-thread results.
+typedef struct client
+{
+    pthread_t       tinfo;
+    uint64_t        requests;
+    uint64_t        errors;
+} client_t;
+
+// Does one request-response on a new connection.
+// Returns 0 on success.
+int do_request ()
+{
+    int             sock_fd = 0;
+    int             ret = 0;
+    int             one = 1;
+    uint8_t         response_buffer[64];
+    struct linger   lin = {1, 0};
+
+    ret = socket(AF_INET, SOCK_STREAM, 0);
+    if (ret < 0)
+    {
+        return -1;
+    }
+    sock_fd = ret;
+
+    // Reset instead of a graceful close, so that the client side
+    // doesn't run out of ports due to TIME_WAIT.
+    setsockopt(sock_fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+    setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    ret = connect(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        close(sock_fd);
+        return -1;
+    }
+
+    ret = send(sock_fd, "Hello from client!", 19, 0);
+    if (ret < 19)
+    {
+        close(sock_fd);
+        return -1;
+    }
+
+    // The servers reply with "Hello from server!" and close.
+    ret = recv(sock_fd, response_buffer, sizeof(response_buffer), MSG_WAITALL);
+    close(sock_fd);
+    if (ret < 19)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+void* client_run (void *arg)
+{
+    client_t    *client = arg;
+
+    while (stop == false)
+    {
+        if (do_request() == 0)
+        {
+            client->requests += 1;
+        }
+        else
+        {
+            client->errors += 1;
+        }
+    }
+
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc != 5)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number] [concurrency] [seconds]\n", argv[0]);
+        return 0;
+    }
+
+    int                 ret = 0;
+    int                 i = 0;
+    int                 concurrency = atoi(argv[3]);
+    int                 seconds = atoi(argv[4]);
+    client_t            *clients = NULL;
+    uint64_t            requests = 0;
+    uint64_t            errors = 0;
+    struct timespec     start = {0};
+    struct timespec     end = {0};
+    double              elapsed = 0;
+
+    if (concurrency <= 0 || seconds <= 0)
+    {
+        printf("concurrency and seconds should be positive\n");
+        return -1;
+    }
+
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    clients = calloc(concurrency, sizeof(client_t));
+    if (clients == NULL)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < concurrency; i++)
+    {
+        ret = pthread_create(&clients[i].tinfo, NULL, client_run, &clients[i]);
+        if (ret != 0)
+        {
+            printf("pthread_create() failed\n");
+            return -1;
+        }
+    }
+
+    sleep(seconds);
+    stop = true;
+
+    for (i = 0; i < concurrency; i++)
+    {
+        pthread_join(clients[i].tinfo, NULL);
+        requests += clients[i].requests;
+        errors += clients[i].errors;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%lu requests, %lu errors in %.2f s: %.0f requests/sec\n",
+           requests, errors, elapsed, requests / elapsed);
+
+    return 0;
+}
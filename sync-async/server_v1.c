@@ -16,18 +16,20 @@
 
 void serve_connection (int client_fd)
 {   
-    uint8_t         request_buffer[10000] = {0};
-    uint8_t         response_buffer[10000] = {0};
+    uint8_t         request_buffer[10000];
     int             ret = 0;
 
     // Only one request response!
-    ret = recv(client_fd, request_buffer, sizeof(request_buffer), 0);
+    ret = recv(client_fd, request_buffer, sizeof(request_buffer) - 1, 0);
     if (ret < 0)
     {
         printf("recv() failed for fd = %d\n", ret);
         return;
     }
 
+    // recv left a byte for this.
+    request_buffer[ret] = '\0';
+
     // Print the request (symbolic of processing the request)
     printf("%d: %s\n", client_fd, request_buffer);
 
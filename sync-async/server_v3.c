@@ -24,21 +24,22 @@ pid_t gettid()
 
 void* serve_connection (void *client_fd)
 {   
-    uint8_t         request_buffer[10000] = {0};
-    uint8_t         response_buffer[10000] = {0};
+    uint8_t         request_buffer[10000];
     int             ret = 0;
     int             fd = *(int *)client_fd;
 
     printf("Serving client with fd: %d using thread with tid = %d, pid = %d\n", fd, gettid(), getpid());
 
     // Only one request response!
-    ret = recv(fd, request_buffer, sizeof(request_buffer), 0);
+    ret = recv(fd, request_buffer, sizeof(request_buffer) - 1, 0);
     if (ret < 0)
     {
         printf("recv() failed for fd = %d\n", fd);
         return NULL;
     }
 
+    request_buffer[ret] = '\0';
+
     // Print the request (symbolic of processing the request)
     printf("%d: %s\n", fd, request_buffer);
 
@@ -17,15 +17,15 @@
 #include <unistd.h>
 #include <sys/select.h>
 #include <stdbool.h>
+#include "fd_bitmap.h"
 
 void serve_connection (int client_fd)
 {   
-    uint8_t         request_buffer[10000] = {0};
-    uint8_t         response_buffer[10000] = {0};
+    uint8_t         request_buffer[10000];
     int             ret = 0;
 
     // Only one request response!
-    ret = recv(client_fd, request_buffer, sizeof(request_buffer), 0);
+    ret = recv(client_fd, request_buffer, sizeof(request_buffer) - 1, 0);
     printf("recv() on fd %d return %d\n", client_fd, ret);
     if (ret < 0)
     {
@@ -33,6 +33,8 @@ void serve_connection (int client_fd)
         return;
     }
 
+    request_buffer[ret] = '\0';
+
     // Print the request (symbolic of processing the request)
     printf("%d: %s\n", client_fd, request_buffer);
 
@@ -63,12 +65,10 @@ int main (int argc, char **argv)
     int                 ret = 0;
     int                 i = 0;
     struct sockaddr_in  server_addr = {0};
-    struct sockaddr_in  client_addr = {0};
-    socklen_t           client_addr_len = 0;
     const char          *ip_addr = argv[1];
     uint16_t            port_no = atoi(argv[2]);
-    fd_set              read_set = {0};
-    bool                fds_list[FD_SETSIZE] = {false};
+    fd_bitmap_t         watch_set = {0};
+    fd_bitmap_t         read_set = {0};
 
     // Lets create a socket.
     ret = socket(AF_INET, SOCK_STREAM, 0);
@@ -101,19 +101,33 @@ int main (int argc, char **argv)
     printf("Listening at (%s, %u)\n", ip_addr, port_no);
 
     // Before entering, initialize everything we need to call select.
-    // This set is passed to select, it gets altered when select succeeds.
-    FD_ZERO(&read_set);
+    // watch_set has every descriptor we want select to monitor.
+    // read_set is what we pass to select, it gets altered when select succeeds.
+    // Both grow as bigger descriptors show up. See fd_bitmap.h
+    if (fd_bitmap_init(&watch_set) < 0 || fd_bitmap_init(&read_set) < 0)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+    if (fd_bitmap_reserve(&watch_set, sock_fd) < 0)
+    {
+        printf("realloc() failed\n");
+        return -1;
+    }
+    fd_bitmap_set(&watch_set, sock_fd);
 
     // Do the thing
     while (1)
     {
-        memset(&client_addr, '\0', sizeof(client_addr));
-
         // Copy.
-        FD_SET(sock_fd, &read_set);
+        if (fd_bitmap_copy(&read_set, &watch_set) < 0)
+        {
+            printf("realloc() failed\n");
+            return -1;
+        }
 
         printf("Waiting for select() to succeed\n");
-        ret = select(FD_SETSIZE, &read_set, NULL, NULL, NULL);
+        ret = select(fd_bitmap_nfds(&watch_set), fd_bitmap_fd_set(&read_set), NULL, NULL, NULL);
         if (ret <= 0)
         {
             printf("select() failed\n");
@@ -121,69 +135,40 @@ int main (int argc, char **argv)
         }
         printf("After select, %d descriptors are ready!\n", ret);
         // Suppose it succeeds, we don't know which sockets are ready.
-        // All the "ready" sockets are set in those sets.
-        // We know the socket value, we need to go over them and see
-        // which one to process first.
-        
-        // If this comes true, that means we have an incoming connection
-        // waiting to be accepted.
-        if (FD_ISSET(sock_fd, &read_set))
-        {   
-            printf("Inside sock_fd if\n");
-            ret = accept(sock_fd, (struct sockaddr *)&client_addr, &client_addr_len);
-            if (ret < 0)
-            {
-                printf("accept4() failed\n");
-                return -1;
-            }
-            client_fd = ret;
-            printf("client_fd = %d\n", client_fd);
-
-            // We want select to keep an eye on this new socket.
-            fds_list[client_fd] = true;
-
-            // When select returns, read_set would be modified
-            // to keep just the "ready" descriptors. A couple of them
-            // might be lost. Need to update read_set before
-            // we pass it to select again.
-            for (i = 0; i < FD_SETSIZE; i++)
+        // All the "ready" sockets are set in read_set.
+        // Go over just those - a word (64 descriptors) at a time.
+        for (i = fd_bitmap_next(&read_set, 0); i >= 0; i = fd_bitmap_next(&read_set, i + 1))
+        {
+            // If this comes true, that means we have an incoming connection
+            // waiting to be accepted.
+            if (i == sock_fd)
             {
-                if (fds_list[i] == true)
+                printf("Inside sock_fd if\n");
+                ret = accept(sock_fd, NULL, NULL);
+                if (ret < 0)
                 {
-                    FD_SET(i, &read_set);
+                    printf("accept4() failed\n");
+                    return -1;
                 }
-            }
-        }
-        else // This should cover all the other socket descriptors
-        {
-            // Should we iterate through our fds_list and check
-            // which descriptor is present in the read/write/error sets?
-            for (i = 0; i < FD_SETSIZE; i++)
-            {   
-                printf("Inside for: %d\n", i);
-                // Check if this socket exists
-                if (fds_list[i] == true)
-                {   printf("Inside if\n");
-                    // If it is ready to read, go for it.
-                    if (FD_ISSET(i, &read_set))
-                    {
-                        printf("FD: %d\n", i);
-                        // Read that data, and send back a response
-                        serve_connection(i);
-                        // close(i);
-                        // FD_CLR(i, &read_set);
-                        // fds_list[i] = false;
-                    }
-                    else
-                    {   
-                        // If it is not ready to be read
-                        // but is a valid descriptor, then
-                        // select should monitor it.
-                        FD_SET(i, &read_set);
-                    }
-                    
+                client_fd = ret;
+                printf("client_fd = %d\n", client_fd);
+
+                // We want select to keep an eye on this new socket.
+                if (fd_bitmap_reserve(&watch_set, client_fd) < 0)
+                {
+                    printf("realloc() failed for fd = %d\n", client_fd);
+                    close(client_fd);
+                    continue;
                 }
+                fd_bitmap_set(&watch_set, client_fd);
+                continue;
             }
+
+            printf("FD: %d\n", i);
+            // Read that data, and send back a response
+            serve_connection(i);
+            // close(i);
+            // fd_bitmap_clear(&watch_set, i);
         }
     }
 }
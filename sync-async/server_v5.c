@@ -0,0 +1,565 @@
+/*
+ * server_v5.c
+ *
+ * Thread pool version of server_v3.c.
+ * - server_v3.c creates a new thread for every connection. Under a
+ *   connection storm that is thousands of threads fighting for the CPU.
+ * - Here a fixed number of worker threads are created upfront.
+ *   The main thread accepts connections and puts the descriptors
+ *   in a bounded queue. Workers take them off the queue and serve them.
+ * - The queue is lock-free and can have any number of producers and
+ *   consumers (MPMC).
+ * - When the queue is full, we either stop accepting (the kernel's
+ *   backlog fills up and clients wait there) or shed load (accept and
+ *   close right away).
+ * - Every worker records how long each connection waited in the queue
+ *   and how long it took to serve (request received -> response sent)
+ *   in its own histograms. Percentiles are printed every 5 seconds
+ *   and on SIGUSR1.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <time.h>
+#include <signal.h>
+#include "hdr_hist.h"
+
+// What to do when the queue is full.
+enum
+{
+    // Don't accept till a worker frees up a slot.
+    POLICY_BLOCK = 0,
+
+    // Accept and close the connection right away.
+    POLICY_SHED,
+};
+
+// One queued connection.
+typedef struct job
+{
+    int             client_fd;
+
+    // When it was queued. Used to find how long it waited.
+    uint64_t        enqueue_ns;
+} job_t;
+
+// One slot of the queue.
+typedef struct cell
+{
+    // Tells the state of the slot.
+    // - seq == pos: Free, a producer at position pos can fill it.
+    // - seq == pos + 1: Filled, a consumer at position pos can take it.
+    uint64_t        seq;
+    job_t           job;
+} cell_t;
+
+// Bounded lock-free MPMC queue (Dmitry Vyukov's design).
+// Producers and consumers claim positions using a CAS on
+// enqueue_pos/dequeue_pos, then use the slot's sequence number to
+// know whether the slot is ready for them.
+typedef struct job_queue
+{
+    cell_t          *cells;
+
+    // Always a power of 2.
+    uint64_t        capacity;
+    uint64_t        mask;
+
+    // Kept on separate cache lines. Producers and consumers
+    // would keep stealing the line from each other otherwise.
+    uint64_t        enqueue_pos __attribute__((aligned(64)));
+    uint64_t        dequeue_pos __attribute__((aligned(64)));
+} job_queue_t;
+
+// Queue statistics. Updated by everybody using atomics.
+typedef struct queue_stats
+{
+    uint64_t        enqueued;
+    uint64_t        dequeued;
+    uint64_t        shed;
+    uint64_t        max_depth;
+    uint64_t        total_wait_ns;
+    uint64_t        max_wait_ns;
+} queue_stats_t;
+
+// Per-worker latency histograms. Only the worker records into them.
+typedef struct worker
+{
+    hist_t          wait;
+    hist_t          service;
+} worker_t;
+
+static job_queue_t      queue;
+static queue_stats_t    stats;
+static int              policy = POLICY_BLOCK;
+static worker_t         *workers = NULL;
+static int              worker_count = 0;
+
+// Number of jobs in the queue. Workers sleep on it.
+static sem_t            jobs_available;
+
+// Number of free slots in the queue. Used by POLICY_BLOCK.
+static sem_t            slots_available;
+
+uint64_t now_ns ()
+{
+    struct timespec     ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Sets max to value if value is bigger.
+void atomic_max (uint64_t *max, uint64_t value)
+{
+    uint64_t    current = __atomic_load_n(max, __ATOMIC_RELAXED);
+
+    while (value > current)
+    {
+        if (__atomic_compare_exchange_n(max, &current, value, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+}
+
+int job_queue_init (job_queue_t *q, uint64_t capacity)
+{
+    uint64_t    i = 0;
+
+    memset(q, '\0', sizeof(job_queue_t));
+
+    // Round it up to a power of 2 so that we can mask
+    // instead of doing a modulo.
+    q->capacity = 2;
+    while (q->capacity < capacity)
+    {
+        q->capacity *= 2;
+    }
+    q->mask = q->capacity - 1;
+
+    q->cells = calloc(q->capacity, sizeof(cell_t));
+    if (q->cells == NULL)
+    {
+        return -1;
+    }
+
+    for (i = 0; i < q->capacity; i++)
+    {
+        q->cells[i].seq = i;
+    }
+    return 0;
+}
+
+// Returns false if the queue is full.
+bool job_queue_push (job_queue_t *q, job_t *job)
+{
+    cell_t      *cell = NULL;
+    uint64_t    pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+    uint64_t    seq = 0;
+    int64_t     diff = 0;
+
+    while (1)
+    {
+        cell = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (int64_t)seq - (int64_t)pos;
+
+        if (diff == 0)
+        {
+            // Slot is free. Try to claim the position.
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+            // pos got updated by the failed CAS. Try again.
+        }
+        else if (diff < 0)
+        {
+            // Slot still has a job from the last lap. Queue is full.
+            return false;
+        }
+        else
+        {
+            // Somebody else took this position.
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->job = *job;
+
+    // Hand over the slot to consumers.
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Returns false if the queue is empty.
+bool job_queue_pop (job_queue_t *q, job_t *job)
+{
+    cell_t      *cell = NULL;
+    uint64_t    pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    uint64_t    seq = 0;
+    int64_t     diff = 0;
+
+    while (1)
+    {
+        cell = &q->cells[pos & q->mask];
+        seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        diff = (int64_t)seq - (int64_t)(pos + 1);
+
+        if (diff == 0)
+        {
+            // Slot has a job. Try to claim the position.
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // Nothing here yet. Queue is empty.
+            return false;
+        }
+        else
+        {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    *job = cell->job;
+
+    // Free the slot for the producer in the next lap.
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void serve_connection (int worker_id, int fd)
+{
+    uint8_t         request_buffer[10000];
+    int             ret = 0;
+    uint64_t        start_ns = 0;
+
+    printf("Serving client with fd: %d using worker %d\n", fd, worker_id);
+
+    // Only one request response!
+    ret = recv(fd, request_buffer, sizeof(request_buffer) - 1, 0);
+    if (ret < 0)
+    {
+        printf("recv() failed for fd = %d\n", fd);
+        return;
+    }
+    // The request is in. Service time starts now.
+    start_ns = now_ns();
+
+    request_buffer[ret] = '\0';
+
+    // Print the request (symbolic of processing the request)
+    printf("%d: %s\n", fd, request_buffer);
+
+    // Send back response
+    ret = send(fd, "Hello from server!", 19, 0);
+    if (ret < 19)
+    {
+        printf("send() failed for fd = %d\n", fd);
+        return;
+    }
+
+    hist_record(&workers[worker_id].service, now_ns() - start_ns);
+}
+
+void* worker_run (void *arg)
+{
+    int         worker_id = (int)(intptr_t)arg;
+    job_t       job = {0};
+    uint64_t    wait_ns = 0;
+
+    while (1)
+    {
+        // Sleep till there is something in the queue.
+        while (sem_wait(&jobs_available) < 0 && errno == EINTR)
+        {
+        }
+
+        // The producer pushes before it posts, so there is a job
+        // for us. The pop can still lose a race for a slot which is
+        // being handed over. Try again in that case.
+        while (job_queue_pop(&queue, &job) == false)
+        {
+            sched_yield();
+        }
+        __atomic_add_fetch(&stats.dequeued, 1, __ATOMIC_RELAXED);
+
+        // Let the acceptor know a slot is free.
+        if (policy == POLICY_BLOCK)
+        {
+            sem_post(&slots_available);
+        }
+
+        wait_ns = now_ns() - job.enqueue_ns;
+        __atomic_add_fetch(&stats.total_wait_ns, wait_ns, __ATOMIC_RELAXED);
+        atomic_max(&stats.max_wait_ns, wait_ns);
+        hist_record(&workers[worker_id].wait, wait_ns);
+
+        serve_connection(worker_id, job.client_fd);
+
+        // Close up the socket.
+        close(job.client_fd);
+    }
+
+    return NULL;
+}
+
+// Merges the per-worker histograms and prints the percentiles.
+void print_latency ()
+{
+    static hist_t   wait;
+    static hist_t   service;
+    int             i = 0;
+
+    hist_init(&wait);
+    hist_init(&service);
+    for (i = 0; i < worker_count; i++)
+    {
+        hist_merge(&wait, &workers[i].wait);
+        hist_merge(&service, &workers[i].service);
+    }
+
+    hist_print(stdout, "queue wait", &wait);
+    hist_print(stdout, "service", &service);
+}
+
+// Prints the queue statistics every few seconds,
+// and latency percentiles on SIGUSR1 as well.
+void* stats_run (void *arg)
+{
+    uint64_t        enqueued = 0;
+    uint64_t        dequeued = 0;
+    uint64_t        shed = 0;
+    uint64_t        total_wait_ns = 0;
+    sigset_t        sigs;
+    struct timespec timeout = {5, 0};
+
+    (void)arg;
+
+    // SIGUSR1 is blocked in every thread (see main).
+    // We pick it up here, where printf is safe.
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+
+    while (1)
+    {
+        if (sigtimedwait(&sigs, NULL, &timeout) == SIGUSR1)
+        {
+            print_latency();
+            fflush(stdout);
+            continue;
+        }
+
+        // dequeued first. Loaded the other way round, jobs which come
+        // and go in between count as dequeued but not enqueued, and
+        // the depth wraps. Even this way a worker can count a job
+        // before the acceptor does (it pushes, then counts), so a
+        // depth "below 0" is shown as 0.
+        dequeued = __atomic_load_n(&stats.dequeued, __ATOMIC_ACQUIRE);
+        enqueued = __atomic_load_n(&stats.enqueued, __ATOMIC_ACQUIRE);
+        shed = __atomic_load_n(&stats.shed, __ATOMIC_RELAXED);
+        total_wait_ns = __atomic_load_n(&stats.total_wait_ns, __ATOMIC_RELAXED);
+
+        printf("stats: queue depth = %lu (max %lu), enqueued = %lu, shed = %lu, "
+               "avg wait = %lu us, max wait = %lu us\n",
+               (enqueued > dequeued) ? enqueued - dequeued : 0,
+               __atomic_load_n(&stats.max_depth, __ATOMIC_RELAXED),
+               enqueued, shed,
+               dequeued ? total_wait_ns / dequeued / 1000 : 0,
+               __atomic_load_n(&stats.max_wait_ns, __ATOMIC_RELAXED) / 1000);
+        print_latency();
+        fflush(stdout);
+    }
+
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 3 || argc > 6)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number] [worker-count] [queue-size] [block|shed]\n", argv[0]);
+        printf("Defaults: 16 workers, 1024 queue slots, block\n");
+        return 0;
+    }
+
+    int                 sock_fd = 0;
+    int                 client_fd = 0;
+    int                 ret = 0;
+    int                 i = 0;
+    struct sockaddr_in  server_addr = {0};
+    const char          *ip_addr = argv[1];
+    uint16_t            port_no = atoi(argv[2]);
+    int                 queue_size = 1024;
+    sigset_t            sigs;
+    pthread_t           tinfo;
+    job_t               job = {0};
+    uint64_t            depth = 0;
+
+    worker_count = 16;
+    if (argc > 3)
+    {
+        worker_count = atoi(argv[3]);
+    }
+    if (argc > 4)
+    {
+        queue_size = atoi(argv[4]);
+    }
+    if (argc > 5)
+    {
+        if (strcmp(argv[5], "shed") == 0)
+        {
+            policy = POLICY_SHED;
+        }
+        else if (strcmp(argv[5], "block") != 0)
+        {
+            printf("Unknown policy %s\n", argv[5]);
+            return -1;
+        }
+    }
+    if (worker_count <= 0 || queue_size <= 0)
+    {
+        printf("worker-count and queue-size should be positive\n");
+        return -1;
+    }
+
+    // Setup the queue and the semaphores.
+    ret = job_queue_init(&queue, queue_size);
+    if (ret < 0)
+    {
+        printf("job_queue_init() failed\n");
+        return -1;
+    }
+    sem_init(&jobs_available, 0, 0);
+    sem_init(&slots_available, 0, queue.capacity);
+
+    // Socket related work.
+    // Lets create a socket.
+    ret = socket(AF_INET, SOCK_STREAM, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    sock_fd = ret;
+
+    // Bind the socket to the passed (ip_address, port_no).
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    ret = bind(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("bind() failed\n");
+        return -1;
+    }
+
+    // Start listening
+    ret = listen(sock_fd, 50);
+    if (ret < 0)
+    {
+        printf("listen() failed\n");
+        return -1;
+    }
+    printf("Listening at (%s, %u) with %d workers, %lu queue slots\n",
+           ip_addr, port_no, worker_count, queue.capacity);
+
+    workers = malloc(sizeof(worker_t) * worker_count);
+    if (workers == NULL)
+    {
+        printf("malloc() failed\n");
+        return -1;
+    }
+    for (i = 0; i < worker_count; i++)
+    {
+        hist_init(&workers[i].wait);
+        hist_init(&workers[i].service);
+    }
+
+    // Only stats_run should get SIGUSR1. Block it here,
+    // the threads we create inherit that.
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    // Spawn the workers upfront.
+    for (i = 0; i < worker_count; i++)
+    {
+        ret = pthread_create(&tinfo, NULL, worker_run, (void *)(intptr_t)i);
+        if (ret != 0)
+        {
+            printf("pthread_create() failed\n");
+            return -1;
+        }
+        pthread_detach(tinfo);
+    }
+
+    ret = pthread_create(&tinfo, NULL, stats_run, NULL);
+    if (ret != 0)
+    {
+        printf("pthread_create() failed\n");
+        return -1;
+    }
+    pthread_detach(tinfo);
+
+    // Do the thing
+    while (1)
+    {
+        if (policy == POLICY_BLOCK)
+        {
+            // Don't accept anything we can't queue.
+            // Connection requests wait in the kernel's backlog meanwhile.
+            while (sem_wait(&slots_available) < 0 && errno == EINTR)
+            {
+            }
+        }
+
+        // Wait till we get a connection request
+        ret = accept(sock_fd, NULL, NULL);
+        if (ret < 0)
+        {
+            printf("accept() failed\n");
+            return -1;
+        }
+        client_fd = ret;
+
+        job.client_fd = client_fd;
+        job.enqueue_ns = now_ns();
+        if (job_queue_push(&queue, &job) == false)
+        {
+            // Only POLICY_SHED gets here.
+            // Everybody is busy and the queue is full. Drop it.
+            close(client_fd);
+            __atomic_add_fetch(&stats.shed, 1, __ATOMIC_RELAXED);
+            continue;
+        }
+
+        depth = __atomic_add_fetch(&stats.enqueued, 1, __ATOMIC_RELAXED) -
+                __atomic_load_n(&stats.dequeued, __ATOMIC_RELAXED);
+        atomic_max(&stats.max_depth, depth);
+
+        // Wake up a worker.
+        sem_post(&jobs_available);
+    }
+}
@@ -0,0 +1,370 @@
+/*
+ * server_v6.c
+ *
+ * Pre-forked version of server_v2.c.
+ * - server_v2.c forks a new process for every connection. That is a
+ *   full fork() + exit() per request.
+ * - Here a fixed number of worker processes are forked upfront. Each
+ *   one serves connections in a loop, one after the other. We still get
+ *   process isolation, without paying for a fork per connection.
+ * - The parent process becomes a supervisor. If a worker dies, it forks
+ *   a new one in its place.
+ * - Two ways of sharing the listening port between workers:
+ *      - serial: All workers inherit the parent's listening socket.
+ *                Only one worker waits in accept() at a time. The
+ *                others wait on a lock shared between the processes.
+ *      - reuseport: Every worker creates its own listening socket
+ *                bound to the same port using SO_REUSEPORT. The kernel
+ *                spreads connections across them.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+// How the workers share the port.
+enum
+{
+    MODE_SERIAL = 0,
+    MODE_REUSEPORT,
+};
+
+// Exit status of a worker which could not even start.
+// There is no point restarting such a worker.
+#define WORKER_SETUP_FAILED     2
+
+static int                  mode = MODE_SERIAL;
+static struct sockaddr_in   server_addr;
+
+// pids of the workers. Index is the worker id.
+static pid_t                *workers = NULL;
+static int                  worker_count = 8;
+
+// Lock around accept() in MODE_SERIAL.
+// Lives in memory shared by all the processes.
+static pthread_mutex_t      *accept_lock = NULL;
+
+void serve_connection (int client_fd)
+{
+    uint8_t         request_buffer[10000];
+    int             ret = 0;
+
+    // Only one request response!
+    ret = recv(client_fd, request_buffer, sizeof(request_buffer) - 1, 0);
+    if (ret < 0)
+    {
+        printf("recv() failed for fd = %d\n", client_fd);
+        return;
+    }
+
+    request_buffer[ret] = '\0';
+
+    // Print the request (symbolic of processing the request)
+    printf("%d: %s\n", client_fd, request_buffer);
+
+    // Send back response
+    ret = send(client_fd, "Hello from server!", 19, 0);
+    if (ret < 19)
+    {
+        printf("send() failed for fd = %d\n", client_fd);
+        return;
+    }
+}
+
+// Creates a listening socket bound to server_addr.
+int create_server_socket (bool reuseport)
+{
+    int     sock_fd = 0;
+    int     ret = 0;
+    int     one = 1;
+
+    ret = socket(AF_INET, SOCK_STREAM, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    sock_fd = ret;
+
+    if (reuseport)
+    {
+        ret = setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        if (ret < 0)
+        {
+            printf("setsockopt(SO_REUSEPORT) failed\n");
+            close(sock_fd);
+            return -1;
+        }
+    }
+
+    ret = bind(sock_fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("bind() failed\n");
+        close(sock_fd);
+        return -1;
+    }
+
+    ret = listen(sock_fd, 50);
+    if (ret < 0)
+    {
+        printf("listen() failed\n");
+        close(sock_fd);
+        return -1;
+    }
+
+    return sock_fd;
+}
+
+// Waits for the accept lock.
+void accept_lock_acquire ()
+{
+    int     ret = pthread_mutex_lock(accept_lock);
+
+    // The previous owner died holding the lock.
+    // There is nothing to repair, accept() keeps no state with us.
+    if (ret == EOWNERDEAD)
+    {
+        pthread_mutex_consistent(accept_lock);
+    }
+}
+
+// Main loop of a worker process. Never returns.
+void worker_run (int worker_id, int sock_fd)
+{
+    int     client_fd = 0;
+    int     ret = 0;
+
+    // In MODE_REUSEPORT, every worker gets its own socket.
+    if (mode == MODE_REUSEPORT)
+    {
+        sock_fd = create_server_socket(true);
+        if (sock_fd < 0)
+        {
+            exit(WORKER_SETUP_FAILED);
+        }
+    }
+
+    printf("Worker %d (pid %d) started\n", worker_id, getpid());
+
+    while (1)
+    {
+        if (mode == MODE_SERIAL)
+        {
+            accept_lock_acquire();
+        }
+
+        ret = accept(sock_fd, NULL, NULL);
+
+        if (mode == MODE_SERIAL)
+        {
+            pthread_mutex_unlock(accept_lock);
+        }
+
+        if (ret < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            printf("Worker %d: accept() failed\n", worker_id);
+            exit(-1);
+        }
+        client_fd = ret;
+
+        // Handle the request
+        serve_connection(client_fd);
+
+        // Close the client socket once done.
+        close(client_fd);
+    }
+}
+
+// Takes the workers down along with the supervisor.
+void stop_workers (int signo)
+{
+    int     i = 0;
+
+    for (i = 0; i < worker_count; i++)
+    {
+        if (workers[i] > 0)
+        {
+            kill(workers[i], SIGTERM);
+        }
+    }
+    _exit(signo == SIGTERM ? 0 : -1);
+}
+
+// Forks a worker. Returns the child's pid to the parent.
+pid_t spawn_worker (int worker_id, int sock_fd)
+{
+    pid_t   pid = fork();
+
+    if (pid == 0) /* Child process */
+    {
+        signal(SIGTERM, SIG_DFL);
+        signal(SIGINT, SIG_DFL);
+        worker_run(worker_id, sock_fd);
+        exit(0);
+    }
+
+    return pid;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 3 || argc > 5)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number] [worker-count] [serial|reuseport]\n", argv[0]);
+        printf("Defaults: 8 workers, serial\n");
+        return 0;
+    }
+
+    int                 sock_fd = -1;
+    int                 ret = 0;
+    int                 i = 0;
+    int                 status = 0;
+    const char          *ip_addr = argv[1];
+    uint16_t            port_no = atoi(argv[2]);
+    pid_t               pid = 0;
+    pthread_mutexattr_t attr;
+
+    if (argc > 3)
+    {
+        worker_count = atoi(argv[3]);
+    }
+    if (argc > 4)
+    {
+        if (strcmp(argv[4], "reuseport") == 0)
+        {
+            mode = MODE_REUSEPORT;
+        }
+        else if (strcmp(argv[4], "serial") != 0)
+        {
+            printf("Unknown mode %s\n", argv[4]);
+            return -1;
+        }
+    }
+    if (worker_count <= 0)
+    {
+        printf("worker-count should be positive\n");
+        return -1;
+    }
+
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    workers = calloc(worker_count, sizeof(pid_t));
+    if (workers == NULL)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+
+    if (mode == MODE_SERIAL)
+    {
+        // One socket, inherited by all the workers.
+        sock_fd = create_server_socket(false);
+        if (sock_fd < 0)
+        {
+            return -1;
+        }
+
+        // The lock has to live in memory which stays shared
+        // across fork(). A robust mutex lets us recover if a
+        // worker dies while holding it.
+        accept_lock = mmap(NULL, sizeof(pthread_mutex_t), PROT_READ | PROT_WRITE,
+                           MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (accept_lock == MAP_FAILED)
+        {
+            printf("mmap() failed\n");
+            return -1;
+        }
+
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        ret = pthread_mutex_init(accept_lock, &attr);
+        if (ret != 0)
+        {
+            printf("pthread_mutex_init() failed\n");
+            return -1;
+        }
+    }
+    printf("Listening at (%s, %u) with %d %s workers\n", ip_addr, port_no,
+           worker_count, mode == MODE_SERIAL ? "serial" : "reuseport");
+
+    // Don't let the children inherit half-printed output.
+    fflush(stdout);
+
+    signal(SIGTERM, stop_workers);
+    signal(SIGINT, stop_workers);
+
+    // Fork all the workers upfront.
+    for (i = 0; i < worker_count; i++)
+    {
+        workers[i] = spawn_worker(i, sock_fd);
+        if (workers[i] < 0)
+        {
+            printf("fork() failed\n");
+            return -1;
+        }
+    }
+
+    // Supervise. Replace any worker that dies.
+    while (1)
+    {
+        pid = wait(&status);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            printf("wait() failed\n");
+            return -1;
+        }
+
+        for (i = 0; i < worker_count; i++)
+        {
+            if (workers[i] == pid)
+            {
+                break;
+            }
+        }
+        if (i == worker_count)
+        {
+            continue;
+        }
+
+        if (WIFEXITED(status) && WEXITSTATUS(status) == WORKER_SETUP_FAILED)
+        {
+            // It will fail again. Kill the server.
+            printf("Worker %d could not start. Exiting...\n", i);
+            fflush(stdout);
+            workers[i] = 0;
+            stop_workers(0);
+        }
+
+        printf("Worker %d (pid %d) died. Restarting it\n", i, pid);
+        fflush(stdout);
+        workers[i] = spawn_worker(i, sock_fd);
+        if (workers[i] < 0)
+        {
+            printf("fork() failed\n");
+            return -1;
+        }
+    }
+}
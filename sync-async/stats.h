@@ -0,0 +1,135 @@
+/*
+ * stats.h
+ *
+ * Live server counters, in shared memory.
+ * - The server creates /dev/shm/sastat.<port> and maps it. Counters
+ *   are plain memory in that mapping. Bumping one is a store - no
+ *   syscall, no lock. sastat.c maps the same file read-only and
+ *   prints rates once a second.
+ * - One stats_counters_t per thread. Only its thread writes it, so
+ *   an update is a load and a store, not a locked add. Relaxed atomic
+ *   stores make sure a reader never sees a torn value; it may see one
+ *   counter a little ahead of another, which is fine for rates.
+ * - Each thread's counters fill exactly one cache line, and the array
+ *   is cache line aligned. Two threads never write the same line, so
+ *   they don't bounce it between their cores.
+ * - If the file can't be created, counters go to private memory
+ *   instead. The server runs the same, it just can't be watched.
+ *
+ * Header only. Just #include it.
+ */
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#define STATS_MAGIC         0x5341535441543031ULL   // "SASTAT01"
+#define STATS_CACHE_LINE    64
+
+// Where the stats of the server on port p live. sastat.c
+// finds them the same way.
+#define STATS_PATH_FORMAT   "/dev/shm/sastat.%u"
+
+// One thread's counters. Exactly one cache line.
+typedef struct stats_counters
+{
+    // Gauge: connections open right now.
+    uint64_t        conns;
+
+    uint64_t        accepts;
+    uint64_t        bytes_in;
+    uint64_t        bytes_out;
+
+    // Connections closed because recv/send failed or poll/epoll
+    // reported an error.
+    uint64_t        errors;
+
+    // Connections closed because they missed a deadline.
+    uint64_t        timeouts;
+
+    // Gauges: descriptor slots in use and allocated (pfds_t count
+    // and capacity in echo_server_v3.c). 0 where there is no such thing.
+    uint64_t        slots;
+    uint64_t        capacity;
+} __attribute__((aligned(STATS_CACHE_LINE))) stats_counters_t;
+
+typedef struct stats_header
+{
+    // Written last. Till it is STATS_MAGIC, the rest isn't ready.
+    uint64_t        magic;
+    uint32_t        threads;
+    int32_t         pid;
+    char            server[32];
+} __attribute__((aligned(STATS_CACHE_LINE))) stats_header_t;
+
+typedef struct stats_block
+{
+    stats_header_t      header;
+    stats_counters_t    thread[];
+} stats_block_t;
+
+// Single writer per stats_counters_t. See the top of the file.
+#define STATS_ADD(counters, field, n)   \
+    __atomic_store_n(&(counters)->field, (counters)->field + (n), __ATOMIC_RELAXED)
+#define STATS_SET(counters, field, v)   \
+    __atomic_store_n(&(counters)->field, (v), __ATOMIC_RELAXED)
+#define STATS_LOAD(counters, field)     \
+    __atomic_load_n(&(counters)->field, __ATOMIC_RELAXED)
+
+static inline uint64_t stats_size (uint32_t threads)
+{
+    return sizeof(stats_block_t) + (uint64_t)threads * sizeof(stats_counters_t);
+}
+
+// Creates the stats block of the server on port, with counters
+// for threads threads. Never returns NULL.
+static inline stats_block_t* stats_open (const char *server, uint16_t port, uint32_t threads)
+{
+    char            path[64];
+    int             fd = -1;
+    uint64_t        size = stats_size(threads);
+    stats_block_t   *block = MAP_FAILED;
+
+    snprintf(path, sizeof(path), STATS_PATH_FORMAT, port);
+
+    // Whatever a previous server on this port left behind goes.
+    // Anybody who still has it mapped keeps the old one.
+    unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (fd >= 0 && ftruncate(fd, size) == 0)
+    {
+        block = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if (fd >= 0)
+    {
+        // The mapping stays without it.
+        close(fd);
+    }
+
+    if (block == MAP_FAILED)
+    {
+        printf("Couldn't create %s, stats won't be visible\n", path);
+        block = aligned_alloc(STATS_CACHE_LINE, size);
+        if (block == NULL)
+        {
+            printf("aligned_alloc() failed. Exiting...\n");
+            exit(-1);
+        }
+    }
+
+    // A fresh file is all zeroes already. Private memory isn't.
+    memset(block, '\0', size);
+    block->header.threads = threads;
+    block->header.pid = getpid();
+    snprintf(block->header.server, sizeof(block->header.server), "%s", server);
+    __atomic_store_n(&block->header.magic, STATS_MAGIC, __ATOMIC_RELEASE);
+    return block;
+}
+
+#endif /* __STATS_H__ */
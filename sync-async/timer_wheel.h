@@ -0,0 +1,357 @@
+/*
+ * timer_wheel.h
+ *
+ * Hierarchical timing wheel.
+ * - Every connection gets a deadline, and the deadline moves on every
+ *   read or write. With a sorted structure (heap, tree) that is
+ *   O(log n) each time. Here arming, re-arming and cancelling are O(1):
+ *   unlink from one list, link into another.
+ * - Time is in ticks of 1ms. Level 0 has 64 slots of 1 tick, level 1
+ *   has 64 slots of 64 ticks, and so on. 4 levels cover 64^4 ticks,
+ *   a bit over 4.5 hours. Longer deadlines are cut to that.
+ * - A timer goes to the lowest level that can hold its distance from
+ *   now. Every 64 ticks, the next level 1 slot is due and its timers
+ *   move down (cascade) - most of them to level 0. Every 64^2 ticks,
+ *   the same happens for a level 2 slot, and so on.
+ * - Every slot is a doubly linked list of timer ids. Ids are indices
+ *   into an array (for the servers - the descriptor), not pointers.
+ *   So the array can grow with realloc like the connection tables.
+ * - Every level keeps a 64 bit map of its non-empty slots. Finding
+ *   the next time something might be due (the poll timeout) is a
+ *   few count-trailing-zeros, not a scan.
+ * - Not thread-safe. One event loop owns a wheel.
+ *
+ * Header only. Just #include it.
+ */
+#ifndef __TIMER_WHEEL_H__
+#define __TIMER_WHEEL_H__
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define TW_LEVELS           4
+#define TW_SLOT_BITS        6
+#define TW_SLOTS            (1 << TW_SLOT_BITS)
+
+// Longest deadline we can hold, in ticks.
+#define TW_MAX_DELTA        ((1ULL << (TW_LEVELS * TW_SLOT_BITS)) - 1)
+
+// No timer. Ends every list.
+#define TW_NONE             -1
+
+// The expired list sits "below" the levels.
+#define TW_EXPIRED_LEVEL    TW_LEVELS
+
+typedef struct tw_node
+{
+    uint64_t        expires;
+    int32_t         prev;
+    int32_t         next;
+
+    // Which list the timer is on.
+    uint8_t         level;
+    uint8_t         slot;
+    bool            armed;
+} tw_node_t;
+
+typedef struct tw
+{
+    // Indexed by timer id. Grows on demand - see tw_reserve.
+    tw_node_t       *nodes;
+    uint64_t        capacity;
+
+    int32_t         heads[TW_LEVELS][TW_SLOTS];
+    uint64_t        occupied[TW_LEVELS];
+
+    // Timers which are due, till tw_pop_expired hands them out.
+    int32_t         expired;
+
+    // Every tick up to and including this one is processed.
+    uint64_t        current;
+
+    // Timers on the levels (not the expired ones).
+    uint64_t        count;
+} tw_t;
+
+static inline void tw_init (tw_t *tw, uint64_t now)
+{
+    int     level = 0;
+    int     slot = 0;
+
+    memset(tw, '\0', sizeof(tw_t));
+    for (level = 0; level < TW_LEVELS; level++)
+    {
+        for (slot = 0; slot < TW_SLOTS; slot++)
+        {
+            tw->heads[level][slot] = TW_NONE;
+        }
+    }
+    tw->expired = TW_NONE;
+    tw->current = now;
+}
+
+// Makes sure the wheel can hold timer id.
+// New ids start out disarmed.
+static inline int tw_reserve (tw_t *tw, uint32_t id)
+{
+    uint64_t    new_capacity = 0;
+    tw_node_t   *temp = NULL;
+
+    if (id < tw->capacity)
+    {
+        return 0;
+    }
+
+    new_capacity = tw->capacity ? tw->capacity : 1024;
+    while (new_capacity <= id)
+    {
+        new_capacity *= 2;
+    }
+
+    temp = realloc(tw->nodes, sizeof(tw_node_t) * new_capacity);
+    if (temp == NULL)
+    {
+        return -1;
+    }
+    memset(temp + tw->capacity, '\0', sizeof(tw_node_t) * (new_capacity - tw->capacity));
+
+    tw->nodes = temp;
+    tw->capacity = new_capacity;
+    return 0;
+}
+
+static inline int32_t* tw_head (tw_t *tw, uint8_t level, uint8_t slot)
+{
+    return (level == TW_EXPIRED_LEVEL) ? &tw->expired : &tw->heads[level][slot];
+}
+
+static inline void tw_link (tw_t *tw, int32_t id, uint8_t level, uint8_t slot)
+{
+    tw_node_t   *node = &tw->nodes[id];
+    int32_t     *head = tw_head(tw, level, slot);
+
+    node->level = level;
+    node->slot = slot;
+    node->prev = TW_NONE;
+    node->next = *head;
+    if (*head != TW_NONE)
+    {
+        tw->nodes[*head].prev = id;
+    }
+    *head = id;
+
+    if (level != TW_EXPIRED_LEVEL)
+    {
+        tw->occupied[level] |= 1ULL << slot;
+        tw->count += 1;
+    }
+}
+
+static inline void tw_unlink (tw_t *tw, int32_t id)
+{
+    tw_node_t   *node = &tw->nodes[id];
+    int32_t     *head = tw_head(tw, node->level, node->slot);
+
+    if (node->prev != TW_NONE)
+    {
+        tw->nodes[node->prev].next = node->next;
+    }
+    else
+    {
+        *head = node->next;
+    }
+    if (node->next != TW_NONE)
+    {
+        tw->nodes[node->next].prev = node->prev;
+    }
+
+    if (node->level != TW_EXPIRED_LEVEL)
+    {
+        if (*head == TW_NONE)
+        {
+            tw->occupied[node->level] &= ~(1ULL << node->slot);
+        }
+        tw->count -= 1;
+    }
+}
+
+// Puts an (unlinked) timer where its deadline says.
+static inline void tw_place (tw_t *tw, int32_t id)
+{
+    uint64_t    expires = tw->nodes[id].expires;
+    uint64_t    delta = expires - tw->current;
+    uint8_t     level = 0;
+
+    while (level < TW_LEVELS - 1 && delta >= (1ULL << ((level + 1) * TW_SLOT_BITS)))
+    {
+        level += 1;
+    }
+    tw_link(tw, id, level, (expires >> (level * TW_SLOT_BITS)) & (TW_SLOTS - 1));
+}
+
+// Timer id fires at tick expires. If it is already armed,
+// the old deadline is forgotten.
+static inline void tw_arm (tw_t *tw, uint32_t id, uint64_t expires)
+{
+    tw_node_t   *node = &tw->nodes[id];
+
+    if (node->armed)
+    {
+        tw_unlink(tw, id);
+    }
+
+    // Already due? It goes out with the next tick.
+    if (expires <= tw->current)
+    {
+        expires = tw->current + 1;
+    }
+    if (expires - tw->current > TW_MAX_DELTA)
+    {
+        expires = tw->current + TW_MAX_DELTA;
+    }
+
+    node->expires = expires;
+    node->armed = true;
+    tw_place(tw, id);
+}
+
+static inline void tw_cancel (tw_t *tw, uint32_t id)
+{
+    if (id < tw->capacity && tw->nodes[id].armed)
+    {
+        tw_unlink(tw, id);
+        tw->nodes[id].armed = false;
+    }
+}
+
+// Moves every timer of a slot one level down (or to level 0).
+static inline void tw_cascade (tw_t *tw, uint8_t level, uint8_t slot)
+{
+    int32_t     id = tw->heads[level][slot];
+    int32_t     next = TW_NONE;
+
+    tw->heads[level][slot] = TW_NONE;
+    tw->occupied[level] &= ~(1ULL << slot);
+
+    for (; id != TW_NONE; id = next)
+    {
+        next = tw->nodes[id].next;
+        tw->count -= 1;
+        tw_place(tw, id);
+    }
+}
+
+// Processes every tick up to now. Timers which are due go on the
+// expired list - see tw_pop_expired.
+static inline void tw_advance (tw_t *tw, uint64_t now)
+{
+    uint64_t    t = 0;
+    uint8_t     level = 0;
+    uint8_t     slot = 0;
+    int32_t     id = TW_NONE;
+
+    while (tw->current < now)
+    {
+        // Nothing on the wheel. Nothing to do for the ticks in between.
+        if (tw->count == 0)
+        {
+            tw->current = now;
+            break;
+        }
+
+        // Nothing on level 0. Skip to the end of its round - the
+        // next tick after that is where the next cascade happens.
+        if (tw->occupied[0] == 0)
+        {
+            t = tw->current | (TW_SLOTS - 1);
+            if (t > tw->current)
+            {
+                tw->current = (t < now) ? t : now;
+                continue;
+            }
+        }
+
+        t = ++tw->current;
+
+        // Higher levels first. Their timers may land on the levels
+        // below, whose slots are up right after.
+        for (level = TW_LEVELS - 1; level > 0; level--)
+        {
+            if ((t & ((1ULL << (level * TW_SLOT_BITS)) - 1)) == 0)
+            {
+                tw_cascade(tw, level, (t >> (level * TW_SLOT_BITS)) & (TW_SLOTS - 1));
+            }
+        }
+
+        // Everything in this level 0 slot is due.
+        slot = t & (TW_SLOTS - 1);
+        while ((id = tw->heads[0][slot]) != TW_NONE)
+        {
+            tw_unlink(tw, id);
+            tw_link(tw, id, TW_EXPIRED_LEVEL, 0);
+        }
+    }
+}
+
+// Hands out one expired timer. TW_NONE if there are no more.
+// The timer is disarmed.
+static inline int32_t tw_pop_expired (tw_t *tw)
+{
+    int32_t     id = tw->expired;
+
+    if (id != TW_NONE)
+    {
+        tw_unlink(tw, id);
+        tw->nodes[id].armed = false;
+    }
+    return id;
+}
+
+// Ticks till something might be due: a timer expires or a slot
+// cascades. -1 if the wheel is empty. Good as a poll timeout.
+static inline int64_t tw_timeout (tw_t *tw, uint64_t now)
+{
+    uint64_t    best = UINT64_MAX;
+    uint64_t    group = 0;
+    uint64_t    at = 0;
+    uint64_t    map = 0;
+    uint32_t    start = 0;
+    uint8_t     level = 0;
+
+    if (tw->expired != TW_NONE)
+    {
+        return 0;
+    }
+    if (tw->count == 0)
+    {
+        return -1;
+    }
+
+    for (level = 0; level < TW_LEVELS; level++)
+    {
+        if (tw->occupied[level] == 0)
+        {
+            continue;
+        }
+
+        // Slots come up in order starting right after the current
+        // one. Rotate the map so that bit 0 is that slot.
+        group = (tw->current >> (level * TW_SLOT_BITS)) + 1;
+        start = group & (TW_SLOTS - 1);
+        map = tw->occupied[level];
+        map = (map >> start) | (start ? map << (TW_SLOTS - start) : 0);
+
+        at = (group + __builtin_ctzll(map)) << (level * TW_SLOT_BITS);
+        if (at < best)
+        {
+            best = at;
+        }
+    }
+
+    return (best > now) ? (int64_t)(best - now) : 0;
+}
+
+#endif /* __TIMER_WHEEL_H__ */
@@ -0,0 +1,308 @@
+/*
+ * udp_load_gen.c
+ *
+ * Packets/sec benchmark for echo_server_v11.c.
+ *
+ * - Each thread has its own connected UDP socket, so its own source
+ *   port. With SO_REUSEPORT on the server, different threads can land
+ *   on different server threads.
+ * - A thread keeps up to --window datagrams in flight. It sends them
+ *   --batch at a time with sendmmsg() and reads the echoes --batch at
+ *   a time with recvmmsg(). --batch 1 is one syscall per datagram.
+ * - UDP can drop. If nothing comes back for 10ms, whatever is still
+ *   in flight is counted as lost and the thread starts sending again.
+ * - Only the size of each echo is checked, not its bytes.
+ *   load_gen.c does that for the TCP servers.
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+
+// recvmmsg()/sendmmsg() take at most these many messages.
+#define MAX_BATCH           1024
+
+// How long to wait for an echo before giving up on what is in flight.
+#define LOSS_TIMEOUT_MS     10
+
+typedef struct client
+{
+    int                 fd;
+
+    struct mmsghdr      *out;
+    struct mmsghdr      *in;
+    struct iovec        *iov;
+    uint8_t             *bufs;
+
+    int64_t             in_flight;
+
+    uint64_t            sent;
+    uint64_t            received;
+    uint64_t            lost;
+    uint64_t            bad_size;
+    uint64_t            send_calls;
+    uint64_t            recv_calls;
+
+    pthread_t           tinfo;
+} client_t;
+
+static struct sockaddr_in   server_addr;
+static volatile bool        stop = false;
+static int                  batch = 32;
+static int                  window = 256;
+static uint32_t             payload_size = 64;
+
+uint64_t now_ns ()
+{
+    struct timespec     ts = {0};
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+int client_init (client_t *client)
+{
+    int     i = 0;
+    int     ret = 0;
+
+    ret = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (ret < 0)
+    {
+        printf("socket() failed\n");
+        return -1;
+    }
+    client->fd = ret;
+
+    // Connected: no address per datagram, and only the
+    // server's datagrams come to us.
+    ret = connect(client->fd, (const struct sockaddr *)&server_addr, sizeof(server_addr));
+    if (ret < 0)
+    {
+        printf("connect() failed\n");
+        return -1;
+    }
+
+    client->out = calloc(batch, sizeof(struct mmsghdr));
+    client->in = calloc(batch, sizeof(struct mmsghdr));
+    client->iov = calloc(batch, sizeof(struct iovec));
+    client->bufs = calloc(batch, payload_size);
+    if (client->out == NULL || client->in == NULL || client->iov == NULL || client->bufs == NULL)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+
+    // The same buffers go out and come back in. We don't look at
+    // what is in them anyway.
+    for (i = 0; i < batch; i++)
+    {
+        memset(client->bufs + (size_t)i * payload_size, 'a' + i % 26, payload_size);
+        client->iov[i].iov_base = client->bufs + (size_t)i * payload_size;
+        client->iov[i].iov_len = payload_size;
+        client->out[i].msg_hdr.msg_iov = &client->iov[i];
+        client->out[i].msg_hdr.msg_iovlen = 1;
+        client->in[i].msg_hdr.msg_iov = &client->iov[i];
+        client->in[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    return 0;
+}
+
+void* client_run (void *arg)
+{
+    client_t        *client = arg;
+    struct pollfd   pfd = {0};
+    int             ret = 0;
+    int             count = 0;
+    int             i = 0;
+
+    pfd.fd = client->fd;
+    pfd.events = POLLIN;
+
+    while (stop == false)
+    {
+        // Fill up the window.
+        while (client->in_flight + batch <= window)
+        {
+            ret = sendmmsg(client->fd, client->out, batch, 0);
+            client->send_calls += 1;
+            if (ret < 0)
+            {
+                if (errno == EINTR || errno == ENOBUFS || errno == ECONNREFUSED)
+                {
+                    break;
+                }
+                printf("sendmmsg() failed, errno = %d\n", errno);
+                return NULL;
+            }
+            client->sent += ret;
+            client->in_flight += ret;
+        }
+
+        ret = recvmmsg(client->fd, client->in, batch, MSG_DONTWAIT, NULL);
+        client->recv_calls += 1;
+        if (ret > 0)
+        {
+            count = ret;
+            for (i = 0; i < count; i++)
+            {
+                if (client->in[i].msg_len != payload_size)
+                {
+                    client->bad_size += 1;
+                }
+            }
+            client->received += count;
+
+            // An echo we already counted as lost might still show up.
+            client->in_flight -= count;
+            if (client->in_flight < 0)
+            {
+                client->in_flight = 0;
+            }
+            continue;
+        }
+        else if (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+                 errno != EINTR && errno != ECONNREFUSED)
+        {
+            printf("recvmmsg() failed, errno = %d\n", errno);
+            return NULL;
+        }
+
+        // Nothing there. Wait for a bit before writing off
+        // what is in flight.
+        if (client->in_flight > 0 && poll(&pfd, 1, LOSS_TIMEOUT_MS) == 0)
+        {
+            client->lost += client->in_flight;
+            client->in_flight = 0;
+        }
+    }
+
+    return NULL;
+}
+
+int main (int argc, char **argv)
+{
+    if (argc < 4)
+    {
+        printf("Usage: $ %s [host-ipv4-address] [port-number] [seconds] "
+               "[--threads N] [--batch B] [--window W] [--size BYTES]\n", argv[0]);
+        return 0;
+    }
+
+    int                 ret = 0;
+    int                 i = 0;
+    int                 seconds = atoi(argv[3]);
+    int                 thread_count = 1;
+    client_t            *clients = NULL;
+    uint64_t            sent = 0;
+    uint64_t            received = 0;
+    uint64_t            lost = 0;
+    uint64_t            bad_size = 0;
+    uint64_t            send_calls = 0;
+    uint64_t            recv_calls = 0;
+    uint64_t            start = 0;
+    double              elapsed = 0;
+
+    for (i = 4; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc)
+        {
+            thread_count = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+        {
+            batch = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc)
+        {
+            window = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc)
+        {
+            payload_size = atoi(argv[++i]);
+        }
+        else
+        {
+            printf("Unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    if (seconds <= 0 || thread_count <= 0 || payload_size == 0)
+    {
+        printf("seconds, threads and size should be positive\n");
+        return -1;
+    }
+    if (batch <= 0 || batch > MAX_BATCH || window < batch)
+    {
+        printf("batch should be in [1, %d] and window at least batch\n", MAX_BATCH);
+        return -1;
+    }
+
+    server_addr.sin_port = htons(atoi(argv[2]));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(argv[1]);
+
+    clients = calloc(thread_count, sizeof(client_t));
+    if (clients == NULL)
+    {
+        printf("calloc() failed\n");
+        return -1;
+    }
+
+    for (i = 0; i < thread_count; i++)
+    {
+        if (client_init(&clients[i]) < 0)
+        {
+            return -1;
+        }
+    }
+
+    start = now_ns();
+    for (i = 0; i < thread_count; i++)
+    {
+        ret = pthread_create(&clients[i].tinfo, NULL, client_run, &clients[i]);
+        if (ret != 0)
+        {
+            printf("pthread_create() failed\n");
+            return -1;
+        }
+    }
+
+    sleep(seconds);
+    stop = true;
+
+    for (i = 0; i < thread_count; i++)
+    {
+        pthread_join(clients[i].tinfo, NULL);
+        sent += clients[i].sent;
+        received += clients[i].received;
+        lost += clients[i].lost;
+        bad_size += clients[i].bad_size;
+        send_calls += clients[i].send_calls;
+        recv_calls += clients[i].recv_calls;
+    }
+    elapsed = (now_ns() - start) / 1e9;
+
+    printf("batch %d, window %d, %d threads, %u byte datagrams\n", batch, window, thread_count, payload_size);
+    printf("%lu sent, %lu echoed, %lu lost, %lu wrong size in %.2f s: %.0f echoes/sec\n",
+           sent, received, lost, bad_size, elapsed, received / elapsed);
+    printf("%.1f datagrams per sendmmsg(), %.1f per recvmmsg()\n",
+           send_calls ? (double)sent / send_calls : 0.0,
+           recv_calls ? (double)received / recv_calls : 0.0);
+
+    // One line for scripts.
+    printf("RESULT %.0f %lu\n", received / elapsed, lost);
+
+    return 0;
+}